@@ -22,6 +22,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <getopt.h>
 
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -74,18 +75,319 @@ int demo_buffer_sync(struct demo_buffer *buffer, long flags)
 	return 0;
 }
 
-int demo_buffer_sync_begin(struct demo_buffer *buffer)
+static unsigned int demo_buffer_size(struct demo_buffer *buffer)
 {
-	long flags = demo_buffer_sync_flags(buffer);
+	unsigned int length;
+	unsigned int size = 0;
+	unsigned int i;
+
+	for (i = 0; i < buffer->planes_count; i++) {
+		v4l2_buffer_plane_length(&buffer->buffer, i, &length);
+		size += length;
+	}
+
+	return size;
+}
+
+static void demo_buffer_unmap_planes(struct demo_buffer *buffer,
+				     unsigned int planes_count)
+{
+	unsigned int length;
+	unsigned int i;
+
+	for (i = 0; i < planes_count; i++) {
+		v4l2_buffer_plane_length(&buffer->buffer, i, &length);
+		munmap(buffer->data[i], length);
+		buffer->data[i] = NULL;
+	}
+}
+
+static int demo_buffer_map_planes(struct demo_buffer *buffer)
+{
+	unsigned int offset;
+	unsigned int length;
+	unsigned int i;
+	void *data;
+	int flags;
+	int fd;
+
+	/* Device mappings are not faulted in by mlockall. */
+	flags = MAP_SHARED;
+	if (buffer->maps->populate)
+		flags |= MAP_POPULATE;
+
+	for (i = 0; i < buffer->planes_count; i++) {
+		v4l2_buffer_plane_length(&buffer->buffer, i, &length);
+
+		/* Map dma-buf fds when available or driver memory otherwise. */
+		if (buffer->dma_buf_fd[i] >= 0) {
+			fd = buffer->dma_buf_fd[i];
+			offset = 0;
+		} else {
+			fd = buffer->video_fd;
+			v4l2_buffer_plane_offset(&buffer->buffer, i, &offset);
+		}
+
+		data = mmap(NULL, length, PROT_READ | PROT_WRITE, flags, fd,
+			    offset);
+		if (data == MAP_FAILED) {
+			demo_buffer_unmap_planes(buffer, i);
+			return -ENOMEM;
+		}
+
+		buffer->data[i] = data;
+	}
+
+	return 0;
+}
+
+static void demo_buffer_maps_remove(struct demo_buffer_maps *maps,
+				    struct demo_buffer *buffer)
+{
+	if (buffer->maps_prev)
+		buffer->maps_prev->maps_next = buffer->maps_next;
+	else
+		maps->first = buffer->maps_next;
+
+	if (buffer->maps_next)
+		buffer->maps_next->maps_prev = buffer->maps_prev;
+	else
+		maps->last = buffer->maps_prev;
+
+	buffer->maps_prev = NULL;
+	buffer->maps_next = NULL;
+}
+
+static void demo_buffer_maps_append(struct demo_buffer_maps *maps,
+				    struct demo_buffer *buffer)
+{
+	buffer->maps_prev = maps->last;
+	buffer->maps_next = NULL;
+
+	if (maps->last)
+		maps->last->maps_next = buffer;
+	else
+		maps->first = buffer;
+
+	maps->last = buffer;
+}
+
+/* Drop idle mappings, least recently used first, until size fits. */
+static void demo_buffer_maps_evict(struct demo_buffer_maps *maps,
+				   size_t size_max)
+{
+	struct demo_buffer *buffer = maps->first;
+	struct demo_buffer *buffer_next;
+
+	while (buffer && maps->size > size_max) {
+		buffer_next = buffer->maps_next;
+
+		if (!buffer->access_count) {
+			demo_buffer_maps_remove(maps, buffer);
+			demo_buffer_unmap_planes(buffer, buffer->planes_count);
+
+			buffer->mapped = false;
+			maps->size -= demo_buffer_size(buffer);
+		}
+
+		buffer = buffer_next;
+	}
+}
+
+static int demo_buffer_map_locked(struct demo_buffer_maps *maps,
+				  struct demo_buffer *buffer)
+{
+	unsigned int size = demo_buffer_size(buffer);
+	int ret;
+
+	/* User memory is always mapped. */
+	if (buffer->buffer.memory == V4L2_MEMORY_USERPTR)
+		return 0;
+
+	if (buffer->mapped) {
+		/* Keep the list ordered by last access. */
+		demo_buffer_maps_remove(maps, buffer);
+		demo_buffer_maps_append(maps, buffer);
+		return 0;
+	}
+
+	if (maps->size_max && maps->size + size > maps->size_max)
+		demo_buffer_maps_evict(maps, maps->size_max > size ?
+					     maps->size_max - size : 0);
+
+	ret = demo_buffer_map_planes(buffer);
+	if (ret == -ENOMEM) {
+		/* Drop all idle mappings under memory pressure and retry. */
+		demo_buffer_maps_evict(maps, 0);
+
+		ret = demo_buffer_map_planes(buffer);
+	}
+
+	if (ret)
+		return ret;
+
+	buffer->mapped = true;
+	maps->size += size;
+
+	demo_buffer_maps_append(maps, buffer);
+
+	return 0;
+}
+
+int demo_buffer_map(struct demo_buffer *buffer)
+{
+	int ret;
+
+	if (!buffer || !buffer->maps)
+		return -EINVAL;
+
+	pthread_mutex_lock(&buffer->maps->lock);
+	ret = demo_buffer_map_locked(buffer->maps, buffer);
+	pthread_mutex_unlock(&buffer->maps->lock);
+
+	return ret;
+}
+
+void demo_buffer_unmap(struct demo_buffer *buffer)
+{
+	struct demo_buffer_maps *maps;
+
+	if (!buffer || !buffer->maps)
+		return;
+
+	maps = buffer->maps;
+
+	pthread_mutex_lock(&maps->lock);
+
+	if (buffer->mapped) {
+		demo_buffer_maps_remove(maps, buffer);
+		demo_buffer_unmap_planes(buffer, buffer->planes_count);
+
+		buffer->mapped = false;
+		maps->size -= demo_buffer_size(buffer);
+	}
+
+	pthread_mutex_unlock(&maps->lock);
+}
 
-	return demo_buffer_sync(buffer, flags | DMA_BUF_SYNC_START);
+static struct demo_buffer *demo_buffer_access_target(struct demo_buffer *buffer)
+{
+	if (!buffer->import)
+		return buffer;
+
+	return buffer->import_buffer;
 }
 
-int demo_buffer_sync_finish(struct demo_buffer *buffer)
+int demo_buffer_access_begin_flags(struct demo_buffer *buffer, long flags)
 {
-	long flags = demo_buffer_sync_flags(buffer);
+	struct demo_buffer *map_buffer;
+	struct demo_buffer_maps *maps;
+	unsigned int i;
+	int ret;
+
+	if (!buffer)
+		return -EINVAL;
+
+	map_buffer = demo_buffer_access_target(buffer);
+	if (!map_buffer || !map_buffer->maps)
+		return -EINVAL;
+
+	maps = map_buffer->maps;
+
+	pthread_mutex_lock(&maps->lock);
+
+	ret = demo_buffer_map_locked(maps, map_buffer);
+	if (!ret) {
+		/* Mappings in use are never evicted. */
+		map_buffer->access_count++;
+
+		for (i = 0; i < buffer->planes_count; i++)
+			buffer->data[i] = map_buffer->data[i];
+	}
 
-	return demo_buffer_sync(buffer, flags | DMA_BUF_SYNC_END);
+	pthread_mutex_unlock(&maps->lock);
+
+	if (ret)
+		return ret;
+
+	ret = demo_buffer_sync(map_buffer, flags | DMA_BUF_SYNC_START);
+	if (ret) {
+		pthread_mutex_lock(&maps->lock);
+		map_buffer->access_count--;
+		pthread_mutex_unlock(&maps->lock);
+
+		return ret;
+	}
+
+	return 0;
+}
+
+int demo_buffer_access_begin(struct demo_buffer *buffer)
+{
+	if (!buffer)
+		return -EINVAL;
+
+	return demo_buffer_access_begin_flags(buffer,
+					      demo_buffer_sync_flags(buffer));
+}
+
+int demo_buffer_access_finish_flags(struct demo_buffer *buffer, long flags)
+{
+	struct demo_buffer *map_buffer;
+	struct demo_buffer_maps *maps;
+
+	if (!buffer)
+		return -EINVAL;
+
+	map_buffer = demo_buffer_access_target(buffer);
+	if (!map_buffer || !map_buffer->maps)
+		return -EINVAL;
+
+	maps = map_buffer->maps;
+
+	pthread_mutex_lock(&maps->lock);
+
+	if (map_buffer->access_count)
+		map_buffer->access_count--;
+
+	pthread_mutex_unlock(&maps->lock);
+
+	return demo_buffer_sync(map_buffer, flags | DMA_BUF_SYNC_END);
+}
+
+int demo_buffer_access_finish(struct demo_buffer *buffer)
+{
+	if (!buffer)
+		return -EINVAL;
+
+	return demo_buffer_access_finish_flags(buffer,
+					       demo_buffer_sync_flags(buffer));
+}
+
+int demo_buffer_maps_setup(struct demo_buffer_maps *maps, size_t size_max)
+{
+	int ret;
+
+	if (!maps)
+		return -EINVAL;
+
+	memset(maps, 0, sizeof(*maps));
+
+	ret = pthread_mutex_init(&maps->lock, NULL);
+	if (ret)
+		return -ret;
+
+	maps->size_max = size_max;
+
+	return 0;
+}
+
+void demo_buffer_maps_cleanup(struct demo_buffer_maps *maps)
+{
+	if (!maps)
+		return;
+
+	pthread_mutex_destroy(&maps->lock);
 }
 
 int demo_buffer_setup_base(struct demo_buffer *buffer, int video_fd,
@@ -104,7 +406,13 @@ int demo_buffer_setup_base(struct demo_buffer *buffer, int video_fd,
 			return -EINVAL;
 	}
 
+	buffer->video_fd = video_fd;
 	buffer->planes_count = planes_count;
+	buffer->import = false;
+	buffer->import_buffer = NULL;
+	buffer->mapped = false;
+	buffer->access_count = 0;
+	buffer->maps = NULL;
 
 	for (i = 0; i < planes_count; i++)
 		buffer->dma_buf_fd[i] = -1;
@@ -122,17 +430,20 @@ int demo_buffer_setup_base(struct demo_buffer *buffer, int video_fd,
 	return 0;
 }
 
-int demo_buffer_setup_import(struct demo *demo, struct demo_buffer *buffer,
-			     struct demo_buffer *import_buffer,
-			     int import_video_fd)
+int demo_buffer_import(struct demo_buffer *buffer,
+		       struct demo_buffer *import_buffer)
 {
 	unsigned int import_length;
 	unsigned int length;
 	unsigned int i;
-	void *data;
-	int fd;
 	int ret;
 
+	if (!buffer || !import_buffer || !buffer->import)
+		return -EINVAL;
+
+	if (buffer->import_buffer == import_buffer)
+		return 0;
+
 	if (buffer->planes_count != import_buffer->planes_count)
 		return -EINVAL;
 
@@ -144,92 +455,66 @@ int demo_buffer_setup_import(struct demo *demo, struct demo_buffer *buffer,
 		if (import_length < length)
 			return -EINVAL;
 
-		/* Reuse dma-heap fd if possible or export dma-buf fds. */
-		if (demo->allocator == DEMO_ALLOCATOR_DMA_HEAP) {
-			fd = import_buffer->dma_buf_fd[i];
-			if (fd < 0)
-				return -EINVAL;
-		} else {
-			ret = v4l2_buffer_export(import_video_fd,
-						 &import_buffer->buffer, i,
-						 O_RDWR, &fd);
-			if (ret)
-				return ret;
-
-			/* Duplicate file descriptor for reference count. */
-			buffer->dma_buf_fd[i] = dup(fd);
-		}
-
-		v4l2_buffer_setup_fd(&buffer->buffer, i, fd);
+		/* Rely on the dma-buf fds held by the imported buffer. */
+		if (import_buffer->dma_buf_fd[i] < 0)
+			return -EINVAL;
 
-		data = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED,
-			    fd, 0);
-		if (data == MAP_FAILED) {
-			/* TODO: Cleanup previous mappings on error. */
-			return -ENOMEM;
-		}
+		ret = v4l2_buffer_setup_fd(&buffer->buffer, i,
+					   import_buffer->dma_buf_fd[i]);
+		if (ret)
+			return ret;
 
-		buffer->data[i] = data;
 	}
 
+	buffer->import_buffer = import_buffer;
+
 	return 0;
 }
 
-int demo_buffer_setup_dma_heap(struct demo *demo, struct demo_buffer *buffer,
-			    int video_fd)
+int demo_buffer_export(struct demo_buffer *buffer, int video_fd)
 {
-	unsigned int length;
 	unsigned int i;
-	void *data;
 	int fd;
 	int ret;
 
-	for (i = 0; i < buffer->planes_count; i++) {
-		v4l2_buffer_plane_length(&buffer->buffer, i, &length);
-
-		fd = dma_heap_alloc(demo->dma_heap_fd, length, O_RDWR);
-		if (fd < 0) {
-			/* TODO: Cleanup previous allocations/mappings on error. */
-			return -ENOMEM;
-		}
-
-		buffer->dma_buf_fd[i] = fd;
+	if (!buffer)
+		return -EINVAL;
 
-		v4l2_buffer_setup_fd(&buffer->buffer, i, fd);
+	/* Buffers allocated from a dma-heap already have dma-buf fds. */
+	if (buffer->dma_buf_fd[0] >= 0)
+		return 0;
 
-		data = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED,
-			    fd, 0);
-		if (data == MAP_FAILED) {
-			/* TODO: Cleanup previous mappings on error. */
-			return -ENOMEM;
-		}
+	for (i = 0; i < buffer->planes_count; i++) {
+		ret = v4l2_buffer_export(video_fd, &buffer->buffer, i, O_RDWR,
+					 &fd);
+		if (ret)
+			return ret;
 
-		buffer->data[i] = data;
+		buffer->dma_buf_fd[i] = fd;
 	}
 
 	return 0;
 }
 
-int demo_buffer_setup_v4l2(struct demo *demo, struct demo_buffer *buffer,
-			   int video_fd)
+int demo_buffer_setup_dma_heap(struct demo *demo, struct demo_buffer *buffer,
+			    int video_fd)
 {
-	unsigned int offset;
 	unsigned int length;
 	unsigned int i;
-	void *data;
+	int fd;
 
 	for (i = 0; i < buffer->planes_count; i++) {
-		v4l2_buffer_plane_offset(&buffer->buffer, i, &offset);
 		v4l2_buffer_plane_length(&buffer->buffer, i, &length);
 
-		data = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED,
-			    video_fd, offset);
-		if (data == MAP_FAILED) {
-			/* TODO: Cleanup previous mappings on error. */
+		fd = dma_heap_alloc(demo->dma_heap_fd, length, O_RDWR);
+		if (fd < 0) {
+			/* TODO: Cleanup previous allocations/mappings on error. */
 			return -ENOMEM;
 		}
 
-		buffer->data[i] = data;
+		buffer->dma_buf_fd[i] = fd;
+
+		v4l2_buffer_setup_fd(&buffer->buffer, i, fd);
 	}
 
 	return 0;
@@ -240,8 +525,6 @@ int demo_buffer_setup(struct demo *demo, struct demo_buffer *buffer,
 		      unsigned int index, unsigned int planes_count,
 		      bool import_camera)
 {
-	struct demo_buffer *import_buffer;
-	int import_video_fd;
 	int ret;
 
 	if (!demo || !buffer)
@@ -252,36 +535,54 @@ int demo_buffer_setup(struct demo *demo, struct demo_buffer *buffer,
 	if (ret)
 		return ret;
 
-	if (import_camera) {
-		import_buffer = &demo->camera.capture_buffers[index];
-		import_video_fd = demo->camera.video_fd;
+	buffer->maps = &demo->buffer_maps;
 
-		ret = demo_buffer_setup_import(demo, buffer, import_buffer,
-					       import_video_fd);
+	if (memory == V4L2_MEMORY_USERPTR) {
+		/* User pages are bound at queue time. */
+		ret = 0;
+	} else if (import_camera && memory == V4L2_MEMORY_DMABUF) {
+		/* Camera buffers are bound at queue time. */
+		buffer->import = true;
+		buffer->import_buffer = NULL;
+
+		ret = 0;
+	} else if (memory == V4L2_MEMORY_MMAP ||
+		   demo->allocator == DEMO_ALLOCATOR_V4L2) {
+		/* Driver-allocated memory only needs mapping on CPU access. */
+		ret = 0;
 	} else if (demo->allocator == DEMO_ALLOCATOR_DMA_HEAP) {
 		ret = demo_buffer_setup_dma_heap(demo, buffer, video_fd);
-	} else if (demo->allocator == DEMO_ALLOCATOR_V4L2) {
-		ret = demo_buffer_setup_v4l2(demo, buffer, video_fd);
 	} else {
 		ret = -EINVAL;
 	}
 
+	if (ret)
+		return ret;
+
+	/* Keep first CPU access page faults out of the hot path. */
+	if (buffer->maps->populate && !buffer->import &&
+	    memory != V4L2_MEMORY_USERPTR)
+		ret = demo_buffer_map(buffer);
+
 	return ret;
 }
 
 void demo_buffer_cleanup(struct demo_buffer *buffer)
 {
-	unsigned int length;
 	unsigned int i;
 
 	if (!buffer)
 		return;
 
-	for (i = 0; i < buffer->planes_count; i++) {
-		v4l2_buffer_plane_length(&buffer->buffer, i, &length);
-		munmap(buffer->data[i], length);
-		buffer->data[i] = NULL;
+	/* Imported memory belongs to the imported buffer. */
+	if (buffer->import) {
+		buffer->import_buffer = NULL;
+		return;
+	}
+
+	demo_buffer_unmap(buffer);
 
+	for (i = 0; i < buffer->planes_count; i++) {
 		if (buffer->dma_buf_fd[i] >= 0) {
 			close(buffer->dma_buf_fd[i]);
 			buffer->dma_buf_fd[i] = -1;
@@ -290,7 +591,7 @@ void demo_buffer_cleanup(struct demo_buffer *buffer)
 }
 
 int demo_open_media_decoder(struct udev *udev, const char *media_path,
-			    int *video_fd)
+			    struct demo_decoder *decoder)
 {
 	int function = MEDIA_ENT_F_PROC_VIDEO_DECODER;
 	struct media_device_info device_info = { 0 };
@@ -430,7 +731,12 @@ int demo_open_media_decoder(struct udev *udev, const char *media_path,
 		goto complete;
 	}
 
-	*video_fd = fd;
+	decoder->video_fd = fd;
+
+	snprintf(decoder->device, sizeof(decoder->device), "%.*s\t%.*s\t%.*s",
+		 (int)sizeof(device_info.driver), device_info.driver,
+		 (int)sizeof(device_info.model), device_info.model,
+		 (int)sizeof(device_info.bus_info), device_info.bus_info);
 
 	ret = 0;
 
@@ -558,7 +864,8 @@ int demo_open_media_camera(struct udev *udev, const char *media_path,
 			continue;
 
 		capabilities = 0;
-		ret = v4l2_capabilities_probe(fd, &capabilities, NULL, NULL);
+		ret = v4l2_capabilities_probe(fd, &capabilities, NULL, NULL,
+					      NULL);
 		if (ret)
 			continue;
 
@@ -638,8 +945,7 @@ int demo_open(struct demo *demo)
 		media_path = udev_device_get_devnode(device);
 
 		if (decoder->video_fd < 0)
-			demo_open_media_decoder(udev, media_path,
-						&decoder->video_fd);
+			demo_open_media_decoder(udev, media_path, decoder);
 
 		if (camera->video_fd < 0)
 			demo_open_media_camera(udev, media_path,
@@ -710,6 +1016,13 @@ int demo_setup(struct demo *demo, int source, int allocator, unsigned int width,
 	demo->width = width;
 	demo->height = height;
 
+	ret = demo_buffer_maps_setup(&demo->buffer_maps,
+				     demo->buffer_maps_size_max);
+	if (ret)
+		return ret;
+
+	demo->buffer_maps.populate = demo->realtime.lock;
+
 	if (allocator == DEMO_ALLOCATOR_DMA_HEAP) {
 		fd = dma_heap_open("reserved");
 		if (fd < 0)
@@ -718,6 +1031,10 @@ int demo_setup(struct demo *demo, int source, int allocator, unsigned int width,
 		demo->dma_heap_fd = fd;
 	}
 
+	/* Decoder queues are probed by the camera ahead of decoder setup. */
+	demo->decoder.output_type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	demo->decoder.capture_type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
 	if (source == DEMO_SOURCE_CAMERA) {
 		ret = demo_camera_setup(demo);
 		if (ret) {
@@ -741,56 +1058,63 @@ void demo_cleanup(struct demo *demo)
 		return;
 
 	demo_decoder_cleanup(demo);
+	demo_scheduler_cleanup(demo);
 
 	if (demo->source == DEMO_SOURCE_CAMERA)
 		demo_camera_cleanup(demo);
 
 	if (demo->allocator == DEMO_ALLOCATOR_DMA_HEAP)
 		close(demo->dma_heap_fd);
+
+	demo_buffer_maps_cleanup(&demo->buffer_maps);
 }
 
-int demo_file_read(struct demo *demo)
+int demo_file_read_buffer(struct demo *demo, struct demo_buffer *buffer)
 {
 	struct demo_file *file = &demo->file;
-	struct demo_decoder *decoder = &demo->decoder;
-	struct demo_buffer *buffer;
 	struct perf perf = { 0 };
 	unsigned int plane_index = 0;
 	unsigned int length;
 	void *data;
 	int ret;
 
-	if (!demo)
+	if (!demo || !buffer)
 		return -EINVAL;
 
-	ret = demo_decoder_buffer_current(demo, decoder->output_type, &buffer);
-	if (ret)
-		return ret;
-
-	data = buffer->data[plane_index];
-
 	v4l2_buffer_plane_length(&buffer->buffer, plane_index, &length);
 	if (length < file->size)
 		return -ENOMEM;
 
-	ret = demo_buffer_sync_begin(buffer);
+	ret = demo_buffer_access_begin(buffer);
 	if (ret)
 		return ret;
 
+	data = buffer->data[plane_index];
+
 	perf_before(&perf);
 	ret = read(file->fd, data, file->size);
 	perf_after(&perf);
 
 	if (ret < file->size) {
 		fprintf(stderr, "Failed to read from source file\n");
-		return 1;
+		demo_buffer_access_finish(buffer);
+		return -EIO;
 	}
 
 	printf("Read %u bytes from source file\n", file->size);
 
 	perf_print(&perf, "source read");
 
-	ret = demo_buffer_sync_finish(buffer);
+	if (demo->validate) {
+		ret = demo_mjpeg_validate(demo, data, file->size);
+		if (ret) {
+			demo->frames_rejected++;
+			demo_buffer_access_finish(buffer);
+			return ret;
+		}
+	}
+
+	ret = demo_buffer_access_finish(buffer);
 	if (ret)
 		return ret;
 
@@ -800,6 +1124,22 @@ int demo_file_read(struct demo *demo)
 	return 0;
 }
 
+int demo_file_read(struct demo *demo)
+{
+	struct demo_decoder *decoder = &demo->decoder;
+	struct demo_buffer *buffer;
+	int ret;
+
+	if (!demo)
+		return -EINVAL;
+
+	ret = demo_decoder_buffer_current(demo, decoder->output_type, &buffer);
+	if (ret)
+		return ret;
+
+	return demo_file_read_buffer(demo, buffer);
+}
+
 int demo_file_open(struct demo *demo, char *path)
 {
 	struct demo_file *file = &demo->file;
@@ -845,72 +1185,153 @@ void demo_file_close(struct demo *demo)
 	}
 }
 
-int demo_dump(struct demo *demo, char *dump_path)
+int demo_dump(struct demo *demo)
 {
 	struct demo_decoder *decoder = &demo->decoder;
-	struct perf perf = { 0 };
 	struct demo_buffer *buffer;
-	unsigned int plane_index = 0;
-	unsigned int size;
-	void *data;
-	int fd = -1;
 	int ret;
 
 	ret = demo_decoder_buffer_current(demo, decoder->capture_type, &buffer);
 	if (ret)
 		return ret;
 
-	v4l2_buffer_plane_length_used(&buffer->buffer, plane_index, &size);
-
-	data = buffer->data[plane_index];
-
-	fd = open(dump_path, O_RDWR | O_TRUNC | O_CREAT, 0644);
-	if (dump_path < 0) {
-		fprintf(stderr, "Failed to open dump file\n");
-		return -errno;
-	}
-
-	ret = demo_buffer_sync_begin(buffer);
+	ret = demo_buffer_access_begin(buffer);
 	if (ret)
-		goto complete;
-
-	perf_before(&perf);
-	ret = write(fd, data, size);
-	perf_after(&perf);
+		return ret;
 
-	if (ret < size) {
-		fprintf(stderr, "Failed to write data to output file\n");
-		ret = -EIO;
-		goto complete;
+	ret = demo_sink_write(demo, buffer);
+	if (ret) {
+		demo_buffer_access_finish(buffer);
+		return ret;
 	}
 
-	printf("Wrote %u bytes to dump file %s\n", size, dump_path);
-
-	perf_print(&perf, "dump write");
-
-	ret = demo_buffer_sync_finish(buffer);
-	if (ret)
-		goto complete;
-
-	ret = 0;
-
-complete:
-	if (fd >= 0)
-		close(fd);
+	return demo_buffer_access_finish(buffer);
+}
 
-	return ret;
+static void usage(const char *name)
+{
+	printf("Usage: %s [options] [source files...]\n\n"
+	       "Options:\n"
+	       " -s, --source=camera|file|stream\n"
+	       "                           Frame source (default: camera),\n"
+	       "                           stream is concatenated MJPEG\n"
+	       "                           or a camera record file\n"
+	       " -a, --allocator=v4l2|dma-heap\n"
+	       "                           Buffer allocator (default: dma-heap)\n"
+	       " -W, --width=WIDTH         Frame width (default: 1280)\n"
+	       " -H, --height=HEIGHT       Frame height (default: 720)\n"
+	       " -o, --output=PATH         Dump file path (default: output.yuv),\n"
+	       "                           one file per frame with a %%u pattern\n"
+	       " -p, --pipeline            Run the threaded pipeline\n"
+	       " -n, --frames=COUNT        Camera frames to decode in pipeline\n"
+	       "                           or low-latency mode\n"
+	       " -l, --low-latency         Decode latest camera frame only\n"
+	       " -S, --settle=FRAMES       Start decoding as soon as camera 3A\n"
+	       "                           settles, within a budget of frames\n"
+	       " -F, --max-rate            Prefer camera frame rate over size\n"
+	       " -M, --map-budget=MIB      Maximum size of buffer CPU mappings\n"
+	       " -m, --mmap-output         Decode straight into the mapped dump\n"
+	       "                           file when supported (raw only)\n"
+	       " -f, --format=raw|y4m      Dump file format (default: raw)\n"
+	       " -D, --direct              Write raw dump file with O_DIRECT\n"
+	       " -c, --compress=lz4|zstd   Compress dump file in a framed\n"
+	       "                           container with an index\n"
+	       " -j, --jobs=COUNT          Compression workers (default: CPUs)\n"
+	       " -x, --slices=COUNT        Compressed slices per frame\n"
+	       " -P, --publish=SLOTS       Publish frames to a shared memory\n"
+	       "                           ring instead of the dump file\n"
+	       " -R, --record=PATH         Record camera MJPEG frames to an\n"
+	       "                           indexed file instead of decoding\n"
+	       " -r, --replay-speed=max|FACTOR\n"
+	       "                           Record file replay speed (default: 1)\n"
+	       " -V, --no-validate         Queue frames to the decoder without\n"
+	       "                           checking them first\n"
+	       " -C, --cpu-threads=COUNT   Decode frames unsupported by the\n"
+	       "                           hardware on CPU workers\n"
+	       " -Q, --overflow-depth=COUNT\n"
+	       "                           Also use idle CPU workers with\n"
+	       "                           COUNT frames queued to hardware\n"
+	       " -L, --overflow-latency=US Also use idle CPU workers past this\n"
+	       "                           average hardware latency\n"
+	       " -d, --downscale=2|4|8     Decode frames downscaled, in hardware\n"
+	       "                           or on CPU workers\n"
+	       " -g, --crop=WIDTHxHEIGHT+X+Y\n"
+	       "                           Decode a region of interest only, in\n"
+	       "                           hardware or on CPU workers\n"
+	       " -y, --pixel-format=nv16|nv12|i422|i420|nv12-32l32|nv12-16l16\n"
+	       "                           Dump file pixel format, with the\n"
+	       "                           cheapest capture format to convert\n"
+	       "                           from (default: nv16), tiled ones\n"
+	       "                           only when the decoder writes them\n"
+	       " -b, --benchmark=COUNT     Time the software decoder on source\n"
+	       "                           files, against a bit by bit reference\n"
+	       " -k, --counters            Read CPU performance counters around\n"
+	       "                           timed steps and report them by step\n"
+	       " -A, --cpus=LIST           Pin pipeline threads to CPUs, as a\n"
+	       "                           list of CPUs and ranges (e.g. 2-3)\n"
+	       " -Z, --fifo=PRIORITY       Run pipeline threads with SCHED_FIFO\n"
+	       "                           real-time priority\n"
+	       " -K, --lock-memory         Lock memory and map buffers up front\n"
+	       "                           to avoid page faults while decoding\n"
+	       " -B, --busy-poll=US        Poll for decode completion without\n"
+	       "                           sleeping for up to US microseconds\n"
+	       " -h, --help                Show this help\n", name);
 }
 
 int main(int argc, char *argv[])
 {
 	struct demo demo = { 0 };
+	struct option options[] = {
+		{ "source",	required_argument,	0, 's' },
+		{ "allocator",	required_argument,	0, 'a' },
+		{ "width",	required_argument,	0, 'W' },
+		{ "height",	required_argument,	0, 'H' },
+		{ "output",	required_argument,	0, 'o' },
+		{ "pipeline",	no_argument,		0, 'p' },
+		{ "frames",	required_argument,	0, 'n' },
+		{ "low-latency", no_argument,		0, 'l' },
+		{ "settle",	required_argument,	0, 'S' },
+		{ "max-rate",	no_argument,		0, 'F' },
+		{ "map-budget",	required_argument,	0, 'M' },
+		{ "mmap-output", no_argument,		0, 'm' },
+		{ "format",	required_argument,	0, 'f' },
+		{ "direct",	no_argument,		0, 'D' },
+		{ "compress",	required_argument,	0, 'c' },
+		{ "jobs",	required_argument,	0, 'j' },
+		{ "slices",	required_argument,	0, 'x' },
+		{ "publish",	required_argument,	0, 'P' },
+		{ "record",	required_argument,	0, 'R' },
+		{ "replay-speed", required_argument,	0, 'r' },
+		{ "no-validate", no_argument,		0, 'V' },
+		{ "cpu-threads", required_argument,	0, 'C' },
+		{ "overflow-depth", required_argument,	0, 'Q' },
+		{ "overflow-latency", required_argument, 0, 'L' },
+		{ "downscale",	required_argument,	0, 'd' },
+		{ "crop",	required_argument,	0, 'g' },
+		{ "pixel-format", required_argument,	0, 'y' },
+		{ "benchmark",	required_argument,	0, 'b' },
+		{ "counters",	no_argument,		0, 'k' },
+		{ "cpus",	required_argument,	0, 'A' },
+		{ "fifo",	required_argument,	0, 'Z' },
+		{ "lock-memory", no_argument,		0, 'K' },
+		{ "busy-poll",	required_argument,	0, 'B' },
+		{ "help",	no_argument,		0, 'h' },
+		{ 0 }
+	};
+	const struct demo_format *format;
+	struct demo_buffer *buffer;
+	const void *stream_data;
+	unsigned int stream_size;
+	uint64_t stream_timestamp;
+	unsigned int output_type;
 	unsigned int width;
 	unsigned int height;
 	int source;
 	int allocator;
-	unsigned int dump_size;
 	char *dump_path;
-	int dump_fd;
+	bool pipeline;
+	bool low_latency;
+	int option;
 	int ret;
 
 	dump_path = "output.yuv";
@@ -918,32 +1339,343 @@ int main(int argc, char *argv[])
 	allocator = DEMO_ALLOCATOR_DMA_HEAP;
 	width = 1280;
 	height = 720;
+	pipeline = false;
+	low_latency = false;
+
+	demo.frames_count = 1;
+	demo.sink.fd = -1;
+	demo.stream.fd = -1;
+	demo.shm.fd = -1;
+	demo.record.fd = -1;
+	demo.stream.speed = 1.0;
+	demo.validate = true;
+	demo.compress.threads_count = sysconf(_SC_NPROCESSORS_ONLN);
+	demo.compress.slices_count = 1;
+	demo.decoder.scale = 1;
+	demo.sink.pixel_format = V4L2_PIX_FMT_NV16;
+
+	while (1) {
+		option = getopt_long(argc, argv, "s:a:W:H:o:pn:lS:FM:mf:Dc:j:x:"
+				     "P:R:r:VC:Q:L:d:g:y:b:kA:Z:KB:h", options, NULL);
+		if (option < 0)
+			break;
 
-	if (source == DEMO_SOURCE_FILE) {
-		char *source_path = argv[1];
+		switch (option) {
+		case 's':
+			if (!strcmp(optarg, "camera"))
+				source = DEMO_SOURCE_CAMERA;
+			else if (!strcmp(optarg, "file"))
+				source = DEMO_SOURCE_FILE;
+			else if (!strcmp(optarg, "stream"))
+				source = DEMO_SOURCE_STREAM;
+			else
+				goto usage;
+			break;
+		case 'a':
+			if (!strcmp(optarg, "v4l2"))
+				allocator = DEMO_ALLOCATOR_V4L2;
+			else if (!strcmp(optarg, "dma-heap"))
+				allocator = DEMO_ALLOCATOR_DMA_HEAP;
+			else
+				goto usage;
+			break;
+		case 'W':
+			width = strtoul(optarg, NULL, 0);
+			break;
+		case 'H':
+			height = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			dump_path = optarg;
+			break;
+		case 'p':
+			pipeline = true;
+			break;
+		case 'n':
+			demo.frames_count = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			low_latency = true;
+			break;
+		case 'S':
+			demo.camera.settle_frames_max = strtoul(optarg, NULL,
+								0);
+			break;
+		case 'F':
+			demo.camera.rate_prefer = true;
+			break;
+		case 'M':
+			demo.buffer_maps_size_max =
+				strtoul(optarg, NULL, 0) * 1024 * 1024;
+			break;
+		case 'm':
+			demo.sink.mmap_request = true;
+			break;
+		case 'f':
+			if (!strcmp(optarg, "raw"))
+				demo.sink.format = DEMO_SINK_FORMAT_RAW;
+			else if (!strcmp(optarg, "y4m"))
+				demo.sink.format = DEMO_SINK_FORMAT_Y4M;
+			else
+				goto usage;
+			break;
+		case 'D':
+			demo.sink.direct_request = true;
+			break;
+		case 'c':
+			if (!strcmp(optarg, "lz4"))
+				demo.compress.codec = DEMO_COMPRESS_CODEC_LZ4;
+			else if (!strcmp(optarg, "zstd"))
+				demo.compress.codec = DEMO_COMPRESS_CODEC_ZSTD;
+			else
+				goto usage;
+			break;
+		case 'j':
+			demo.compress.threads_count = strtoul(optarg, NULL, 0);
+			break;
+		case 'x':
+			demo.compress.slices_count = strtoul(optarg, NULL, 0);
+			break;
+		case 'P':
+			demo.shm.slots_count = strtoul(optarg, NULL, 0);
+			break;
+		case 'R':
+			demo.record.path = optarg;
+			break;
+		case 'r':
+			/* Zero speed replays frames as fast as possible. */
+			if (!strcmp(optarg, "max"))
+				demo.stream.speed = 0;
+			else
+				demo.stream.speed = strtod(optarg, NULL);
+
+			if (demo.stream.speed < 0)
+				goto usage;
+			break;
+		case 'V':
+			demo.validate = false;
+			break;
+		case 'C':
+			demo.scheduler.threads_count = strtoul(optarg, NULL, 0);
+			break;
+		case 'Q':
+			demo.scheduler.overflow_depth = strtoul(optarg, NULL,
+								0);
+			break;
+		case 'L':
+			demo.scheduler.overflow_latency = strtoul(optarg, NULL,
+								  0);
+			break;
+		case 'd':
+			demo.decoder.scale = strtoul(optarg, NULL, 0);
+			if (demo.decoder.scale != 2 && demo.decoder.scale != 4 &&
+			    demo.decoder.scale != 8)
+				goto usage;
+			break;
+		case 'y':
+			format = demo_format_find_name(optarg);
+			if (!format)
+				goto usage;
 
-		if (argc < 2)
-			return 1;
+			demo.sink.pixel_format = format->pixel_format;
+			break;
+		case 'g':
+			ret = sscanf(optarg, "%ux%u+%d+%d",
+				     &demo.decoder.crop.width,
+				     &demo.decoder.crop.height,
+				     &demo.decoder.crop.left,
+				     &demo.decoder.crop.top);
+			if (ret != 4 || !demo.decoder.crop.width)
+				goto usage;
+			break;
+		case 'b':
+			demo.benchmark_count = strtoul(optarg, NULL, 0);
+			break;
+		case 'k':
+			perf_counters_enable();
+			break;
+		case 'A':
+			demo.realtime.cpus = optarg;
+			break;
+		case 'Z':
+			demo.realtime.priority = strtol(optarg, NULL, 0);
+			break;
+		case 'K':
+			demo.realtime.lock = true;
+			break;
+		case 'B':
+			demo.decoder.spin_budget = strtoul(optarg, NULL, 0);
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			goto usage;
+		}
+	}
 
-		ret = demo_file_open(&demo, source_path);
-		if (ret)
+	demo.source_paths = &argv[optind];
+	demo.source_paths_count = argc - optind;
+	demo.dump_path = dump_path;
+
+	if (strchr(dump_path, '%') && !demo_sink_pattern_check(dump_path)) {
+		fprintf(stderr, "Dump path pattern needs a single %%u "
+			"conversion\n");
+		return 1;
+	}
+
+	if (low_latency && source != DEMO_SOURCE_CAMERA)
+		goto usage;
+
+	if (demo.record.path &&
+	    (source != DEMO_SOURCE_CAMERA || pipeline || low_latency))
+		goto usage;
+
+	/* Overflow only applies to the hybrid pipeline. */
+	if ((demo.scheduler.threads_count && low_latency) ||
+	    ((demo.scheduler.overflow_depth ||
+	      demo.scheduler.overflow_latency) &&
+	     !demo.scheduler.threads_count))
+		goto usage;
+
+	/* Dump file slots needed when decoding in place. */
+	if (pipeline && source == DEMO_SOURCE_FILE)
+		demo.sink.frames_count = demo.source_paths_count;
+	else if (pipeline || low_latency)
+		demo.sink.frames_count = demo.frames_count;
+	else
+		demo.sink.frames_count = 1;
+
+	/* Decoding in place only works for a single raw file. */
+	if (demo.sink.mmap_request &&
+	    (demo.sink.format != DEMO_SINK_FORMAT_RAW ||
+	     strchr(dump_path, '%')))
+		goto usage;
+
+	if (demo.shm.slots_count &&
+	    (demo.sink.mmap_request ||
+	     demo.compress.codec != DEMO_COMPRESS_CODEC_NONE))
+		goto usage;
+
+	if (demo.compress.codec != DEMO_COMPRESS_CODEC_NONE) {
+		if (!demo_compress_codec_check(demo.compress.codec)) {
+			fprintf(stderr, "Compression codec not built in\n");
 			return 1;
+		}
+
+		/* Compressed frames are stored raw in a single file. */
+		if (demo.sink.mmap_request || demo.sink.direct_request ||
+		    demo.sink.format != DEMO_SINK_FORMAT_RAW ||
+		    strchr(dump_path, '%'))
+			goto usage;
+	}
+
+	/* Evicted mappings would fault again in the hot path. */
+	if (demo.realtime.lock && demo.buffer_maps_size_max)
+		goto usage;
+
+	ret = demo_realtime_setup(&demo);
+	if (ret)
+		return 1;
+
+	/* Benchmarks only run the software decoder, without devices. */
+	if (demo.benchmark_count) {
+		if (source != DEMO_SOURCE_FILE || !demo.source_paths_count)
+			goto usage;
+
+		ret = demo_benchmark_run(&demo);
+
+		return ret ? 1 : 0;
+	}
+
+	if (source == DEMO_SOURCE_FILE) {
+		if (!demo.source_paths_count)
+			goto usage;
+
+		if (!pipeline) {
+			ret = demo_file_open(&demo, demo.source_paths[0]);
+			if (ret)
+				return 1;
+		}
 	}
 
 	ret = demo_open(&demo);
 	if (ret)
 		return 1;
 
+	if (source == DEMO_SOURCE_STREAM && demo.source_paths_count != 1)
+		goto usage;
+
 	ret = demo_setup(&demo, source, allocator, width, height);
 	if (ret)
 		return 1;
 
+	if (source == DEMO_SOURCE_STREAM) {
+		ret = demo_stream_open(&demo, demo.source_paths[0]);
+		if (ret)
+			return 1;
+
+		if (pipeline)
+			demo.sink.frames_count = demo.stream.frames_count;
+	}
+
+	if (demo.record.path) {
+		ret = demo_record_run(&demo);
+		if (ret)
+			return 1;
+
+		goto complete;
+	}
+
+	ret = demo_sink_open(&demo);
+	if (ret)
+		return 1;
+
+	if (pipeline) {
+		ret = demo_pipeline_run(&demo);
+		if (ret)
+			return 1;
+
+		goto complete;
+	}
+
+	if (low_latency) {
+		/* The live loop runs on the main thread. */
+		demo_realtime_self_setup(&demo, "live");
+
+		ret = demo_camera_live(&demo);
+		if (ret)
+			return 1;
+
+		goto complete;
+	}
+
 	if (source == DEMO_SOURCE_FILE) {
 		ret = demo_file_read(&demo);
 		if (ret)
 			return 1;
 
 		demo_file_close(&demo);
+	} else if (source == DEMO_SOURCE_STREAM) {
+		output_type = demo.decoder.output_type;
+
+		ret = demo_stream_frame_next(&demo, &stream_data, &stream_size,
+					     &stream_timestamp);
+		if (ret)
+			return 1;
+
+		if (demo.validate &&
+		    demo_mjpeg_validate(&demo, stream_data, stream_size))
+			return 1;
+
+		ret = demo_decoder_buffer_current(&demo, output_type, &buffer);
+		if (ret)
+			return 1;
+
+		ret = demo_stream_frame_load(&demo, buffer, stream_data,
+					     stream_size, stream_timestamp);
+		if (ret)
+			return 1;
 	} else {
 		ret = demo_camera_roll(&demo);
 		if (ret)
@@ -954,12 +1686,23 @@ int main(int argc, char *argv[])
 	if (ret)
 		return 1;
 
-	ret = demo_dump(&demo, dump_path);
+	ret = demo_dump(&demo);
 	if (ret)
 		return 1;
 
+	perf_ioctl_report(1);
+
+complete:
+	demo_sink_close(&demo);
+	demo_stream_close(&demo);
 	demo_cleanup(&demo);
 	demo_close(&demo);
 
+	perf_report();
+
 	return 0;
+
+usage:
+	usage(argv[0]);
+	return 1;
 }
@@ -18,6 +18,12 @@
 #ifndef _DEMO_H_
 #define _DEMO_H_
 
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "jpeg.h"
+#include "perf.h"
+#include "ring.h"
 #include "v4l2.h"
 
 enum demo_allocator {
@@ -28,6 +34,47 @@ enum demo_allocator {
 enum demo_source {
 	DEMO_SOURCE_FILE,
 	DEMO_SOURCE_CAMERA,
+	DEMO_SOURCE_STREAM,
+};
+
+enum demo_compress_codec {
+	DEMO_COMPRESS_CODEC_NONE,
+	DEMO_COMPRESS_CODEC_LZ4,
+	DEMO_COMPRESS_CODEC_ZSTD,
+};
+
+enum demo_mjpeg_tables {
+	DEMO_MJPEG_TABLES_UNKNOWN = 0,
+	DEMO_MJPEG_TABLES_PRESENT,
+	DEMO_MJPEG_TABLES_MISSING,
+};
+
+enum demo_scheduler_route {
+	DEMO_SCHEDULER_ROUTE_HARDWARE,
+	DEMO_SCHEDULER_ROUTE_SOFTWARE,
+	DEMO_SCHEDULER_ROUTE_OVERFLOW,
+	DEMO_SCHEDULER_ROUTES_COUNT,
+};
+
+enum demo_sink_format {
+	DEMO_SINK_FORMAT_RAW,
+	DEMO_SINK_FORMAT_Y4M,
+};
+
+struct demo_buffer;
+
+struct demo_buffer_maps {
+	pthread_mutex_t lock;
+
+	/* Mapped buffers, least recently used first. */
+	struct demo_buffer *first;
+	struct demo_buffer *last;
+
+	size_t size;
+	size_t size_max;
+
+	/* Buffers are mapped with their pages at setup, in real-time mode. */
+	bool populate;
 };
 
 struct demo_buffer {
@@ -35,13 +82,29 @@ struct demo_buffer {
 	struct v4l2_plane planes[4];
 	unsigned int planes_count;
 
+	int video_fd;
+
 	void *data[4];
 	int dma_buf_fd[4];
+
+	/* Memory is only mapped on first CPU access. */
+	bool mapped;
+	unsigned int access_count;
+	struct demo_buffer_maps *maps;
+	struct demo_buffer *maps_prev;
+	struct demo_buffer *maps_next;
+
+	/* Memory imported from another buffer, bound at queue time. */
+	bool import;
+	struct demo_buffer *import_buffer;
 };
 
 struct demo_decoder {
 	int video_fd;
 
+	/* Driver, model and bus info from the media device, for caching. */
+	char device[96];
+
 	unsigned int output_memory;
 	unsigned int output_type;
 	unsigned int output_width;
@@ -53,6 +116,9 @@ struct demo_decoder {
 	unsigned int output_buffers_count;
 	unsigned int output_buffer_index;
 
+	/* Output memory for copying frames, without user pointers. */
+	unsigned int output_memory_copy;
+
 	unsigned int capture_memory;
 	unsigned int capture_type;
 	unsigned int capture_width;
@@ -63,8 +129,46 @@ struct demo_decoder {
 	struct demo_buffer capture_buffers[3];
 	unsigned int capture_buffers_count;
 	unsigned int capture_buffer_index;
+
+	/* Capture memory for copying to the dump, without user pointers. */
+	unsigned int capture_memory_copy;
+
+	/* Capture downscaling factor and source region of interest. */
+	unsigned int scale;
+	struct v4l2_rect crop;
+
+	/* Capture region offset in the downscaled frame. */
+	unsigned int capture_x;
+	unsigned int capture_y;
+
+	/* Frames only decoded by CPU workers, packed to the capture size. */
+	bool capture_packed;
+
+	/* Completion is busy-polled for this many us before sleeping. */
+	unsigned int spin_budget;
+	unsigned int spin_count;
+	struct perf_histogram wait;
+};
+
+/* Largest number of capture formats considered for a device. */
+#define DEMO_FORMATS_MAX	32
+
+struct demo_format {
+	unsigned int pixel_format;
+	const char *name;
+
+	/* Vertical chroma subsampling shift, 0 for 4:2:2 and 1 for 4:2:0. */
+	unsigned int chroma_shift;
+	bool planar;
+
+	/* Tile size in bytes and lines, for tiled formats. */
+	unsigned int tile_width;
+	unsigned int tile_height;
 };
 
+/* Room ahead of camera frames in user memory for Huffman tables. */
+#define DEMO_CAMERA_PREFIX_SIZE	4096
+
 struct demo_camera {
 	int video_fd;
 
@@ -78,6 +182,21 @@ struct demo_camera {
 	struct demo_buffer capture_buffers[3];
 	unsigned int capture_buffers_count;
 	unsigned int capture_buffer_index;
+	unsigned int capture_prefix;
+
+	/* Huffman tables found in camera frames. */
+	int tables;
+
+	/* Adaptive 3A settle budget, fixed warm-up when zero. */
+	unsigned int settle_frames_max;
+
+	/* Prefer frame rate over size within target size. */
+	bool rate_prefer;
+	struct v4l2_fract interval;
+
+	unsigned int frames_count;
+	uint64_t timestamp_first;
+	uint64_t timestamp_last;
 };
 
 struct demo_file {
@@ -85,6 +204,274 @@ struct demo_file {
 	unsigned int size;
 };
 
+#define DEMO_SINK_STAGING_COUNT	4
+
+struct demo_sink {
+	int fd;
+	int format;
+
+	/* One file per frame when the dump path is a printf pattern. */
+	bool pattern;
+
+	/* Frames staged for a single write, bypassing the page cache. */
+	bool direct_request;
+	bool direct;
+	void *staging;
+	size_t staging_slot_size;
+	size_t staging_sizes[DEMO_SINK_STAGING_COUNT];
+	unsigned int staging_count;
+
+	char header[80];
+	unsigned int header_size;
+
+	/* Decoded frame layout, with chroma following the luma lines. */
+	unsigned int width;
+	unsigned int height;
+	unsigned int stride;
+	unsigned int lines;
+
+	/* Dumped frames pixel format, converted from the capture format. */
+	unsigned int pixel_format;
+	const struct demo_format *convert_format;
+	const struct demo_format *convert_target;
+
+	/* Decoder writes frames straight into the mapped dump file. */
+	bool mmap_request;
+	bool mmap;
+	void *data;
+	size_t size;
+	unsigned int frame_size;
+	unsigned int frame_index;
+
+	unsigned int frames_count;
+	unsigned int frames_written;
+};
+
+struct demo_compress_slot;
+struct demo_compress_worker;
+struct demo_compress_entry;
+
+struct demo_compress {
+	int codec;
+	unsigned int threads_count;
+	unsigned int slices_count;
+
+	struct demo_compress_worker *workers;
+
+	pthread_mutex_t lock;
+	pthread_cond_t task_cond;
+	pthread_cond_t slot_cond;
+	bool stopping;
+	int error;
+
+	/* Frame copies, compressed one slice per task. */
+	struct demo_compress_slot *slots;
+	unsigned int slots_count;
+	unsigned int frame_size;
+	unsigned int slice_size;
+	unsigned int frames_count;
+
+	unsigned int *tasks;
+	unsigned int tasks_size;
+	unsigned int tasks_head;
+	unsigned int tasks_tail;
+	unsigned int tasks_count;
+
+	int fd;
+	uint64_t offset;
+	uint64_t size;
+	uint64_t size_raw;
+
+	struct demo_compress_entry *entries;
+	unsigned int entries_count;
+	unsigned int entries_size;
+};
+
+/* Shared memory layout, as seen by reader processes. */
+
+struct demo_shm_slot {
+	atomic_uint sequence;
+	uint32_t frame;
+	uint32_t size;
+	uint32_t reserved;
+	uint64_t timestamp;
+};
+
+struct demo_shm_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t slots_count;
+	uint32_t slot_size;
+	uint32_t data_offset;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t pixel_format;
+
+	/* Futex incremented for each published frame. */
+	_Alignas(64) atomic_uint sequence;
+	atomic_uint readers_waiting;
+
+	_Alignas(64) struct demo_shm_slot slots[];
+};
+
+struct demo_shm {
+	unsigned int slots_count;
+
+	int fd;
+	void *data;
+	size_t size;
+	struct demo_shm_header *header;
+
+	unsigned int frames_count;
+};
+
+/* Camera record file layout, see demo_record.c. */
+
+#define DEMO_RECORD_MAGIC	"CJDR"
+#define DEMO_RECORD_INDEX_MAGIC	"CJDX"
+#define DEMO_RECORD_VERSION	1
+
+struct demo_record_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t pixel_format;
+	uint32_t width;
+	uint32_t height;
+	uint32_t interval_numerator;
+	uint32_t interval_denominator;
+	uint32_t reserved;
+};
+
+struct demo_record_frame {
+	uint64_t timestamp;
+	uint32_t size;
+	uint32_t sequence;
+};
+
+struct demo_record_entry {
+	uint64_t offset;
+	uint64_t timestamp;
+	uint32_t size;
+	uint32_t sequence;
+};
+
+struct demo_record_footer {
+	uint64_t index_offset;
+	uint32_t index_count;
+	char magic[4];
+};
+
+struct demo_record {
+	char *path;
+	int fd;
+	uint64_t offset;
+
+	struct demo_record_entry *entries;
+	unsigned int entries_count;
+	unsigned int entries_size;
+};
+
+struct demo_stream {
+	int fd;
+	const void *data;
+	size_t size;
+	size_t map_size;
+
+	/* Copies of unaligned frames, one slot per output buffer. */
+	void *bounce;
+	size_t bounce_slot_size;
+
+	size_t offset;
+	unsigned int frames_count;
+
+	/* Recorded camera frames, paced by their timestamps. */
+	const struct demo_record_entry *entries;
+	unsigned int entry_index;
+	double speed;
+	uint64_t timestamp_first;
+	uint64_t replay_start;
+};
+
+struct demo_scheduler_job;
+struct demo_scheduler_worker;
+
+struct demo_scheduler {
+	/* Hybrid decoding is enabled with CPU workers. */
+	unsigned int threads_count;
+	unsigned int overflow_depth;
+	unsigned int overflow_latency;
+
+	struct demo_scheduler_worker *workers;
+
+	pthread_mutex_t lock;
+	pthread_cond_t job_cond;
+	pthread_cond_t done_cond;
+	bool stopping;
+
+	/* Jobs indexed by decoder output buffer, queued in order by slice. */
+	struct demo_scheduler_job *jobs;
+	unsigned int jobs_count;
+	unsigned int slices_max;
+	unsigned int *queue;
+	unsigned int queue_size;
+	unsigned int queue_head;
+	unsigned int queue_tail;
+	unsigned int queue_count;
+	unsigned int busy_count;
+
+	/* Frames queued to the hardware and their latency average in ns. */
+	atomic_uint hardware_depth;
+	atomic_ullong hardware_latency;
+
+	/* Frame headers parsed for classification outside of jobs. */
+	struct jpeg jpeg;
+
+	struct perf_histogram stats[DEMO_SCHEDULER_ROUTES_COUNT];
+};
+
+/* Largest number of decoder buffers of each type in the pipeline. */
+#define DEMO_PIPELINE_BUFFERS_MAX	16
+
+struct demo_pipeline {
+	pthread_t input_thread;
+	pthread_t submit_thread;
+	pthread_t reap_thread;
+	pthread_t process_thread;
+	pthread_t output_thread;
+
+	/* Decoder output buffer indices. */
+	struct ring output_free;
+	struct ring decode;
+
+	/* Decoder output and capture buffer indices in flight. */
+	struct ring pending;
+
+	/* Decoder capture buffer indices. */
+	struct ring process;
+	struct ring dump;
+	struct ring capture_free;
+
+	/* Capture buffers with CPU access begun in the process stage. */
+	bool capture_access[DEMO_PIPELINE_BUFFERS_MAX];
+
+	atomic_int error;
+	unsigned int frames_count;
+};
+
+struct demo_realtime {
+	/* CPU list for pipeline threads, in taskset format. */
+	char *cpus;
+	/* SCHED_FIFO priority for pipeline threads, none when zero. */
+	int priority;
+	bool lock;
+
+	/* Interval between frames out of the decoder, for jitter. */
+	struct perf_histogram interval;
+	uint64_t interval_min;
+	uint64_t frame_last;
+};
+
 struct demo {
 	int source;
 	int allocator;
@@ -94,15 +481,52 @@ struct demo {
 	unsigned int width;
 	unsigned int height;
 
+	struct demo_buffer_maps buffer_maps;
+	size_t buffer_maps_size_max;
+
+	char **source_paths;
+	unsigned int source_paths_count;
+	unsigned int frames_count;
+	char *dump_path;
+
+	/* Frames are checked before reaching the decoder. */
+	bool validate;
+	unsigned int frames_rejected;
+
+	/* Software decoder runs on each source file, when benchmarking. */
+	unsigned int benchmark_count;
+
 	struct demo_file file;
+	struct demo_stream stream;
 	struct demo_decoder decoder;
 	struct demo_camera camera;
+	struct demo_sink sink;
+	struct demo_compress compress;
+	struct demo_shm shm;
+	struct demo_record record;
+	struct demo_scheduler scheduler;
+	struct demo_pipeline pipeline;
+	struct demo_realtime realtime;
 };
 
+int demo_file_read_buffer(struct demo *demo, struct demo_buffer *buffer);
+int demo_file_open(struct demo *demo, char *path);
+void demo_file_close(struct demo *demo);
+
+int demo_buffer_map(struct demo_buffer *buffer);
+void demo_buffer_unmap(struct demo_buffer *buffer);
+int demo_buffer_access_begin_flags(struct demo_buffer *buffer, long flags);
+int demo_buffer_access_begin(struct demo_buffer *buffer);
+int demo_buffer_access_finish_flags(struct demo_buffer *buffer, long flags);
+int demo_buffer_access_finish(struct demo_buffer *buffer);
+int demo_buffer_maps_setup(struct demo_buffer_maps *maps, size_t size_max);
+void demo_buffer_maps_cleanup(struct demo_buffer_maps *maps);
+
 int demo_buffer_sync(struct demo_buffer *buffer, long flags);
-int demo_buffer_sync_begin(struct demo_buffer *buffer);
-int demo_buffer_sync_finish(struct demo_buffer *buffer);
 
+int demo_buffer_import(struct demo_buffer *buffer,
+		       struct demo_buffer *import_buffer);
+int demo_buffer_export(struct demo_buffer *buffer, int video_fd);
 int demo_buffer_setup(struct demo *demo, struct demo_buffer *buffer,
 		      int video_fd, unsigned int memory, unsigned int type,
 		      unsigned int index, unsigned int planes_count,
@@ -112,14 +536,122 @@ void demo_buffer_cleanup(struct demo_buffer *buffer);
 int demo_decoder_buffer_current(struct demo *demo, unsigned int type,
 				struct demo_buffer **buffer);
 int demo_decoder_buffer_cycle(struct demo *demo, unsigned int type);
+int demo_decoder_start(struct demo *demo);
+int demo_decoder_stop(struct demo *demo);
+int demo_decoder_output_import(struct demo *demo,
+			       struct demo_buffer *output_buffer,
+			       struct demo_buffer *camera_buffer);
+int demo_decoder_submit(struct demo *demo, struct demo_buffer *output_buffer,
+			struct demo_buffer *capture_buffer);
+int demo_decoder_reap(struct demo *demo, unsigned int *output_index,
+		      unsigned int *capture_index);
 int demo_decoder_run(struct demo *demo);
+int demo_decoder_output_userptr_validate(struct demo *demo, void *data);
+int demo_decoder_capture_userptr_validate(struct demo *demo);
+void demo_decoder_wait_report(struct demo *demo);
+void demo_decoder_layout(struct demo *demo, unsigned int *stride,
+			 unsigned int *width, unsigned int *height);
 int demo_decoder_setup(struct demo *demo);
 void demo_decoder_cleanup(struct demo *demo);
 
+const struct demo_format *demo_format_find(unsigned int pixel_format);
+const struct demo_format *demo_format_find_name(const char *name);
+const struct demo_format *demo_format_planar(const struct demo_format *format);
+size_t demo_format_frame_size(const struct demo_format *format,
+			      unsigned int stride, unsigned int height);
+void demo_format_chroma(const struct demo_format *format, uint8_t *data,
+			unsigned int stride, unsigned int height,
+			uint8_t **chroma, uint8_t **chroma_cr,
+			unsigned int *chroma_stride);
+bool demo_format_convertible(const struct demo_format *format,
+			     const struct demo_format *target);
+size_t demo_format_cost(const struct demo_format *format,
+			const struct demo_format *target, unsigned int width,
+			unsigned int height);
+void demo_format_convert(const struct demo_format *format, const uint8_t *src,
+			 unsigned int stride, unsigned int height,
+			 const struct demo_format *target, uint8_t *dst,
+			 unsigned int width, unsigned int lines);
+int demo_format_cache_load(const char *device, unsigned int type,
+			   unsigned int *pixel_formats, unsigned int *count);
+int demo_format_cache_store(const char *device, unsigned int type,
+			    const unsigned int *pixel_formats,
+			    unsigned int count);
+
 int demo_camera_buffer_current(struct demo *demo, struct demo_buffer **buffer);
 int demo_camera_buffer_cycle(struct demo *demo);
+int demo_camera_start(struct demo *demo);
+int demo_camera_stop(struct demo *demo);
+int demo_camera_dequeue(struct demo *demo, unsigned int *index);
+int demo_camera_capture(struct demo *demo, unsigned int *index);
+int demo_camera_capture_latest(struct demo *demo, unsigned int *index,
+			       unsigned int *dropped_count);
+int demo_camera_release(struct demo *demo, unsigned int index);
+int demo_camera_settle(struct demo *demo, unsigned int *index);
+int demo_camera_mode_negotiate(struct demo *demo);
+int demo_camera_rate_setup(struct demo *demo);
+void demo_camera_rate_report(struct demo *demo);
 int demo_camera_roll(struct demo *demo);
+int demo_camera_live(struct demo *demo);
 int demo_camera_setup(struct demo *demo);
 void demo_camera_cleanup(struct demo *demo);
 
+int demo_mjpeg_validate(struct demo *demo, const void *data,
+			unsigned int size);
+int demo_mjpeg_tables_probe(struct demo *demo);
+int demo_mjpeg_normalize(struct demo *demo, struct demo_buffer *camera_buffer,
+			 struct demo_buffer *output_buffer,
+			 unsigned int *offset, unsigned int *size);
+
+int demo_stream_frame_next(struct demo *demo, const void **data,
+			   unsigned int *size, uint64_t *timestamp);
+int demo_stream_frame_bounce(struct demo *demo, struct demo_buffer *buffer);
+int demo_stream_frame_load(struct demo *demo, struct demo_buffer *buffer,
+			   const void *data, unsigned int size,
+			   uint64_t timestamp);
+int demo_stream_open(struct demo *demo, char *path);
+void demo_stream_close(struct demo *demo);
+
+bool demo_sink_pattern_check(const char *path);
+const struct demo_format *demo_sink_pixel_format(struct demo *demo);
+int demo_sink_frame_bind(struct demo *demo, struct demo_buffer *buffer);
+int demo_sink_write(struct demo *demo, struct demo_buffer *buffer);
+int demo_sink_open(struct demo *demo);
+void demo_sink_close(struct demo *demo);
+
+bool demo_compress_codec_check(int codec);
+int demo_compress_frame(struct demo *demo, struct demo_buffer *buffer);
+int demo_compress_start(struct demo *demo, int fd);
+int demo_compress_finish(struct demo *demo);
+void demo_compress_cleanup(struct demo *demo);
+
+int demo_shm_publish(struct demo *demo, struct demo_buffer *buffer);
+int demo_shm_setup(struct demo *demo);
+void demo_shm_cleanup(struct demo *demo);
+
+int demo_record_run(struct demo *demo);
+
+int demo_scheduler_classify(struct demo *demo, struct jpeg *jpeg,
+			    struct demo_buffer *output_buffer);
+int demo_scheduler_submit(struct demo *demo, unsigned int output_index,
+			  unsigned int capture_index);
+int demo_scheduler_reap(struct demo *demo, unsigned int *output_index,
+			unsigned int *capture_index);
+void demo_scheduler_report(struct demo *demo);
+int demo_scheduler_start(struct demo *demo);
+void demo_scheduler_stop(struct demo *demo);
+void demo_scheduler_cleanup(struct demo *demo);
+
+int demo_pipeline_run(struct demo *demo);
+
+int demo_benchmark_run(struct demo *demo);
+
+int demo_realtime_thread_create(struct demo *demo, const char *name,
+				pthread_t *thread, void *(*routine)(void *),
+				void *data);
+void demo_realtime_self_setup(struct demo *demo, const char *name);
+void demo_realtime_frame(struct demo *demo);
+void demo_realtime_report(struct demo *demo);
+int demo_realtime_setup(struct demo *demo);
+
 #endif
@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2024 Paul Kocialkowski <contact@paulk.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "demo.h"
+#include "jpeg.h"
+#include "perf.h"
+
+/*
+ * The software decoder is timed on each source file, with Huffman codes
+ * decoded from lookahead tables and one bit at a time as a reference.
+ * Both outputs must match.
+ */
+
+static int demo_benchmark_decode(struct demo *demo, struct jpeg *jpeg,
+				 const void *data, unsigned int size,
+				 struct jpeg_output *output, uint64_t *best)
+{
+	struct perf perf = { 0 };
+	uint64_t diff;
+	unsigned int i;
+	int ret;
+
+	*best = UINT64_MAX;
+
+	for (i = 0; i < demo->benchmark_count; i++) {
+		perf_before(&perf);
+		ret = jpeg_decode(jpeg, data, size, output);
+		perf_after(&perf);
+
+		if (ret) {
+			fprintf(stderr, "Failed to decode source file\n");
+			return ret;
+		}
+
+		diff = timespec_diff(perf.before, perf.after);
+		if (diff < *best)
+			*best = diff;
+	}
+
+	return 0;
+}
+
+static int demo_benchmark_file(struct demo *demo, char *path)
+{
+	struct demo_file *file = &demo->file;
+	struct jpeg reference = { 0 };
+	struct jpeg jpeg = { 0 };
+	struct jpeg_output output[2];
+	uint64_t best[2];
+	uint8_t *buffers[2] = { NULL };
+	unsigned int size;
+	size_t length;
+	void *data;
+	unsigned int i;
+	int ret;
+
+	ret = demo_file_open(demo, path);
+	if (ret)
+		return ret;
+
+	size = file->size;
+
+	data = malloc(size);
+	if (!data) {
+		ret = -ENOMEM;
+		goto complete_file;
+	}
+
+	if (read(file->fd, data, size) < size) {
+		fprintf(stderr, "Failed to read from source file\n");
+		ret = -EIO;
+		goto complete_data;
+	}
+
+	ret = jpeg_parse(&jpeg, data, size);
+	if (ret) {
+		fprintf(stderr, "Failed to parse source file %s\n", path);
+		goto complete_data;
+	}
+
+	length = (size_t)jpeg.width * jpeg.height * 2;
+
+	for (i = 0; i < 2; i++) {
+		buffers[i] = calloc(1, length);
+		if (!buffers[i]) {
+			ret = -ENOMEM;
+			goto complete_buffers;
+		}
+
+		output[i].luma = buffers[i];
+		output[i].stride = jpeg.width;
+		output[i].chroma = buffers[i] + length / 2;
+		output[i].chroma_cr = NULL;
+		output[i].chroma_stride = jpeg.width;
+		output[i].chroma_shift = 0;
+		output[i].width = jpeg.width;
+		output[i].height = jpeg.height;
+		output[i].x = 0;
+		output[i].y = 0;
+		output[i].scale = 1;
+	}
+
+	reference.reference = true;
+
+	ret = demo_benchmark_decode(demo, &reference, data, size, &output[0],
+				    &best[0]);
+	if (ret)
+		goto complete_buffers;
+
+	ret = demo_benchmark_decode(demo, &jpeg, data, size, &output[1],
+				    &best[1]);
+	if (ret)
+		goto complete_buffers;
+
+	if (memcmp(buffers[0], buffers[1], length)) {
+		fprintf(stderr, "Mismatching decoded frames for %s\n", path);
+		ret = -EINVAL;
+		goto complete_buffers;
+	}
+
+	printf("Decoded %s (%ux%u) in %"PRIu64" us with lookahead, "
+	       "%"PRIu64" us bit by bit\n", path, jpeg.width, jpeg.height,
+	       best[1] / 1000, best[0] / 1000);
+
+complete_buffers:
+	for (i = 0; i < 2; i++)
+		free(buffers[i]);
+
+	jpeg_cleanup(&reference);
+	jpeg_cleanup(&jpeg);
+
+complete_data:
+	free(data);
+
+complete_file:
+	demo_file_close(demo);
+
+	return ret;
+}
+
+int demo_benchmark_run(struct demo *demo)
+{
+	unsigned int i;
+	int ret;
+
+	if (!demo || !demo->benchmark_count)
+		return -EINVAL;
+
+	for (i = 0; i < demo->source_paths_count; i++) {
+		ret = demo_benchmark_file(demo, demo->source_paths[i]);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
@@ -17,12 +17,18 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <time.h>
 
 #include <linux/dma-buf.h>
 
 #include "demo.h"
+#include "perf.h"
 
 int demo_camera_buffer_current(struct demo *demo, struct demo_buffer **buffer)
 {
@@ -51,20 +57,19 @@ int demo_camera_buffer_cycle(struct demo *demo)
 	return 0;
 }
 
-int demo_camera_roll(struct demo *demo)
+int demo_camera_start(struct demo *demo)
 {
 	struct demo_camera *camera = &demo->camera;
 	struct demo_buffer *buffer;
-	struct demo_buffer *buffer_next;
-	struct v4l2_buffer buffer_dequeue;
-	unsigned int index;
-	unsigned int count;
 	unsigned int i;
 	int ret;
 
 	if (!demo)
 		return -EINVAL;
 
+	camera->frames_count = 0;
+	camera->tables = DEMO_MJPEG_TABLES_UNKNOWN;
+
 	for (i = 0; i < camera->capture_buffers_count; i++) {
 		ret = demo_camera_buffer_current(demo, &buffer);
 		if (ret)
@@ -87,68 +92,732 @@ int demo_camera_roll(struct demo *demo)
 		return ret;
 	}
 
-	buffer_next = NULL;
+	return 0;
+}
 
-	/*
-	 * Capture data in all buffers and re-capture first buffer to make sure
-	 * 3A has settled.
-	 */
-	for (i = 0; i < camera->capture_buffers_count + 1; i++) {
-		struct timeval timeout = { 4, 0 };
+int demo_camera_stop(struct demo *demo)
+{
+	struct demo_camera *camera = &demo->camera;
 
-		if (buffer_next) {
-			ret = v4l2_buffer_queue(camera->video_fd,
-						&buffer_next->buffer);
-			if (ret) {
-				fprintf(stderr,
-					"Failed to queue capture buffer\n");
+	if (!demo)
+		return -EINVAL;
+
+	return v4l2_stream_off(camera->video_fd, camera->capture_type);
+}
+
+int demo_camera_dequeue(struct demo *demo, unsigned int *index)
+{
+	struct demo_camera *camera = &demo->camera;
+	struct demo_buffer *buffer;
+	struct v4l2_buffer buffer_dequeue;
+	struct timespec now;
+	unsigned int timestamp_flags;
+	uint64_t timestamp;
+	unsigned int size;
+	int ret;
+
+	if (!demo || !index)
+		return -EINVAL;
+
+	v4l2_buffer_setup_base(&buffer_dequeue, camera->capture_type,
+			       camera->capture_memory);
+
+	ret = v4l2_buffer_dequeue(camera->video_fd, &buffer_dequeue);
+	if (ret)
+		return ret;
+
+	buffer = &camera->capture_buffers[buffer_dequeue.index];
+
+	v4l2_buffer_plane_length_used(&buffer_dequeue, 0, &size);
+	v4l2_buffer_setup_plane_length_used(&buffer->buffer, 0, size);
+
+	/* Fallback to dequeue time without a monotonic capture timestamp. */
+	timestamp_flags = buffer_dequeue.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK;
+	if (timestamp_flags == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+		v4l2_buffer_timestamp(&buffer_dequeue, &timestamp);
+	} else {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		timestamp = timespec_ns(now);
+	}
+
+	v4l2_buffer_setup_timestamp(&buffer->buffer, timestamp);
+
+	if (!camera->frames_count)
+		camera->timestamp_first = timestamp;
+
+	camera->timestamp_last = timestamp;
+	camera->frames_count++;
+
+	/* Sync CPU-written data for UVC camera. */
+	ret = demo_buffer_sync(buffer, DMA_BUF_SYNC_WRITE | DMA_BUF_SYNC_END);
+	if (ret)
+		return ret;
+
+	*index = buffer_dequeue.index;
+
+	return 0;
+}
+
+int demo_camera_capture(struct demo *demo, unsigned int *index)
+{
+	struct demo_camera *camera = &demo->camera;
+	struct timeval timeout = { 4, 0 };
+	int ret;
+
+	if (!demo || !index)
+		return -EINVAL;
+
+	ret = v4l2_poll(camera->video_fd, &timeout);
+	if (ret <= 0) {
+		fprintf(stderr, "Error waiting for camera\n");
+		return ret == 0 ? -ETIMEDOUT : ret;
+	}
+
+	ret = demo_camera_dequeue(demo, index);
+	if (ret) {
+		fprintf(stderr, "Failed to dequeue capture buffer\n");
+		return ret;
+	}
+
+	return 0;
+}
+
+int demo_camera_capture_latest(struct demo *demo, unsigned int *index,
+			       unsigned int *dropped_count)
+{
+	unsigned int index_latest;
+	unsigned int count = 0;
+	int ret;
+
+	if (!demo || !index || !dropped_count)
+		return -EINVAL;
+
+	ret = demo_camera_capture(demo, &index_latest);
+	if (ret)
+		return ret;
+
+	/* Drain all ready buffers and give stale ones back right away. */
+	while (1) {
+		ret = demo_camera_dequeue(demo, index);
+		if (ret == -EAGAIN)
+			break;
+		else if (ret)
+			return ret;
+
+		ret = demo_camera_release(demo, index_latest);
+		if (ret)
+			return ret;
+
+		index_latest = *index;
+		count++;
+	}
+
+	*index = index_latest;
+	*dropped_count = count;
+
+	return 0;
+}
+
+int demo_camera_release(struct demo *demo, unsigned int index)
+{
+	struct demo_camera *camera = &demo->camera;
+	struct demo_buffer *buffer;
+	int ret;
+
+	if (!demo || index >= camera->capture_buffers_count)
+		return -EINVAL;
+
+	buffer = &camera->capture_buffers[index];
+
+	ret = v4l2_buffer_queue(camera->video_fd, &buffer->buffer);
+	if (ret) {
+		fprintf(stderr, "Failed to queue capture buffer\n");
+		return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Controls watched by 3A while settling, the ones unsupported by the camera
+ * are ignored.
+ */
+static const unsigned int demo_camera_settle_controls[] = {
+	V4L2_CID_EXPOSURE_ABSOLUTE,
+	V4L2_CID_WHITE_BALANCE_TEMPERATURE,
+	V4L2_CID_GAIN,
+};
+
+#define DEMO_CAMERA_SETTLE_CONTROLS_COUNT \
+	(sizeof(demo_camera_settle_controls) / \
+	 sizeof(demo_camera_settle_controls[0]))
+
+/* Consecutive stable frames required to consider that 3A has settled. */
+#define DEMO_CAMERA_SETTLE_STREAK	2
+
+int demo_camera_settle(struct demo *demo, unsigned int *index)
+{
+	struct demo_camera *camera = &demo->camera;
+	struct v4l2_ext_control controls[DEMO_CAMERA_SETTLE_CONTROLS_COUNT];
+	struct v4l2_ext_controls ext_controls = { 0 };
+	struct v4l2_control control;
+	struct demo_buffer *buffer;
+	struct perf perf = { 0 };
+	int values[DEMO_CAMERA_SETTLE_CONTROLS_COUNT];
+	unsigned int controls_count = 0;
+	unsigned int streak = 0;
+	unsigned int size_previous = 0;
+	unsigned int size_delta;
+	unsigned int size;
+	unsigned int i, j;
+	bool index_next = false;
+	bool stable;
+	int ret;
+
+	if (!demo || !index)
+		return -EINVAL;
+
+	for (i = 0; i < DEMO_CAMERA_SETTLE_CONTROLS_COUNT; i++) {
+		unsigned int id = demo_camera_settle_controls[i];
+
+		v4l2_control_setup_base(&control, id);
+
+		ret = v4l2_control_get(camera->video_fd, &control);
+		if (ret)
+			continue;
+
+		v4l2_ext_control_setup_base(&controls[controls_count], id);
+		values[controls_count] = v4l2_control_value(&control);
+		controls_count++;
+	}
+
+	v4l2_ext_controls_setup(&ext_controls, controls, controls_count);
+
+	perf_before(&perf);
+
+	for (i = 0; i < camera->settle_frames_max; i++) {
+		if (index_next) {
+			ret = demo_camera_release(demo, *index);
+			if (ret)
 				return ret;
+		}
+
+		ret = demo_camera_capture(demo, index);
+		if (ret)
+			return ret;
+
+		index_next = true;
+
+		stable = i > 0;
+
+		if (controls_count) {
+			ret = v4l2_ext_controls_get(camera->video_fd,
+						    &ext_controls);
+			if (ret) {
+				/* Rely on frame size only from now on. */
+				controls_count = 0;
+				ext_controls.count = 0;
 			}
 		}
 
-		ret = v4l2_poll(camera->video_fd, &timeout);
-		if (ret <= 0) {
-			fprintf(stderr, "Error waiting for camera\n");
-			return ret == 0 ? -ETIMEDOUT : ret;
+		for (j = 0; j < controls_count; j++) {
+			if (controls[j].value != values[j])
+				stable = false;
+
+			values[j] = controls[j].value;
 		}
 
-		v4l2_buffer_setup_base(&buffer_dequeue, camera->capture_type,
-				       camera->capture_memory);
+		/* Compressed size tracks exposure and scene changes. */
+		buffer = &camera->capture_buffers[*index];
 
-		ret = v4l2_buffer_dequeue(camera->video_fd, &buffer_dequeue);
-		if (ret) {
-			fprintf(stderr, "Failed to dequeue capture buffer\n");
+		v4l2_buffer_plane_length_used(&buffer->buffer, 0, &size);
+
+		if (size > size_previous)
+			size_delta = size - size_previous;
+		else
+			size_delta = size_previous - size;
+
+		if (size_delta > size_previous / 16)
+			stable = false;
+
+		size_previous = size;
+
+		if (stable)
+			streak++;
+		else
+			streak = 0;
+
+		if (streak >= DEMO_CAMERA_SETTLE_STREAK)
+			break;
+	}
+
+	perf_after(&perf);
+
+	if (streak >= DEMO_CAMERA_SETTLE_STREAK)
+		printf("Camera settled after %u frames\n", i + 1);
+	else
+		printf("Camera did not settle within %u frames\n",
+		       camera->settle_frames_max);
+
+	perf_print(&perf, "camera settle");
+
+	return 0;
+}
+
+int demo_camera_roll(struct demo *demo)
+{
+	struct demo_camera *camera = &demo->camera;
+	unsigned int index;
+	unsigned int i;
+	bool index_next = false;
+	int ret;
+
+	if (!demo)
+		return -EINVAL;
+
+	ret = demo_camera_start(demo);
+	if (ret)
+		return ret;
+
+	if (camera->settle_frames_max) {
+		ret = demo_camera_settle(demo, &index);
+		if (ret)
 			return ret;
+
+		goto complete;
+	}
+
+	/*
+	 * Capture data in all buffers and re-capture first buffer to make sure
+	 * 3A has settled.
+	 */
+	for (i = 0; i < camera->capture_buffers_count + 1; i++) {
+		if (index_next) {
+			ret = demo_camera_release(demo, index);
+			if (ret)
+				return ret;
 		}
 
-		index = buffer_dequeue.index;
-		buffer_next = &camera->capture_buffers[index];
+		ret = demo_camera_capture(demo, &index);
+		if (ret)
+			return ret;
+
+		index_next = true;
 	}
 
-	ret = v4l2_stream_off(camera->video_fd, camera->capture_type);
+complete:
+	/* Keep track of the last captured buffer for decoding. */
+	camera->capture_buffer_index = index;
+
+	demo_camera_rate_report(demo);
+
+	ret = demo_camera_stop(demo);
 	if (ret)
 		return ret;
 
-	ret = demo_camera_buffer_current(demo, &buffer);
+	return 0;
+}
+
+int demo_camera_live(struct demo *demo)
+{
+	struct demo_decoder *decoder = &demo->decoder;
+	struct demo_camera *camera = &demo->camera;
+	struct demo_buffer *output_buffer;
+	struct demo_buffer *capture_buffer;
+	struct demo_buffer *camera_buffer;
+	struct timespec now;
+	uint64_t latency_sum = 0;
+	uint64_t latency_min = UINT64_MAX;
+	uint64_t latency_max = 0;
+	uint64_t latency;
+	uint64_t timestamp;
+	unsigned int dropped_total = 0;
+	unsigned int dropped_count;
+	unsigned int decoded_count;
+	unsigned int output_index;
+	unsigned int capture_index;
+	unsigned int index;
+	unsigned int i;
+	int ret;
+
+	if (!demo || !demo->frames_count)
+		return -EINVAL;
+
+	ret = demo_camera_start(demo);
 	if (ret)
-		return ret;
+		goto complete;
 
-	for (i = 0; i < camera->capture_buffers_count; i++) {
-		buffer = &camera->capture_buffers[i];
+	ret = demo_decoder_start(demo);
+	if (ret)
+		goto complete;
 
-		/* Sync CPU-written data for UVC camera. */
-		ret = demo_buffer_sync(buffer, DMA_BUF_SYNC_WRITE |
-				       DMA_BUF_SYNC_END);
+	for (i = 0; i < demo->frames_count; i++) {
+		ret = demo_camera_capture_latest(demo, &index, &dropped_count);
 		if (ret)
-			return ret;
+			goto complete;
+
+		dropped_total += dropped_count;
+
+		camera_buffer = &camera->capture_buffers[index];
+
+		ret = demo_decoder_buffer_current(demo, decoder->output_type,
+						  &output_buffer);
+		if (ret)
+			goto complete;
+
+		ret = demo_decoder_buffer_current(demo, decoder->capture_type,
+						  &capture_buffer);
+		if (ret)
+			goto complete;
+
+		ret = demo_decoder_output_import(demo, output_buffer,
+						 camera_buffer);
+		if (ret == -EBADMSG) {
+			ret = demo_camera_release(demo, index);
+			if (ret)
+				goto complete;
+
+			continue;
+		} else if (ret) {
+			goto complete;
+		}
+
+		ret = demo_decoder_submit(demo, output_buffer, capture_buffer);
+		if (ret)
+			goto complete;
+
+		ret = demo_decoder_reap(demo, &output_index, &capture_index);
+		if (ret)
+			goto complete;
+
+		demo_realtime_frame(demo);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		v4l2_buffer_timestamp(&camera_buffer->buffer, &timestamp);
+		latency = (timespec_ns(now) - timestamp) / 1000UL;
+
+		latency_sum += latency;
+
+		if (latency < latency_min)
+			latency_min = latency;
+
+		if (latency > latency_max)
+			latency_max = latency;
+
+		printf("Decoded camera frame %u (%u dropped) with latency %"
+		       PRIu64" us\n", i, dropped_count, latency);
+
+		ret = demo_camera_release(demo, index);
+		if (ret)
+			goto complete;
+
+		capture_buffer = &decoder->capture_buffers[capture_index];
+
+		ret = demo_buffer_access_begin(capture_buffer);
+		if (ret)
+			goto complete;
+
+		ret = demo_sink_write(demo, capture_buffer);
+		if (ret) {
+			demo_buffer_access_finish(capture_buffer);
+			goto complete;
+		}
+
+		ret = demo_buffer_access_finish(capture_buffer);
+		if (ret)
+			goto complete;
+
+		demo_decoder_buffer_cycle(demo, decoder->output_type);
+		demo_decoder_buffer_cycle(demo, decoder->capture_type);
+	}
+
+	decoded_count = demo->frames_count - demo->frames_rejected;
+	if (!decoded_count) {
+		fprintf(stderr, "No valid camera frame to decode\n");
+		ret = -EBADMSG;
+		goto complete;
+	}
+
+	printf("Camera live: %u frames decoded, %u dropped, %u rejected, "
+	       "latency min %"PRIu64" us avg %"PRIu64" us max %"PRIu64" us\n",
+	       decoded_count, dropped_total, demo->frames_rejected,
+	       latency_min, latency_sum / decoded_count, latency_max);
+
+	demo_camera_rate_report(demo);
+	demo_decoder_wait_report(demo);
+	demo_realtime_report(demo);
+	perf_ioctl_report(decoded_count);
+
+	ret = 0;
+
+complete:
+	demo_decoder_stop(demo);
+	demo_camera_stop(demo);
+
+	return ret;
+}
+
+static int demo_camera_interval_shortest(struct demo *demo,
+					 unsigned int width,
+					 unsigned int height,
+					 struct v4l2_fract *interval)
+{
+	struct demo_camera *camera = &demo->camera;
+	struct v4l2_frmivalenum frame_interval;
+	struct v4l2_fract candidate;
+	unsigned int index = 0;
+	bool found = false;
+	int ret;
+
+	while (1) {
+		ret = v4l2_frame_interval_enum(camera->video_fd,
+					       camera->capture_pixel_format,
+					       width, height, index,
+					       &frame_interval);
+		if (ret)
+			break;
+
+		if (frame_interval.type == V4L2_FRMIVAL_TYPE_DISCRETE)
+			candidate = frame_interval.discrete;
+		else
+			candidate = frame_interval.stepwise.min;
+
+		if (candidate.numerator && candidate.denominator &&
+		    (!found || (uint64_t)candidate.numerator *
+			       interval->denominator <
+			       (uint64_t)interval->numerator *
+			       candidate.denominator)) {
+			*interval = candidate;
+			found = true;
+		}
+
+		/* Stepwise and continuous intervals come as a single entry. */
+		if (frame_interval.type != V4L2_FRMIVAL_TYPE_DISCRETE)
+			break;
+
+		index++;
+	}
+
+	return found ? 0 : -ENOENT;
+}
+
+static unsigned int demo_camera_size_step(unsigned int target,
+					  unsigned int min, unsigned int max,
+					  unsigned int step)
+{
+	unsigned int size = target < max ? target : max;
+
+	if (size < min)
+		return 0;
+
+	if (step > 1)
+		size -= (size - min) % step;
+
+	return size;
+}
+
+int demo_camera_mode_negotiate(struct demo *demo)
+{
+	struct demo_camera *camera = &demo->camera;
+	struct v4l2_frmsizeenum frame_size;
+	struct v4l2_frmsize_stepwise *stepwise;
+	struct v4l2_fract interval;
+	uint64_t rate_best;
+	uint64_t rate;
+	unsigned int width_target = camera->capture_width;
+	unsigned int height_target = camera->capture_height;
+	unsigned int width_best = 0;
+	unsigned int height_best = 0;
+	unsigned int width;
+	unsigned int height;
+	unsigned int index = 0;
+	bool found = false;
+	bool better;
+	int ret;
+
+	while (1) {
+		ret = v4l2_frame_size_enum(camera->video_fd,
+					   camera->capture_pixel_format, index,
+					   &frame_size);
+		if (ret)
+			break;
+
+		if (frame_size.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+			width = frame_size.discrete.width;
+			height = frame_size.discrete.height;
+		} else {
+			stepwise = &frame_size.stepwise;
+
+			width = demo_camera_size_step(width_target,
+						      stepwise->min_width,
+						      stepwise->max_width,
+						      stepwise->step_width);
+			height = demo_camera_size_step(height_target,
+						       stepwise->min_height,
+						       stepwise->max_height,
+						       stepwise->step_height);
+		}
+
+		index++;
+
+		if (!width || !height || width > width_target ||
+		    height > height_target)
+			goto next;
+
+		/* Only consider smaller sizes when rate is preferred. */
+		if (!camera->rate_prefer &&
+		    (width != width_target || height != height_target))
+			goto next;
+
+		ret = demo_camera_interval_shortest(demo, width, height,
+						    &interval);
+		if (ret)
+			goto next;
+
+		if (!found) {
+			better = true;
+		} else {
+			/* Compare fractions with a common denominator. */
+			rate = (uint64_t)interval.denominator *
+			       camera->interval.numerator;
+			rate_best = (uint64_t)camera->interval.denominator *
+				    interval.numerator;
+
+			better = rate > rate_best ||
+				 (rate == rate_best &&
+				  width * height > width_best * height_best);
+		}
+
+		if (better) {
+			camera->interval = interval;
+			width_best = width;
+			height_best = height;
+			found = true;
+		}
+
+next:
+		if (frame_size.type != V4L2_FRMSIZE_TYPE_DISCRETE)
+			break;
 	}
 
+	if (!found)
+		return -ENOENT;
+
+	camera->capture_width = width_best;
+	camera->capture_height = height_best;
+
+	printf("Negotiated camera mode %ux%u at %u/%u fps\n", width_best,
+	       height_best, camera->interval.denominator,
+	       camera->interval.numerator);
+
 	return 0;
 }
 
+int demo_camera_rate_setup(struct demo *demo)
+{
+	struct demo_camera *camera = &demo->camera;
+	struct v4l2_streamparm streamparm;
+	unsigned int numerator;
+	unsigned int denominator;
+	int ret;
+
+	v4l2_parm_setup_base(&streamparm, camera->capture_type);
+	v4l2_parm_setup_timeperframe(&streamparm, camera->interval.numerator,
+				     camera->interval.denominator);
+
+	ret = v4l2_parm_set(camera->video_fd, &streamparm);
+	if (ret)
+		return ret;
+
+	/* The driver may adjust the requested interval. */
+	v4l2_parm_timeperframe(&streamparm, &numerator, &denominator);
+
+	camera->interval.numerator = numerator;
+	camera->interval.denominator = denominator;
+
+	return 0;
+}
+
+void demo_camera_rate_report(struct demo *demo)
+{
+	struct demo_camera *camera = &demo->camera;
+	uint64_t duration;
+	uint64_t rate;
+
+	if (camera->frames_count < 2)
+		return;
+
+	duration = camera->timestamp_last - camera->timestamp_first;
+	if (!duration)
+		return;
+
+	/* Frames per second scaled by 1000. */
+	rate = (uint64_t)(camera->frames_count - 1) * 1000000000000ULL /
+	       duration;
+
+	printf("Camera delivered %"PRIu64".%03"PRIu64" fps", rate / 1000,
+	       rate % 1000);
+
+	if (camera->interval.numerator)
+		printf(" (requested %u/%u fps)", camera->interval.denominator,
+		       camera->interval.numerator);
+
+	printf("\n");
+}
+
+static bool demo_camera_prefix_check(struct demo *demo)
+{
+	struct demo_camera *camera = &demo->camera;
+	struct demo_decoder *decoder = &demo->decoder;
+	unsigned int capabilities;
+	int ret;
+
+	ret = v4l2_buffers_capabilities_probe(camera->video_fd,
+					      camera->capture_type,
+					      camera->capture_memory,
+					      &capabilities);
+	if (ret || !(capabilities & V4L2_BUF_CAP_SUPPORTS_USERPTR))
+		return false;
+
+	/* The decoder must read the same user memory, tables included. */
+	ret = v4l2_buffers_capabilities_probe(decoder->video_fd,
+					      decoder->output_type,
+					      V4L2_MEMORY_USERPTR,
+					      &capabilities);
+	if (ret || !(capabilities & V4L2_BUF_CAP_SUPPORTS_USERPTR))
+		return false;
+
+	return true;
+}
+
+static int demo_camera_prefix_setup(struct demo *demo,
+				    struct demo_buffer *buffer)
+{
+	struct demo_camera *camera = &demo->camera;
+	unsigned int length;
+	void *data;
+	int ret;
+
+	v4l2_buffer_plane_length(&buffer->buffer, 0, &length);
+
+	length = (length + DEMO_CAMERA_PREFIX_SIZE - 1) &
+		 ~(DEMO_CAMERA_PREFIX_SIZE - 1);
+
+	ret = posix_memalign(&data, DEMO_CAMERA_PREFIX_SIZE,
+			     camera->capture_prefix + length);
+	if (ret)
+		return -ret;
+
+	buffer->data[0] = (char *)data + camera->capture_prefix;
+
+	return v4l2_buffer_setup_userptr(&buffer->buffer, 0, buffer->data[0]);
+}
+
 int demo_camera_setup(struct demo *demo)
 {
 	struct demo_camera *camera = &demo->camera;
+	unsigned int capture_memory;
 	unsigned int planes_count;
 	unsigned int count;
 	unsigned int size;
@@ -186,6 +855,15 @@ int demo_camera_setup(struct demo *demo)
 		return -EINVAL;
 	}
 
+	/* Capture mode negotiation */
+
+	ret = demo_camera_mode_negotiate(demo);
+	if (!ret) {
+		/* Decoder follows the negotiated camera size. */
+		demo->width = camera->capture_width;
+		demo->height = camera->capture_height;
+	}
+
 	/* Capture format setup */
 
 	v4l2_format_setup_base(&camera->capture_format, camera->capture_type);
@@ -209,13 +887,38 @@ int demo_camera_setup(struct demo *demo)
 		return ret;
 	}
 
+	/* Capture rate setup */
+
+	if (camera->interval.numerator) {
+		ret = demo_camera_rate_setup(demo);
+		if (ret)
+			fprintf(stderr, "Failed to set capture rate\n");
+	}
+
 	/* Capture buffers setup */
 
 	count = sizeof(camera->capture_buffers) /
 		sizeof(camera->capture_buffers[0]);
 
+	capture_memory = camera->capture_memory;
+
+	/* Frames in user memory leave room for tables ahead of them. */
+	if (demo_camera_prefix_check(demo)) {
+		camera->capture_memory = V4L2_MEMORY_USERPTR;
+		camera->capture_prefix = DEMO_CAMERA_PREFIX_SIZE;
+	}
+
 	ret = v4l2_buffers_request(camera->video_fd, camera->capture_type,
 				   camera->capture_memory, count);
+	if (ret && camera->capture_memory == V4L2_MEMORY_USERPTR) {
+		camera->capture_memory = capture_memory;
+		camera->capture_prefix = 0;
+
+		ret = v4l2_buffers_request(camera->video_fd,
+					   camera->capture_type,
+					   camera->capture_memory, count);
+	}
+
 	if (ret) {
 		fprintf(stderr, "Failed to allocate capture buffers\n");
 		/* TODO: Cleanup previous allocations on error. */
@@ -234,6 +937,26 @@ int demo_camera_setup(struct demo *demo)
 			/* TODO: Cleanup previous allocations on error. */
 			return ret;
 		}
+
+		if (camera->capture_memory == V4L2_MEMORY_USERPTR) {
+			ret = demo_camera_prefix_setup(demo,
+						&camera->capture_buffers[i]);
+			if (ret) {
+				fprintf(stderr, "Failed to allocate capture "
+					"memory\n");
+				return ret;
+			}
+
+			continue;
+		}
+
+		/* Export dma-buf fds once for binding to decoder buffers. */
+		ret = demo_buffer_export(&camera->capture_buffers[i],
+					 camera->video_fd);
+		if (ret) {
+			fprintf(stderr, "Failed to export capture buffer\n");
+			return ret;
+		}
 	}
 
 	camera->capture_buffers_count = count;
@@ -244,13 +967,21 @@ int demo_camera_setup(struct demo *demo)
 void demo_camera_cleanup(struct demo *demo)
 {
 	struct demo_camera *camera = &demo->camera;
+	struct demo_buffer *buffer;
 	unsigned int count;
 	unsigned int i;
 
 	/* Capture buffers cleanup */
 
-	for (i = 0; i < camera->capture_buffers_count; i++)
-		demo_buffer_cleanup(&camera->capture_buffers[i]);
+	for (i = 0; i < camera->capture_buffers_count; i++) {
+		buffer = &camera->capture_buffers[i];
+
+		if (camera->capture_memory == V4L2_MEMORY_USERPTR &&
+		    buffer->data[0])
+			free((char *)buffer->data[0] - camera->capture_prefix);
+
+		demo_buffer_cleanup(buffer);
+	}
 
 	v4l2_buffers_destroy(camera->video_fd, camera->capture_type,
 			     camera->capture_memory);
@@ -0,0 +1,645 @@
+/*
+ * Copyright (C) 2024 Paul Kocialkowski <contact@paulk.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#ifdef CONFIG_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+
+#include "demo.h"
+
+/*
+ * Decoded frames are copied to a slot and split into slices of whole lines,
+ * that a pool of workers compresses independently. Each worker reserves room
+ * at the end of the file and writes its chunk there, so chunks may land out
+ * of order. A trailing index, sorted by frame then slice, gives the offset
+ * of each chunk for random access. All fields are stored in host byte order:
+ *
+ * header | chunk (header + data) ... | index entries | footer
+ */
+
+#define DEMO_COMPRESS_MAGIC		"CJDC"
+#define DEMO_COMPRESS_INDEX_MAGIC	"CJDI"
+#define DEMO_COMPRESS_VERSION		2
+#define DEMO_COMPRESS_ZSTD_LEVEL	1
+
+struct demo_compress_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t codec;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t pixel_format;
+	uint32_t frame_size;
+	uint32_t slices_count;
+};
+
+struct demo_compress_chunk {
+	uint32_t frame;
+	uint32_t slice;
+	uint32_t size;
+	uint32_t size_raw;
+};
+
+struct demo_compress_entry {
+	uint64_t offset;
+	uint32_t frame;
+	uint32_t slice;
+	uint32_t size;
+	uint32_t size_raw;
+};
+
+struct demo_compress_footer {
+	uint64_t index_offset;
+	uint32_t index_count;
+	char magic[4];
+};
+
+struct demo_compress_slot {
+	void *data;
+	unsigned int size;
+	unsigned int frame;
+
+	/* Slices left to compress, free when zero. */
+	unsigned int pending;
+};
+
+struct demo_compress_worker {
+	struct demo_compress *compress;
+	pthread_t thread;
+
+	void *output;
+	size_t output_size;
+
+#ifdef CONFIG_ZSTD
+	ZSTD_CCtx *zstd_context;
+#endif
+};
+
+bool demo_compress_codec_check(int codec)
+{
+	switch (codec) {
+#ifdef CONFIG_LZ4
+	case DEMO_COMPRESS_CODEC_LZ4:
+		return true;
+#endif
+#ifdef CONFIG_ZSTD
+	case DEMO_COMPRESS_CODEC_ZSTD:
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
+static size_t demo_compress_bound(int codec, size_t size)
+{
+	switch (codec) {
+#ifdef CONFIG_LZ4
+	case DEMO_COMPRESS_CODEC_LZ4:
+		return LZ4_compressBound(size);
+#endif
+#ifdef CONFIG_ZSTD
+	case DEMO_COMPRESS_CODEC_ZSTD:
+		return ZSTD_compressBound(size);
+#endif
+	default:
+		return 0;
+	}
+}
+
+static int demo_compress_data(struct demo_compress_worker *worker,
+			      const void *data, size_t size, void *output,
+			      size_t output_size, size_t *size_compressed)
+{
+	struct demo_compress *compress = worker->compress;
+
+	switch (compress->codec) {
+#ifdef CONFIG_LZ4
+	case DEMO_COMPRESS_CODEC_LZ4: {
+		int ret;
+
+		ret = LZ4_compress_default(data, output, size, output_size);
+		if (ret <= 0)
+			return -EIO;
+
+		*size_compressed = ret;
+		return 0;
+	}
+#endif
+#ifdef CONFIG_ZSTD
+	case DEMO_COMPRESS_CODEC_ZSTD: {
+		size_t ret;
+
+		ret = ZSTD_compressCCtx(worker->zstd_context, output,
+					output_size, data, size,
+					DEMO_COMPRESS_ZSTD_LEVEL);
+		if (ZSTD_isError(ret))
+			return -EIO;
+
+		*size_compressed = ret;
+		return 0;
+	}
+#endif
+	default:
+		return -EINVAL;
+	}
+}
+
+static int demo_compress_pwrite(int fd, const void *data, size_t size,
+				uint64_t offset)
+{
+	ssize_t ret;
+
+	while (size) {
+		ret = pwrite(fd, data, size, offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return -errno;
+		}
+
+		data = (const char *)data + ret;
+		size -= ret;
+		offset += ret;
+	}
+
+	return 0;
+}
+
+static int demo_compress_entry_append(struct demo_compress *compress,
+				      struct demo_compress_entry *entry)
+{
+	struct demo_compress_entry *entries;
+	unsigned int size;
+
+	if (compress->entries_count == compress->entries_size) {
+		size = compress->entries_size ? compress->entries_size * 2 :
+		       64;
+
+		entries = realloc(compress->entries, size * sizeof(*entries));
+		if (!entries)
+			return -ENOMEM;
+
+		compress->entries = entries;
+		compress->entries_size = size;
+	}
+
+	compress->entries[compress->entries_count++] = *entry;
+
+	return 0;
+}
+
+static int demo_compress_entry_compare(const void *a, const void *b)
+{
+	const struct demo_compress_entry *entry_a = a;
+	const struct demo_compress_entry *entry_b = b;
+
+	if (entry_a->frame != entry_b->frame)
+		return entry_a->frame < entry_b->frame ? -1 : 1;
+
+	if (entry_a->slice != entry_b->slice)
+		return entry_a->slice < entry_b->slice ? -1 : 1;
+
+	return 0;
+}
+
+static int demo_compress_slice(struct demo_compress_worker *worker,
+			       struct demo_compress_slot *slot,
+			       unsigned int slice)
+{
+	struct demo_compress *compress = worker->compress;
+	struct demo_compress_chunk *chunk = worker->output;
+	struct demo_compress_entry entry = { 0 };
+	unsigned int offset = slice * compress->slice_size;
+	unsigned int size;
+	size_t size_compressed;
+	size_t size_chunk;
+	int ret;
+
+	if (offset >= slot->size)
+		size = 0;
+	else if (slot->size - offset < compress->slice_size)
+		size = slot->size - offset;
+	else
+		size = compress->slice_size;
+
+	ret = demo_compress_data(worker, (char *)slot->data + offset, size,
+				 chunk + 1, worker->output_size -
+				 sizeof(*chunk), &size_compressed);
+	if (ret)
+		return ret;
+
+	chunk->frame = slot->frame;
+	chunk->slice = slice;
+	chunk->size = size_compressed;
+	chunk->size_raw = size;
+
+	size_chunk = sizeof(*chunk) + size_compressed;
+
+	entry.frame = slot->frame;
+	entry.slice = slice;
+	entry.size = size_compressed;
+	entry.size_raw = size;
+
+	/* Reserve room for the chunk, written without holding the lock. */
+	pthread_mutex_lock(&compress->lock);
+
+	entry.offset = compress->offset + sizeof(*chunk);
+	compress->offset += size_chunk;
+	compress->size_raw += size;
+	compress->size += size_compressed;
+
+	ret = demo_compress_entry_append(compress, &entry);
+
+	pthread_mutex_unlock(&compress->lock);
+
+	if (ret)
+		return ret;
+
+	return demo_compress_pwrite(compress->fd, chunk, size_chunk,
+				    entry.offset - sizeof(*chunk));
+}
+
+static void *demo_compress_work(void *data)
+{
+	struct demo_compress_worker *worker = data;
+	struct demo_compress *compress = worker->compress;
+	struct demo_compress_slot *slot;
+	unsigned int task;
+	unsigned int slice;
+	int error;
+	int ret;
+
+	while (1) {
+		pthread_mutex_lock(&compress->lock);
+
+		while (!compress->tasks_count && !compress->stopping)
+			pthread_cond_wait(&compress->task_cond,
+					  &compress->lock);
+
+		/* Remaining tasks are still processed when stopping. */
+		if (!compress->tasks_count) {
+			pthread_mutex_unlock(&compress->lock);
+			break;
+		}
+
+		task = compress->tasks[compress->tasks_head];
+		compress->tasks_head = (compress->tasks_head + 1) %
+				       compress->tasks_size;
+		compress->tasks_count--;
+
+		error = compress->error;
+
+		pthread_mutex_unlock(&compress->lock);
+
+		slot = &compress->slots[task / compress->slices_count];
+		slice = task % compress->slices_count;
+
+		if (!error) {
+			ret = demo_compress_slice(worker, slot, slice);
+			if (ret) {
+				fprintf(stderr, "Failed to compress frame %u "
+					"slice %u\n", slot->frame, slice);
+
+				pthread_mutex_lock(&compress->lock);
+				compress->error = ret;
+				pthread_mutex_unlock(&compress->lock);
+			}
+		}
+
+		pthread_mutex_lock(&compress->lock);
+
+		slot->pending--;
+		if (!slot->pending)
+			pthread_cond_broadcast(&compress->slot_cond);
+
+		pthread_mutex_unlock(&compress->lock);
+	}
+
+	return NULL;
+}
+
+int demo_compress_frame(struct demo *demo, struct demo_buffer *buffer)
+{
+	struct demo_compress *compress = &demo->compress;
+	struct demo_compress_slot *slot = NULL;
+	unsigned int size;
+	unsigned int task;
+	unsigned int i;
+	int ret;
+
+	if (!demo || !buffer)
+		return -EINVAL;
+
+	v4l2_buffer_plane_length_used(&buffer->buffer, 0, &size);
+	if (size > compress->frame_size)
+		return -EINVAL;
+
+	pthread_mutex_lock(&compress->lock);
+
+	/* Wait for workers to release a slot. */
+	while (!compress->error) {
+		for (i = 0; i < compress->slots_count; i++) {
+			if (!compress->slots[i].pending) {
+				slot = &compress->slots[i];
+				break;
+			}
+		}
+
+		if (slot)
+			break;
+
+		pthread_cond_wait(&compress->slot_cond, &compress->lock);
+	}
+
+	ret = compress->error;
+	if (!ret)
+		slot->pending = compress->slices_count;
+
+	pthread_mutex_unlock(&compress->lock);
+
+	if (ret)
+		return ret;
+
+	memcpy(slot->data, buffer->data[0], size);
+
+	slot->size = size;
+	slot->frame = compress->frames_count++;
+
+	pthread_mutex_lock(&compress->lock);
+
+	task = (slot - compress->slots) * compress->slices_count;
+
+	/* Tasks never outnumber the slices of all slots. */
+	for (i = 0; i < compress->slices_count; i++) {
+		compress->tasks[compress->tasks_tail] = task + i;
+		compress->tasks_tail = (compress->tasks_tail + 1) %
+				       compress->tasks_size;
+		compress->tasks_count++;
+	}
+
+	pthread_cond_broadcast(&compress->task_cond);
+	pthread_mutex_unlock(&compress->lock);
+
+	return 0;
+}
+
+int demo_compress_start(struct demo *demo, int fd)
+{
+	struct demo_compress *compress = &demo->compress;
+	struct demo_sink *sink = &demo->sink;
+	struct demo_compress_header header = { 0 };
+	struct demo_compress_worker *worker;
+	unsigned int lines;
+	unsigned int i;
+	int ret;
+
+	if (!demo || !compress->threads_count || !compress->slices_count)
+		return -EINVAL;
+
+	if (!demo_compress_codec_check(compress->codec)) {
+		fprintf(stderr, "Unsupported compression codec\n");
+		return -EINVAL;
+	}
+
+	compress->fd = fd;
+	compress->frame_size = sink->frame_size;
+	compress->frames_count = 0;
+	compress->error = 0;
+	compress->stopping = false;
+	compress->tasks_head = 0;
+	compress->tasks_tail = 0;
+	compress->tasks_count = 0;
+	compress->size = 0;
+	compress->size_raw = 0;
+
+	/* Slices span whole lines so that they map to picture regions. */
+	lines = (compress->frame_size + sink->stride - 1) / sink->stride;
+	if (compress->slices_count > lines)
+		compress->slices_count = lines;
+
+	compress->slice_size = (lines + compress->slices_count - 1) /
+			       compress->slices_count * sink->stride;
+
+	/* Keep every worker busy while the next frames are copied in. */
+	compress->slots_count = compress->threads_count + 1;
+	compress->tasks_size = compress->slots_count * compress->slices_count;
+
+	memcpy(header.magic, DEMO_COMPRESS_MAGIC, sizeof(header.magic));
+	header.version = DEMO_COMPRESS_VERSION;
+	header.codec = compress->codec;
+	header.width = sink->width;
+	header.height = sink->height;
+	header.stride = sink->stride;
+	header.pixel_format = demo->decoder.capture_pixel_format;
+	header.frame_size = compress->frame_size;
+	header.slices_count = compress->slices_count;
+
+	ret = demo_compress_pwrite(fd, &header, sizeof(header), 0);
+	if (ret)
+		return ret;
+
+	compress->offset = sizeof(header);
+
+	compress->slots = calloc(compress->slots_count,
+				 sizeof(*compress->slots));
+	compress->tasks = calloc(compress->tasks_size,
+				 sizeof(*compress->tasks));
+	compress->workers = calloc(compress->threads_count,
+				   sizeof(*compress->workers));
+	if (!compress->slots || !compress->tasks || !compress->workers) {
+		ret = -ENOMEM;
+		goto error;
+	}
+
+	for (i = 0; i < compress->slots_count; i++) {
+		compress->slots[i].data = malloc(compress->frame_size);
+		if (!compress->slots[i].data) {
+			ret = -ENOMEM;
+			goto error;
+		}
+	}
+
+	for (i = 0; i < compress->threads_count; i++) {
+		worker = &compress->workers[i];
+		worker->compress = compress;
+		worker->output_size = sizeof(struct demo_compress_chunk) +
+				      demo_compress_bound(compress->codec,
+							  compress->slice_size);
+
+		worker->output = malloc(worker->output_size);
+		if (!worker->output) {
+			ret = -ENOMEM;
+			goto error;
+		}
+
+#ifdef CONFIG_ZSTD
+		worker->zstd_context = ZSTD_createCCtx();
+		if (!worker->zstd_context) {
+			ret = -ENOMEM;
+			goto error;
+		}
+#endif
+	}
+
+	pthread_mutex_init(&compress->lock, NULL);
+	pthread_cond_init(&compress->task_cond, NULL);
+	pthread_cond_init(&compress->slot_cond, NULL);
+
+	for (i = 0; i < compress->threads_count; i++) {
+		ret = pthread_create(&compress->workers[i].thread, NULL,
+				     demo_compress_work, &compress->workers[i]);
+		if (ret) {
+			fprintf(stderr, "Failed to create compression worker "
+				"thread: %s\n", strerror(ret));
+			ret = -ret;
+			goto error_threads;
+		}
+	}
+
+	printf("Compressing dump with %u workers, %u slices per frame\n",
+	       compress->threads_count, compress->slices_count);
+
+	return 0;
+
+error_threads:
+	pthread_mutex_lock(&compress->lock);
+	compress->stopping = true;
+	pthread_cond_broadcast(&compress->task_cond);
+	pthread_mutex_unlock(&compress->lock);
+
+	while (i--)
+		pthread_join(compress->workers[i].thread, NULL);
+
+	pthread_mutex_destroy(&compress->lock);
+	pthread_cond_destroy(&compress->task_cond);
+	pthread_cond_destroy(&compress->slot_cond);
+
+error:
+	demo_compress_cleanup(demo);
+
+	return ret;
+}
+
+int demo_compress_finish(struct demo *demo)
+{
+	struct demo_compress *compress = &demo->compress;
+	struct demo_compress_footer footer = { 0 };
+	unsigned int i;
+	int ret;
+
+	if (!demo || !compress->workers)
+		return -EINVAL;
+
+	pthread_mutex_lock(&compress->lock);
+	compress->stopping = true;
+	pthread_cond_broadcast(&compress->task_cond);
+	pthread_mutex_unlock(&compress->lock);
+
+	for (i = 0; i < compress->threads_count; i++)
+		pthread_join(compress->workers[i].thread, NULL);
+
+	ret = compress->error;
+	if (ret)
+		goto complete;
+
+	/* Chunks complete out of order but are looked up by frame. */
+	qsort(compress->entries, compress->entries_count,
+	      sizeof(*compress->entries), demo_compress_entry_compare);
+
+	ret = demo_compress_pwrite(compress->fd, compress->entries,
+				   compress->entries_count *
+				   sizeof(*compress->entries),
+				   compress->offset);
+	if (ret)
+		goto complete;
+
+	footer.index_offset = compress->offset;
+	footer.index_count = compress->entries_count;
+	memcpy(footer.magic, DEMO_COMPRESS_INDEX_MAGIC, sizeof(footer.magic));
+
+	ret = demo_compress_pwrite(compress->fd, &footer, sizeof(footer),
+				   compress->offset + compress->entries_count *
+				   sizeof(*compress->entries));
+	if (ret)
+		goto complete;
+
+	printf("Compressed %u frames from %"PRIu64" to %"PRIu64" bytes\n",
+	       compress->frames_count, compress->size_raw, compress->size);
+
+complete:
+	pthread_mutex_destroy(&compress->lock);
+	pthread_cond_destroy(&compress->task_cond);
+	pthread_cond_destroy(&compress->slot_cond);
+
+	demo_compress_cleanup(demo);
+
+	return ret;
+}
+
+void demo_compress_cleanup(struct demo *demo)
+{
+	struct demo_compress *compress = &demo->compress;
+	struct demo_compress_worker *worker;
+	unsigned int i;
+
+	if (compress->workers) {
+		for (i = 0; i < compress->threads_count; i++) {
+			worker = &compress->workers[i];
+
+			free(worker->output);
+#ifdef CONFIG_ZSTD
+			if (worker->zstd_context)
+				ZSTD_freeCCtx(worker->zstd_context);
+#endif
+		}
+
+		free(compress->workers);
+		compress->workers = NULL;
+	}
+
+	if (compress->slots) {
+		for (i = 0; i < compress->slots_count; i++)
+			free(compress->slots[i].data);
+
+		free(compress->slots);
+		compress->slots = NULL;
+	}
+
+	free(compress->tasks);
+	compress->tasks = NULL;
+
+	free(compress->entries);
+	compress->entries = NULL;
+	compress->entries_count = 0;
+	compress->entries_size = 0;
+}
@@ -17,6 +17,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <errno.h>
 
 #include "demo.h"
@@ -64,76 +66,167 @@ int demo_decoder_buffer_cycle(struct demo *demo, unsigned int type)
 	return 0;
 }
 
-int demo_decoder_run(struct demo *demo)
+int demo_decoder_start(struct demo *demo)
 {
 	struct demo_decoder *decoder = &demo->decoder;
-	struct perf perf = { 0 };
-	struct demo_buffer *buffer;
-	struct v4l2_buffer buffer_dequeue;
-	struct timeval timeout = { 0, 300000 };
-	unsigned int count;
-	unsigned int i;
 	int ret;
 
 	if (!demo)
 		return -EINVAL;
 
-	perf_before(&perf);
-
-	ret = demo_decoder_buffer_current(demo, decoder->capture_type, &buffer);
-	if (ret)
+	ret = v4l2_stream_on(decoder->video_fd, decoder->capture_type);
+	if (ret) {
+		fprintf(stderr, "Failed to start capture stream\n");
 		return ret;
+	}
 
-	ret = v4l2_buffer_queue(decoder->video_fd, &buffer->buffer);
+	ret = v4l2_stream_on(decoder->video_fd, decoder->output_type);
 	if (ret) {
-		fprintf(stderr, "Failed to queue capture buffer\n");
+		fprintf(stderr, "Failed to start output stream\n");
 		return ret;
 	}
 
-	ret = demo_decoder_buffer_current(demo, decoder->output_type, &buffer);
+	return 0;
+}
+
+int demo_decoder_stop(struct demo *demo)
+{
+	struct demo_decoder *decoder = &demo->decoder;
+	int ret;
+
+	if (!demo)
+		return -EINVAL;
+
+	ret = v4l2_stream_off(decoder->video_fd, decoder->capture_type);
 	if (ret)
 		return ret;
 
-	/* Copy used length from camera source buffer. */
-	if (demo->source == DEMO_SOURCE_CAMERA) {
-		struct demo_camera *camera = &demo->camera;
-		struct demo_buffer *camera_buffer =
-			&camera->capture_buffers[decoder->capture_buffer_index];
+	ret = v4l2_stream_off(decoder->video_fd, decoder->output_type);
+	if (ret)
+		return ret;
 
-		for (i = 0; i < buffer->planes_count; i++) {
-			unsigned int size;
+	return 0;
+}
 
-			v4l2_buffer_plane_length_used(&camera_buffer->buffer, i,
-						      &size);
-			v4l2_buffer_setup_plane_length_used(&buffer->buffer, i,
-							    size);
+int demo_decoder_output_import(struct demo *demo,
+			       struct demo_buffer *output_buffer,
+			       struct demo_buffer *camera_buffer)
+{
+	unsigned int offset;
+	unsigned int size;
+	void *data;
+	int ret;
+
+	if (!demo || !output_buffer || !camera_buffer)
+		return -EINVAL;
+
+	/* Frames lacking Huffman tables get the standard ones. */
+	ret = demo_mjpeg_normalize(demo, camera_buffer, output_buffer, &offset,
+				   &size);
+	if (ret == -EBADMSG) {
+		demo->frames_rejected++;
+		return ret;
+	} else if (ret) {
+		fprintf(stderr, "Failed to normalize camera frame\n");
+		return ret;
+	}
+
+	if (output_buffer->buffer.memory == V4L2_MEMORY_MMAP) {
+		/* Frames were copied, the camera buffer is released later. */
+		output_buffer->import_buffer = camera_buffer;
+	} else if (output_buffer->buffer.memory == V4L2_MEMORY_USERPTR) {
+		/* Camera user memory is read from the start of the frame. */
+		data = (char *)camera_buffer->data[0] - offset;
+
+		v4l2_buffer_setup_userptr(&output_buffer->buffer, 0, data);
+		output_buffer->data[0] = data;
+
+		/* Track the bound camera buffer for its release. */
+		output_buffer->import_buffer = camera_buffer;
+	} else {
+		ret = demo_buffer_import(output_buffer, camera_buffer);
+		if (ret) {
+			fprintf(stderr, "Failed to import camera buffer\n");
+			return ret;
 		}
 	}
 
-	ret = v4l2_buffer_queue(decoder->video_fd, &buffer->buffer);
-	if (ret) {
-		fprintf(stderr, "Failed to queue output buffer\n");
-		return ret;
+	v4l2_buffer_setup_plane_length_used(&output_buffer->buffer, 0, size);
+
+	return 0;
+}
+
+int demo_decoder_submit(struct demo *demo, struct demo_buffer *output_buffer,
+			struct demo_buffer *capture_buffer)
+{
+	struct demo_decoder *decoder = &demo->decoder;
+	int ret;
+
+	if (!demo || !output_buffer || !capture_buffer)
+		return -EINVAL;
+
+	if (decoder->capture_memory == V4L2_MEMORY_USERPTR) {
+		ret = demo_sink_frame_bind(demo, capture_buffer);
+		if (ret)
+			return ret;
 	}
 
-	ret = v4l2_stream_on(decoder->video_fd, decoder->capture_type);
+	ret = v4l2_buffer_queue(decoder->video_fd, &capture_buffer->buffer);
 	if (ret) {
-		fprintf(stderr, "Failed to start capture stream\n");
+		fprintf(stderr, "Failed to queue capture buffer\n");
 		return ret;
 	}
 
-	ret = v4l2_stream_on(decoder->video_fd, decoder->output_type);
+	ret = v4l2_buffer_queue(decoder->video_fd, &output_buffer->buffer);
+	if ((ret == -EINVAL || ret == -EFAULT) &&
+	    demo->source == DEMO_SOURCE_STREAM &&
+	    !demo_stream_frame_bounce(demo, output_buffer))
+		ret = v4l2_buffer_queue(decoder->video_fd,
+					&output_buffer->buffer);
+
 	if (ret) {
-		fprintf(stderr, "Failed to start output stream\n");
+		fprintf(stderr, "Failed to queue output buffer\n");
 		return ret;
 	}
 
-	ret = v4l2_poll(decoder->video_fd, &timeout);
+	return 0;
+}
+
+int demo_decoder_reap(struct demo *demo, unsigned int *output_index,
+		      unsigned int *capture_index)
+{
+	struct demo_decoder *decoder = &demo->decoder;
+	struct demo_buffer *capture_buffer;
+	struct v4l2_buffer buffer_dequeue;
+	struct timeval timeout = { 0, 300000 };
+	struct perf perf = { 0 };
+	unsigned int size;
+	int ret = 0;
+
+	if (!demo || !output_index || !capture_index)
+		return -EINVAL;
+
+	perf_before(&perf);
+
+	if (decoder->spin_budget) {
+		ret = v4l2_poll_spin(decoder->video_fd, decoder->spin_budget);
+		if (ret > 0)
+			decoder->spin_count++;
+	}
+
+	if (!ret)
+		ret = v4l2_poll(decoder->video_fd, &timeout);
+
 	if (ret <= 0) {
 		fprintf(stderr, "Error waiting for decode\n");
 		return ret == 0 ? -ETIMEDOUT : ret;
 	}
 
+	perf_after(&perf);
+
+	perf_histogram_add(&decoder->wait,
+			   timespec_diff(perf.before, perf.after));
+
 	v4l2_buffer_setup_base(&buffer_dequeue, decoder->capture_type,
 			       decoder->capture_memory);
 
@@ -143,10 +236,13 @@ int demo_decoder_run(struct demo *demo)
 		return ret;
 	}
 
-	if (buffer_dequeue.index != decoder->capture_buffer_index)
-		fprintf(stderr,
-			"Dequeued unexpected capture buffer (%d vs %d)\n",
-			buffer_dequeue.index, decoder->capture_buffer_index);
+	*capture_index = buffer_dequeue.index;
+
+	/* Keep track of the decoded size for later processing. */
+	capture_buffer = &decoder->capture_buffers[buffer_dequeue.index];
+
+	v4l2_buffer_plane_length_used(&buffer_dequeue, 0, &size);
+	v4l2_buffer_setup_plane_length_used(&capture_buffer->buffer, 0, size);
 
 	v4l2_buffer_setup_base(&buffer_dequeue, decoder->output_type,
 			       decoder->output_memory);
@@ -157,16 +253,137 @@ int demo_decoder_run(struct demo *demo)
 		return ret;
 	}
 
-	if (buffer_dequeue.index != decoder->output_buffer_index)
-		fprintf(stderr,
-			"Dequeued unexpected output buffer (%d vs %d)\n",
-			buffer_dequeue.index, decoder->output_buffer_index);
+	*output_index = buffer_dequeue.index;
 
-	ret = v4l2_stream_off(decoder->video_fd, decoder->capture_type);
+	return 0;
+}
+
+/*
+ * Waits span from reaping to the completion being seen, whether by spinning
+ * or after sleeping in poll, so they include any wakeup latency rather than
+ * measuring it.
+ */
+void demo_decoder_wait_report(struct demo *demo)
+{
+	struct demo_decoder *decoder = &demo->decoder;
+	struct perf_histogram *wait = &decoder->wait;
+
+	if (!wait->count)
+		return;
+
+	printf("Decoder completion wait mean %"PRIu64" us max %"PRIu64" us",
+	       wait->total / wait->count / 1000, wait->max / 1000);
+
+	if (decoder->spin_budget)
+		printf(", %u of %u within %u us spin budget",
+		       decoder->spin_count, wait->count,
+		       decoder->spin_budget);
+	else
+		printf(", sleeping");
+
+	printf("\n");
+
+	perf_histogram_print(wait);
+}
+
+/* Single frames are decoded by the whole pool, in slices when possible. */
+static int demo_decoder_run_software(struct demo *demo)
+{
+	struct demo_decoder *decoder = &demo->decoder;
+	struct perf perf = { 0 };
+	unsigned int output_index = decoder->output_buffer_index;
+	unsigned int capture_index = decoder->capture_buffer_index;
+	int ret;
+
+	perf_before(&perf);
+
+	ret = demo_scheduler_submit(demo, output_index, capture_index);
 	if (ret)
 		return ret;
 
-	ret = v4l2_stream_off(decoder->video_fd, decoder->output_type);
+	ret = demo_scheduler_reap(demo, &output_index, &capture_index);
+	if (ret)
+		return ret;
+
+	perf_after(&perf);
+
+	perf_print(&perf, "software decode");
+
+	return 0;
+}
+
+int demo_decoder_run(struct demo *demo)
+{
+	struct demo_decoder *decoder = &demo->decoder;
+	struct perf perf = { 0 };
+	struct demo_buffer *output_buffer;
+	struct demo_buffer *capture_buffer;
+	struct demo_buffer *camera_buffer;
+	unsigned int output_index;
+	unsigned int capture_index;
+	int route;
+	int ret;
+
+	if (!demo)
+		return -EINVAL;
+
+	perf_before(&perf);
+
+	ret = demo_decoder_buffer_current(demo, decoder->capture_type,
+					  &capture_buffer);
+	if (ret)
+		return ret;
+
+	ret = demo_decoder_buffer_current(demo, decoder->output_type,
+					  &output_buffer);
+	if (ret)
+		return ret;
+
+	if (demo->source == DEMO_SOURCE_CAMERA) {
+		ret = demo_camera_buffer_current(demo, &camera_buffer);
+		if (ret)
+			return ret;
+
+		ret = demo_decoder_output_import(demo, output_buffer,
+						 camera_buffer);
+		if (ret)
+			return ret;
+	}
+
+	/* Frames the hardware cannot decode are decoded in software. */
+	if (demo->scheduler.threads_count) {
+		route = demo_scheduler_classify(demo, &demo->scheduler.jpeg,
+						output_buffer);
+		if (route < 0)
+			return route;
+
+		if (route == DEMO_SCHEDULER_ROUTE_SOFTWARE)
+			return demo_decoder_run_software(demo);
+	}
+
+	ret = demo_decoder_submit(demo, output_buffer, capture_buffer);
+	if (ret)
+		return ret;
+
+	ret = demo_decoder_start(demo);
+	if (ret)
+		return ret;
+
+	ret = demo_decoder_reap(demo, &output_index, &capture_index);
+	if (ret)
+		return ret;
+
+	if (capture_index != decoder->capture_buffer_index)
+		fprintf(stderr,
+			"Dequeued unexpected capture buffer (%d vs %d)\n",
+			capture_index, decoder->capture_buffer_index);
+
+	if (output_index != decoder->output_buffer_index)
+		fprintf(stderr,
+			"Dequeued unexpected output buffer (%d vs %d)\n",
+			output_index, decoder->output_buffer_index);
+
+	ret = demo_decoder_stop(demo);
 	if (ret)
 		return ret;
 
@@ -177,14 +394,429 @@ int demo_decoder_run(struct demo *demo)
 	return 0;
 }
 
-int demo_decoder_setup(struct demo *demo)
+static bool demo_decoder_userptr_check(struct demo *demo, unsigned int type,
+				       unsigned int memory)
+{
+	struct demo_decoder *decoder = &demo->decoder;
+	unsigned int capabilities;
+	int ret;
+
+	ret = v4l2_buffers_capabilities_probe(decoder->video_fd, type, memory,
+					      &capabilities);
+	if (ret)
+		return false;
+
+	return capabilities & V4L2_BUF_CAP_SUPPORTS_USERPTR;
+}
+
+/*
+ * Frames are laid out as the hardware writes them, unless they are only ever
+ * decoded by CPU workers.
+ */
+void demo_decoder_layout(struct demo *demo, unsigned int *stride,
+			 unsigned int *width, unsigned int *height)
+{
+	struct demo_decoder *decoder = &demo->decoder;
+	struct v4l2_format *format = &decoder->capture_format;
+
+	if (decoder->capture_packed) {
+		*stride = decoder->capture_width;
+		*width = decoder->capture_width;
+		*height = decoder->capture_height;
+		return;
+	}
+
+	*stride = 0;
+
+	v4l2_format_pixel(format, width, height, NULL);
+	v4l2_format_bytesperline(format, 0, stride);
+
+	if (!*stride)
+		*stride = *width;
+}
+
+static bool demo_decoder_selection_set(struct demo *demo, unsigned int target,
+				       struct v4l2_rect *rect)
+{
+	struct demo_decoder *decoder = &demo->decoder;
+	struct v4l2_selection selection;
+	int ret;
+
+	v4l2_selection_setup_base(&selection, decoder->capture_type, target);
+	v4l2_selection_setup_rect(&selection, rect->left, rect->top,
+				  rect->width, rect->height);
+
+	ret = v4l2_selection_set(decoder->video_fd, &selection);
+	if (ret)
+		return false;
+
+	return selection.r.left == rect->left && selection.r.top == rect->top &&
+	       selection.r.width == rect->width &&
+	       selection.r.height == rect->height;
+}
+
+/*
+ * Cropping and downscaling are requested with crop and compose rectangles,
+ * falling back to CPU workers for decoders that keep the capture format full
+ * size.
+ */
+static int demo_decoder_selection_setup(struct demo *demo)
+{
+	struct demo_decoder *decoder = &demo->decoder;
+	struct v4l2_rect compose = { 0 };
+	unsigned int width, height;
+	bool hardware = true;
+	const char *label;
+
+	if (!decoder->crop.width)
+		label = "Downscaling";
+	else if (decoder->scale > 1)
+		label = "Cropping and downscaling";
+	else
+		label = "Cropping";
+
+	v4l2_format_pixel(&decoder->capture_format, &width, &height, NULL);
+
+	if (decoder->crop.width)
+		hardware = demo_decoder_selection_set(demo,
+						      V4L2_SEL_TGT_CROP,
+						      &decoder->crop);
+
+	compose.width = decoder->capture_width;
+	compose.height = decoder->capture_height;
+
+	if (hardware)
+		hardware = demo_decoder_selection_set(demo,
+						      V4L2_SEL_TGT_COMPOSE,
+						      &compose);
+
+	if (hardware && (width < decoder->output_width ||
+			 height < decoder->output_height)) {
+		printf("%s in hardware\n", label);
+		return 0;
+	}
+
+	if (!demo->scheduler.threads_count) {
+		fprintf(stderr, "%s lacks decoder support, CPU workers are "
+			"needed\n", label);
+		return -ENOTSUP;
+	}
+
+	decoder->capture_packed = true;
+
+	printf("%s on CPU workers\n", label);
+
+	return 0;
+}
+
+static bool demo_decoder_format_usable(struct demo *demo,
+				       const struct demo_format *format)
+{
+	if (!format || !demo_format_convertible(format,
+						demo_sink_pixel_format(demo)))
+		return false;
+
+	/* CPU workers only write linear frames. */
+	if (format->tile_width && demo->scheduler.threads_count)
+		return false;
+
+	return true;
+}
+
+/*
+ * The capture format is picked among those the decoder offers, as the
+ * cheapest to produce and convert to what the sink consumes.
+ */
+static int demo_decoder_format_negotiate(struct demo *demo, bool refresh,
+					 bool *cached)
+{
+	struct demo_decoder *decoder = &demo->decoder;
+	unsigned int pixel_formats[DEMO_FORMATS_MAX];
+	unsigned int count = DEMO_FORMATS_MAX;
+	const struct demo_format *format;
+	const struct demo_format *target;
+	const struct demo_format *best = NULL;
+	size_t cost, cost_best = SIZE_MAX;
+	unsigned int i;
+	int ret;
+
+	target = demo_sink_pixel_format(demo);
+
+	*cached = false;
+
+	if (!refresh) {
+		ret = demo_format_cache_load(decoder->device,
+					     decoder->capture_type,
+					     pixel_formats, &count);
+		*cached = !ret;
+	}
+
+	if (!*cached) {
+		for (count = 0; count < DEMO_FORMATS_MAX; count++) {
+			ret = v4l2_pixel_format_enum(decoder->video_fd,
+						     decoder->capture_type,
+						     count,
+						     &pixel_formats[count],
+						     NULL);
+			if (ret)
+				break;
+		}
+
+		/* Decoding goes on without the cache when it can't be saved. */
+		demo_format_cache_store(decoder->device, decoder->capture_type,
+					pixel_formats, count);
+	}
+
+	for (i = 0; i < count; i++) {
+		format = demo_format_find(pixel_formats[i]);
+		if (!demo_decoder_format_usable(demo, format))
+			continue;
+
+		cost = demo_format_cost(format, target, decoder->capture_width,
+					decoder->capture_height);
+		if (cost < cost_best) {
+			cost_best = cost;
+			best = format;
+		}
+	}
+
+	if (!best) {
+		fprintf(stderr, "Missing capture pixel format support\n");
+		return -EINVAL;
+	}
+
+	decoder->capture_pixel_format = best->pixel_format;
+
+	printf("Selected %s capture format for %s frames%s\n", best->name,
+	       target->name, *cached ? " (cached)" : "");
+
+	return 0;
+}
+
+/* The region of interest is rounded out to whole downscaled samples. */
+static int demo_decoder_crop_setup(struct demo *demo)
+{
+	struct demo_decoder *decoder = &demo->decoder;
+	struct v4l2_rect *crop = &decoder->crop;
+	unsigned int scale = decoder->scale;
+	unsigned int right, bottom;
+
+	if (!crop->width) {
+		decoder->capture_x = 0;
+		decoder->capture_y = 0;
+		right = demo->width;
+		bottom = demo->height;
+	} else if (crop->left < 0 || crop->top < 0 || !crop->height ||
+		   crop->left + crop->width > demo->width ||
+		   crop->top + crop->height > demo->height) {
+		fprintf(stderr, "Crop rectangle is out of frame bounds\n");
+		return -EINVAL;
+	} else {
+		/* Chroma samples are interleaved in pairs. */
+		decoder->capture_x = crop->left / scale & ~1;
+		decoder->capture_y = crop->top / scale;
+		right = crop->left + crop->width;
+		bottom = crop->top + crop->height;
+
+		crop->left = decoder->capture_x * scale;
+		crop->top = decoder->capture_y * scale;
+		crop->width = right - crop->left;
+		crop->height = bottom - crop->top;
+	}
+
+	/* Downscaled sizes are rounded up, as for partial blocks. */
+	decoder->capture_width = (right + scale - 1) / scale -
+				 decoder->capture_x;
+	decoder->capture_height = (bottom + scale - 1) / scale -
+				  decoder->capture_y;
+
+	return 0;
+}
+
+static int demo_decoder_output_buffers_setup(struct demo *demo)
 {
 	struct demo_decoder *decoder = &demo->decoder;
-	unsigned int planes_count;
+	bool import_camera = demo->source == DEMO_SOURCE_CAMERA;
 	unsigned int count;
-	unsigned int size;
 	unsigned int i;
+	int ret;
+
+	count = sizeof(decoder->output_buffers) /
+		sizeof(decoder->output_buffers[0]);
+
+	ret = v4l2_buffers_request(decoder->video_fd, decoder->output_type,
+				   decoder->output_memory, count);
+	if (ret) {
+		fprintf(stderr, "Failed to allocate output buffers\n");
+		return ret;
+	}
+
+	printf("Allocated %d output buffers for decoder\n", count);
+
+	for (i = 0; i < count; i++) {
+		ret = demo_buffer_setup(demo, &decoder->output_buffers[i],
+					decoder->video_fd,
+					decoder->output_memory,
+					decoder->output_type, i, 1,
+					import_camera);
+		if (ret) {
+			/* TODO: Cleanup previous allocations on error. */
+			return ret;
+		}
+	}
+
+	decoder->output_buffers_count = count;
+
+	return 0;
+}
+
+/*
+ * User pointers to the input stream mapping may only be refused when they are
+ * queued, so one is queued for real before decoding and output buffers are
+ * allocated again for copying frames when it is refused.
+ */
+int demo_decoder_output_userptr_validate(struct demo *demo, void *data)
+{
+	struct demo_decoder *decoder = &demo->decoder;
+	struct demo_buffer *buffer = &decoder->output_buffers[0];
+	unsigned int length;
+	unsigned int i;
+	int ret;
+
+	if (decoder->output_memory != V4L2_MEMORY_USERPTR)
+		return 0;
+
+	v4l2_buffer_plane_length(&buffer->buffer, 0, &length);
+	v4l2_buffer_setup_userptr(&buffer->buffer, 0, data);
+	v4l2_buffer_setup_plane_length_used(&buffer->buffer, 0, length);
+
+	ret = v4l2_buffer_queue(decoder->video_fd, &buffer->buffer);
+	if (!ret) {
+		/* Give the buffer back without decoding anything. */
+		ret = v4l2_stream_off(decoder->video_fd, decoder->output_type);
+		if (ret)
+			fprintf(stderr, "Failed to release output buffer\n");
+
+		return ret;
+	}
+
+	if (ret != -EINVAL && ret != -EFAULT) {
+		fprintf(stderr, "Failed to queue output buffer\n");
+		return ret;
+	}
+
+	printf("Decoder refused input stream memory, copying input\n");
+
+	for (i = 0; i < decoder->output_buffers_count; i++)
+		demo_buffer_cleanup(&decoder->output_buffers[i]);
+
+	v4l2_buffers_destroy(decoder->video_fd, decoder->output_type,
+			     decoder->output_memory);
+
+	decoder->output_buffers_count = 0;
+	decoder->output_memory = decoder->output_memory_copy;
+
+	return demo_decoder_output_buffers_setup(demo);
+}
+
+static int demo_decoder_capture_buffers_setup(struct demo *demo)
+{
+	struct demo_decoder *decoder = &demo->decoder;
+	unsigned int count;
+	unsigned int i;
+	int ret;
+
+	count = sizeof(decoder->capture_buffers) /
+		sizeof(decoder->capture_buffers[0]);
+
+	ret = v4l2_buffers_request(decoder->video_fd, decoder->capture_type,
+				   decoder->capture_memory, count);
+	if (ret) {
+		fprintf(stderr, "Failed to allocate capture buffers\n");
+		return ret;
+	}
+
+	printf("Allocated %d capture buffers for decoder\n", count);
+
+	for (i = 0; i < count; i++) {
+		ret = demo_buffer_setup(demo, &decoder->capture_buffers[i],
+					decoder->video_fd,
+					decoder->capture_memory,
+					decoder->capture_type, i, 1, false);
+		if (ret) {
+			/* TODO: Cleanup previous allocations on error. */
+			return ret;
+		}
+	}
+
+	decoder->capture_buffers_count = count;
+
+	return 0;
+}
+
+/*
+ * Drivers may only refuse user pointers to the mapped dump file when they
+ * are queued, for alignment or contiguity reasons. One is queued for real
+ * before decoding and capture buffers are allocated again for copying the
+ * frames to the dump file when it is refused.
+ */
+int demo_decoder_capture_userptr_validate(struct demo *demo)
+{
+	struct demo_decoder *decoder = &demo->decoder;
+	struct demo_buffer *buffer = &decoder->capture_buffers[0];
+	unsigned int i;
+	int ret;
+
+	if (decoder->capture_memory != V4L2_MEMORY_USERPTR)
+		return 0;
+
+	ret = demo_sink_frame_bind(demo, buffer);
+	if (ret)
+		return ret;
+
+	ret = v4l2_buffer_queue(decoder->video_fd, &buffer->buffer);
+	if (!ret) {
+		/* Give the buffer back without decoding anything. */
+		ret = v4l2_stream_off(decoder->video_fd,
+				      decoder->capture_type);
+		if (ret)
+			fprintf(stderr, "Failed to release capture buffer\n");
+
+		return ret;
+	}
+
+	if (ret != -EINVAL && ret != -EFAULT) {
+		fprintf(stderr, "Failed to queue capture buffer\n");
+		return ret;
+	}
+
+	printf("Decoder refused dump file memory, dump will copy\n");
+
+	for (i = 0; i < decoder->capture_buffers_count; i++)
+		demo_buffer_cleanup(&decoder->capture_buffers[i]);
+
+	v4l2_buffers_destroy(decoder->video_fd, decoder->capture_type,
+			     decoder->capture_memory);
+
+	decoder->capture_buffers_count = 0;
+	decoder->capture_memory = decoder->capture_memory_copy;
+
+	return demo_decoder_capture_buffers_setup(demo);
+}
+
+int demo_decoder_setup(struct demo *demo)
+{
+	struct demo_decoder *decoder = &demo->decoder;
+	struct demo_buffer *buffer;
+	unsigned int output_memory;
+	unsigned int capture_memory;
+	const struct demo_format *format;
+	unsigned int pixel_format;
+	unsigned int size;
 	bool import_camera = false;
+	bool mmap_request;
+	bool refresh;
+	bool cached;
 	bool check;
 	int ret;
 
@@ -214,14 +846,9 @@ int demo_decoder_setup(struct demo *demo)
 	decoder->output_height = demo->height;
 	decoder->output_pixel_format = V4L2_PIX_FMT_JPEG;
 
-	decoder->capture_width = demo->width;
-	decoder->capture_height = demo->height;
-	decoder->capture_pixel_format = V4L2_PIX_FMT_NV16;
-
-	decoder->output_type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
-	decoder->capture_type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-
-	planes_count = 1;
+	ret = demo_decoder_crop_setup(demo);
+	if (ret)
+		return ret;
 
 	/* Output pixel format check */
 
@@ -232,16 +859,6 @@ int demo_decoder_setup(struct demo *demo)
 		return -EINVAL;
 	}
 
-	/* Capture pixel format check */
-
-	check = v4l2_pixel_format_check(decoder->video_fd,
-					decoder->capture_type,
-					decoder->capture_pixel_format);
-	if (!check) {
-		fprintf(stderr, "Missing capture pixel format support\n");
-		return -EINVAL;
-	}
-
 	/* Output format setup */
 
 	v4l2_format_setup_base(&decoder->output_format, decoder->output_type);
@@ -274,15 +891,48 @@ int demo_decoder_setup(struct demo *demo)
 
 	/* Capture format setup */
 
-	v4l2_format_setup_base(&decoder->capture_format, decoder->capture_type);
-	v4l2_format_setup_pixel(&decoder->capture_format,
-				decoder->capture_width, decoder->capture_height,
-				decoder->capture_pixel_format);
+	for (refresh = false; ; refresh = true) {
+		ret = demo_decoder_format_negotiate(demo, refresh, &cached);
+		if (ret)
+			return ret;
 
-	ret = v4l2_format_try(decoder->video_fd, &decoder->capture_format);
-	if (ret) {
-		fprintf(stderr, "Failed to try capture format\n");
-		return ret;
+		v4l2_format_setup_base(&decoder->capture_format,
+				       decoder->capture_type);
+		v4l2_format_setup_pixel(&decoder->capture_format,
+					decoder->capture_width,
+					decoder->capture_height,
+					decoder->capture_pixel_format);
+
+		ret = v4l2_format_try(decoder->video_fd,
+				      &decoder->capture_format);
+		if (ret) {
+			fprintf(stderr, "Failed to try capture format\n");
+			return ret;
+		}
+
+		v4l2_format_pixel(&decoder->capture_format, NULL, NULL,
+				  &pixel_format);
+
+		if (pixel_format == decoder->capture_pixel_format)
+			break;
+
+		/* Cached formats are stale when drivers change. */
+		if (cached)
+			continue;
+
+		/* Formats adjusted by the decoder are kept when usable. */
+		format = demo_format_find(pixel_format);
+		if (!demo_decoder_format_usable(demo, format)) {
+			fprintf(stderr, "Decoder adjusted capture format to an "
+				"unsupported one\n");
+			return -EINVAL;
+		}
+
+		printf("Decoder adjusted capture format to %s\n",
+		       format->name);
+
+		decoder->capture_pixel_format = pixel_format;
+		break;
 	}
 
 	ret = v4l2_format_set(decoder->video_fd, &decoder->capture_format);
@@ -291,62 +941,121 @@ int demo_decoder_setup(struct demo *demo)
 		return ret;
 	}
 
+	if (decoder->scale > 1 || decoder->crop.width) {
+		ret = demo_decoder_selection_setup(demo);
+		if (ret)
+			return ret;
+	}
+
 	/* Output buffers setup */
 
-	count = sizeof(decoder->output_buffers) /
-		sizeof(decoder->output_buffers[0]);
+	output_memory = decoder->output_memory;
 
-	ret = v4l2_buffers_request(decoder->video_fd, decoder->output_type,
-				   decoder->output_memory, count);
-	if (ret) {
-		fprintf(stderr, "Failed to allocate output buffers\n");
-		return ret;
-	}
+	/*
+	 * Camera frames in user memory are read in place, or copied to decoder
+	 * memory since they cannot be imported as dma-buf.
+	 */
+	if (import_camera &&
+	    demo->camera.capture_memory == V4L2_MEMORY_USERPTR) {
+		output_memory = V4L2_MEMORY_MMAP;
 
-	printf("Allocated %d output buffers for decoder\n", count);
+		check = demo_decoder_userptr_check(demo, decoder->output_type,
+						   V4L2_MEMORY_USERPTR);
+		if (check)
+			decoder->output_memory = V4L2_MEMORY_USERPTR;
+		else
+			decoder->output_memory = output_memory;
+	}
 
-	for (i = 0; i < count; i++) {
-		ret = demo_buffer_setup(demo, &decoder->output_buffers[i],
-					decoder->video_fd,
-					decoder->output_memory,
-					decoder->output_type, i, planes_count,
-					import_camera);
-		if (ret) {
-			/* TODO: Cleanup previous allocations on error. */
+	/* Shared camera frames have no room ahead for missing tables. */
+	if (import_camera && decoder->output_memory == V4L2_MEMORY_DMABUF &&
+	    !demo->camera.capture_prefix) {
+		ret = demo_mjpeg_tables_probe(demo);
+		if (ret < 0)
 			return ret;
+
+		if (ret == DEMO_MJPEG_TABLES_MISSING) {
+			printf("Camera frames lack Huffman tables, copying "
+			       "frames\n");
+			decoder->output_memory = V4L2_MEMORY_MMAP;
 		}
 	}
 
-	decoder->output_buffers_count = count;
+	/* Stream frames are decoded straight from the input mapping. */
+	if (demo->source == DEMO_SOURCE_STREAM) {
+		check = demo_decoder_userptr_check(demo, decoder->output_type,
+						   decoder->output_memory);
+		if (check)
+			decoder->output_memory = V4L2_MEMORY_USERPTR;
+		else
+			printf("Decoder lacks user pointers, copying input\n");
+	}
 
-	/* Capture buffers setup */
+	decoder->output_memory_copy = output_memory;
 
-	count = sizeof(decoder->capture_buffers) /
-		sizeof(decoder->capture_buffers[0]);
+	ret = demo_decoder_output_buffers_setup(demo);
+	if (ret && decoder->output_memory == V4L2_MEMORY_USERPTR) {
+		decoder->output_memory = output_memory;
 
-	ret = v4l2_buffers_request(decoder->video_fd, decoder->capture_type,
-				   decoder->capture_memory, count);
-	if (ret) {
-		fprintf(stderr, "Failed to allocate capture buffers\n");
-		/* TODO: Cleanup previous allocations on error. */
+		ret = demo_decoder_output_buffers_setup(demo);
+	}
+
+	if (ret)
 		return ret;
+
+	if (import_camera && decoder->output_memory == V4L2_MEMORY_MMAP &&
+	    demo->camera.capture_memory == V4L2_MEMORY_USERPTR)
+		printf("Decoder refused camera user memory, copying frames\n");
+
+	/* Capture buffers setup */
+
+	capture_memory = decoder->capture_memory;
+
+	/* Frames converted for the dump can't be decoded in place. */
+	mmap_request = demo->sink.mmap_request;
+	if (mmap_request && decoder->capture_pixel_format !=
+			    demo_sink_pixel_format(demo)->pixel_format) {
+		printf("Dump needs converted frames, dump will copy\n");
+		mmap_request = false;
 	}
 
-	printf("Allocated %d capture buffers for decoder\n", count);
+	if (mmap_request) {
+		check = demo_decoder_userptr_check(demo, decoder->capture_type,
+						   decoder->capture_memory);
+		if (check)
+			decoder->capture_memory = V4L2_MEMORY_USERPTR;
+	}
 
-	for (i = 0; i < count; i++) {
-		ret = demo_buffer_setup(demo, &decoder->capture_buffers[i],
-					decoder->video_fd,
-					decoder->capture_memory,
-					decoder->capture_type, i, planes_count,
-					false);
-		if (ret) {
-			/* TODO: Cleanup previous allocations on error. */
-			return ret;
+	decoder->capture_memory_copy = capture_memory;
+
+	ret = demo_decoder_capture_buffers_setup(demo);
+	if (ret && decoder->capture_memory == V4L2_MEMORY_USERPTR) {
+		decoder->capture_memory = capture_memory;
+
+		ret = demo_decoder_capture_buffers_setup(demo);
+	}
+
+	if (ret)
+		return ret;
+
+	if (mmap_request) {
+		if (decoder->capture_memory == V4L2_MEMORY_USERPTR) {
+			buffer = &decoder->capture_buffers[0];
+			v4l2_buffer_plane_length(&buffer->buffer, 0, &size);
+
+			demo->sink.mmap = true;
+			demo->sink.frame_size = size;
+		} else {
+			printf("Decoder lacks user pointers, dump will copy\n");
 		}
 	}
 
-	decoder->capture_buffers_count = count;
+	/* CPU workers are kept for the whole run, not started per frame. */
+	if (demo->scheduler.threads_count) {
+		ret = demo_scheduler_start(demo);
+		if (ret)
+			return ret;
+	}
 
 	return 0;
 }
@@ -357,6 +1066,9 @@ void demo_decoder_cleanup(struct demo *demo)
 	unsigned int count;
 	unsigned int i;
 
+	/* Workers may still reference buffers. */
+	demo_scheduler_stop(demo);
+
 	/* Output buffers cleanup */
 
 	for (i = 0; i < decoder->output_buffers_count; i++)
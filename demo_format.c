@@ -0,0 +1,437 @@
+/*
+ * Copyright (C) 2024 Paul Kocialkowski <contact@paulk.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "demo.h"
+
+/*
+ * Decoded frames use a single plane, with chroma following the luma lines.
+ * Semi-planar chroma lines have the luma stride, planar ones half of it with
+ * the Cr plane following the Cb plane. Tiled formats store each plane as
+ * tiles in raster order, with lines rounded up to whole tiles.
+ *
+ * Capture formats enumerated by each device are cached in a text file, one
+ * line per device and buffer type. Devices are identified by their media
+ * driver, model and bus info, that are separated by tabs since they may hold
+ * spaces:
+ *
+ * driver model bus-info type fourcc fourcc ...
+ */
+
+#define DEMO_FORMAT_CACHE_NAME	"cedrus-jpeg-decode-demo-formats"
+
+static const struct demo_format demo_formats[] = {
+	{ V4L2_PIX_FMT_NV16,		"nv16",		0, false, 0, 0 },
+	{ V4L2_PIX_FMT_NV12,		"nv12",		1, false, 0, 0 },
+	{ V4L2_PIX_FMT_YUV422P,		"i422",		0, true, 0, 0 },
+	{ V4L2_PIX_FMT_YUV420,		"i420",		1, true, 0, 0 },
+	{ V4L2_PIX_FMT_NV12_32L32,	"nv12-32l32",	1, false, 32, 32 },
+	{ V4L2_PIX_FMT_NV12_16L16,	"nv12-16l16",	1, false, 16, 16 },
+};
+
+const struct demo_format *demo_format_find(unsigned int pixel_format)
+{
+	unsigned int count = sizeof(demo_formats) / sizeof(demo_formats[0]);
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		if (demo_formats[i].pixel_format == pixel_format)
+			return &demo_formats[i];
+
+	return NULL;
+}
+
+const struct demo_format *demo_format_find_name(const char *name)
+{
+	unsigned int count = sizeof(demo_formats) / sizeof(demo_formats[0]);
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		if (!strcasecmp(demo_formats[i].name, name))
+			return &demo_formats[i];
+
+	return NULL;
+}
+
+/* Planar format with the same subsampling, as Y4M has no semi-planar one. */
+const struct demo_format *demo_format_planar(const struct demo_format *format)
+{
+	if (format->chroma_shift)
+		return demo_format_find(V4L2_PIX_FMT_YUV420);
+	else
+		return demo_format_find(V4L2_PIX_FMT_YUV422P);
+}
+
+static unsigned int demo_format_align(const struct demo_format *format,
+				      unsigned int lines)
+{
+	unsigned int tile_height = format->tile_height;
+
+	if (!tile_height)
+		return lines;
+
+	return (lines + tile_height - 1) / tile_height * tile_height;
+}
+
+static unsigned int demo_format_chroma_lines(const struct demo_format *format,
+					     unsigned int height)
+{
+	unsigned int mask = (1 << format->chroma_shift) - 1;
+
+	return (height + mask) >> format->chroma_shift;
+}
+
+size_t demo_format_frame_size(const struct demo_format *format,
+			      unsigned int stride, unsigned int height)
+{
+	unsigned int lines_chroma = demo_format_chroma_lines(format, height);
+
+	return (size_t)stride * demo_format_align(format, height) +
+	       (size_t)stride * demo_format_align(format, lines_chroma);
+}
+
+void demo_format_chroma(const struct demo_format *format, uint8_t *data,
+			unsigned int stride, unsigned int height,
+			uint8_t **chroma, uint8_t **chroma_cr,
+			unsigned int *chroma_stride)
+{
+	*chroma = data + (size_t)stride * demo_format_align(format, height);
+
+	if (format->planar) {
+		*chroma_stride = stride / 2;
+		*chroma_cr = *chroma + (size_t)*chroma_stride *
+			     demo_format_chroma_lines(format, height);
+	} else {
+		*chroma_stride = stride;
+		*chroma_cr = NULL;
+	}
+}
+
+/* Linear frames can't be converted to tiled ones. */
+bool demo_format_convertible(const struct demo_format *format,
+			     const struct demo_format *target)
+{
+	return format == target || !target->tile_width;
+}
+
+/*
+ * Frames are written by the decoder and read by the consumer, with an extra
+ * read and write pass when converting between formats.
+ */
+size_t demo_format_cost(const struct demo_format *format,
+			const struct demo_format *target, unsigned int width,
+			unsigned int height)
+{
+	size_t cost = demo_format_frame_size(format, width, height);
+
+	if (format != target)
+		cost += cost + demo_format_frame_size(target, width, height);
+
+	return cost;
+}
+
+/* Tiles are stored in raster order, each with its own lines in sequence. */
+static const uint8_t *demo_format_tile_line(const struct demo_format *format,
+					    const uint8_t *plane,
+					    unsigned int stride,
+					    unsigned int line)
+{
+	unsigned int tile_width = format->tile_width;
+	unsigned int tile_height = format->tile_height;
+
+	return plane + (size_t)(line / tile_height) * stride * tile_height +
+	       (line % tile_height) * tile_width;
+}
+
+static void demo_format_detile_line(const struct demo_format *format,
+				    const uint8_t *plane, unsigned int stride,
+				    unsigned int line, uint8_t *dst,
+				    unsigned int size)
+{
+	unsigned int tile_width = format->tile_width;
+	unsigned int tile_size = tile_width * format->tile_height;
+	const uint8_t *src;
+	unsigned int count;
+	unsigned int x = 0;
+
+	src = demo_format_tile_line(format, plane, stride, line);
+
+	/* Constant size copies compile to a few vector loads and stores. */
+	if (tile_width == 32)
+		for (; x + 32 <= size; x += 32, src += tile_size)
+			memcpy(dst + x, src, 32);
+	else if (tile_width == 16)
+		for (; x + 16 <= size; x += 16, src += tile_size)
+			memcpy(dst + x, src, 16);
+
+	for (; x < size; x += count, src += tile_size) {
+		count = size - x < tile_width ? size - x : tile_width;
+		memcpy(dst + x, src, count);
+	}
+}
+
+/* Tiled chroma is always semi-planar, split here into planes. */
+static void demo_format_detile_chroma(const struct demo_format *format,
+				      const uint8_t *plane,
+				      unsigned int stride, unsigned int line,
+				      uint8_t *cb_out, uint8_t *cr_out,
+				      unsigned int count)
+{
+	unsigned int tile_pairs = format->tile_width / 2;
+	unsigned int tile_size = format->tile_width * format->tile_height;
+	const uint8_t *src;
+	unsigned int x, i;
+
+	src = demo_format_tile_line(format, plane, stride, line);
+
+	for (x = 0; x < count; src += tile_size)
+		for (i = 0; i < tile_pairs && x < count; i++, x++) {
+			cb_out[x] = src[i * 2];
+			cr_out[x] = src[i * 2 + 1];
+		}
+}
+
+/*
+ * Convert to a linear frame without padding, dropping or repeating chroma
+ * lines when vertical subsampling differs.
+ */
+void demo_format_convert(const struct demo_format *format, const uint8_t *src,
+			 unsigned int stride, unsigned int height,
+			 const struct demo_format *target, uint8_t *dst,
+			 unsigned int width, unsigned int lines)
+{
+	unsigned int src_stride, dst_stride;
+	unsigned int src_step, dst_step;
+	unsigned int line, line_src;
+	unsigned int x, y;
+	uint8_t *src_cb, *src_cr;
+	uint8_t *dst_cb, *dst_cr;
+	const uint8_t *cb, *cr;
+	uint8_t *cb_out, *cr_out;
+
+	for (y = 0; y < lines; y++)
+		if (format->tile_width)
+			demo_format_detile_line(format, src, stride, y,
+						dst + (size_t)y * width,
+						width);
+		else
+			memcpy(dst + (size_t)y * width,
+			       src + (size_t)y * stride, width);
+
+	demo_format_chroma(format, (uint8_t *)src, stride, height, &src_cb,
+			   &src_cr, &src_stride);
+	demo_format_chroma(target, dst, width, lines, &dst_cb, &dst_cr,
+			   &dst_stride);
+
+	src_step = format->planar ? 1 : 2;
+	dst_step = target->planar ? 1 : 2;
+
+	if (!src_cr)
+		src_cr = src_cb + 1;
+
+	if (!dst_cr)
+		dst_cr = dst_cb + 1;
+
+	for (line = 0; line < demo_format_chroma_lines(target, lines); line++) {
+		line_src = (line << target->chroma_shift) >>
+			   format->chroma_shift;
+
+		cb_out = dst_cb + (size_t)line * dst_stride;
+		cr_out = dst_cr + (size_t)line * dst_stride;
+
+		if (format->tile_width && !target->planar) {
+			demo_format_detile_line(format, src_cb, src_stride,
+						line_src, cb_out, width & ~1);
+			continue;
+		}
+
+		if (format->tile_width) {
+			demo_format_detile_chroma(format, src_cb, src_stride,
+						  line_src, cb_out, cr_out,
+						  width / 2);
+			continue;
+		}
+
+		cb = src_cb + (size_t)line_src * src_stride;
+		cr = src_cr + (size_t)line_src * src_stride;
+
+		for (x = 0; x < width / 2; x++) {
+			cb_out[x * dst_step] = cb[x * src_step];
+			cr_out[x * dst_step] = cr[x * src_step];
+		}
+	}
+}
+
+/* Cache */
+
+static int demo_format_cache_path(char *path, size_t size, bool create)
+{
+	const char *base;
+	const char *home;
+
+	base = getenv("XDG_CACHE_HOME");
+	if (base && base[0]) {
+		snprintf(path, size, "%s/%s", base, DEMO_FORMAT_CACHE_NAME);
+		return 0;
+	}
+
+	home = getenv("HOME");
+	if (!home || !home[0])
+		return -ENOENT;
+
+	/* The cache directory is only created for writing the cache. */
+	if (create) {
+		snprintf(path, size, "%s/.cache", home);
+		mkdir(path, 0755);
+	}
+
+	snprintf(path, size, "%s/.cache/%s", home, DEMO_FORMAT_CACHE_NAME);
+
+	return 0;
+}
+
+static bool demo_format_cache_match(const char *line, const char *device,
+				    unsigned int type, int *offset)
+{
+	size_t length = strlen(device);
+	unsigned int type_line;
+	int ret;
+
+	if (strncmp(line, device, length) || line[length] != '\t')
+		return false;
+
+	ret = sscanf(line + length + 1, "%u%n", &type_line, offset);
+	if (ret != 1)
+		return false;
+
+	*offset += length + 1;
+
+	return type_line == type;
+}
+
+int demo_format_cache_load(const char *device, unsigned int type,
+			   unsigned int *pixel_formats, unsigned int *count)
+{
+	char path[256];
+	char line[512];
+	const char *p;
+	unsigned int index = 0;
+	int offset;
+	int length;
+	FILE *file;
+	int ret;
+
+	ret = demo_format_cache_path(path, sizeof(path), false);
+	if (ret)
+		return ret;
+
+	file = fopen(path, "r");
+	if (!file)
+		return -errno;
+
+	ret = -ENOENT;
+
+	while (fgets(line, sizeof(line), file)) {
+		if (!demo_format_cache_match(line, device, type, &offset))
+			continue;
+
+		p = line + offset;
+
+		while (index < *count &&
+		       sscanf(p, "%x%n", &pixel_formats[index], &length) == 1) {
+			p += length;
+			index++;
+		}
+
+		*count = index;
+		ret = index ? 0 : -ENOENT;
+		break;
+	}
+
+	fclose(file);
+
+	return ret;
+}
+
+/* Entries for other devices are kept, with this one rewritten last. */
+int demo_format_cache_store(const char *device, unsigned int type,
+			    const unsigned int *pixel_formats,
+			    unsigned int count)
+{
+	char path[256];
+	char path_new[264];
+	char line[512];
+	FILE *file_new;
+	FILE *file;
+	unsigned int i;
+	int offset;
+	int ret;
+
+	ret = demo_format_cache_path(path, sizeof(path), true);
+	if (ret)
+		return ret;
+
+	snprintf(path_new, sizeof(path_new), "%s.new", path);
+
+	file_new = fopen(path_new, "w");
+	if (!file_new)
+		return -errno;
+
+	file = fopen(path, "r");
+	if (file) {
+		while (fgets(line, sizeof(line), file))
+			if (!demo_format_cache_match(line, device, type,
+						     &offset))
+				fputs(line, file_new);
+
+		fclose(file);
+	}
+
+	fprintf(file_new, "%s\t%u", device, type);
+
+	for (i = 0; i < count; i++)
+		fprintf(file_new, " %08x", pixel_formats[i]);
+
+	fputc('\n', file_new);
+
+	ret = fclose(file_new);
+	if (ret) {
+		ret = -errno;
+		goto error;
+	}
+
+	ret = rename(path_new, path);
+	if (ret) {
+		ret = -errno;
+		goto error;
+	}
+
+	return 0;
+
+error:
+	unlink(path_new);
+
+	return ret;
+}
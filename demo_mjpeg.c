@@ -0,0 +1,581 @@
+/*
+ * Copyright (C) 2024 Paul Kocialkowski <contact@paulk.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <linux/dma-buf.h>
+
+#include "demo.h"
+#include "perf.h"
+
+/*
+ * UVC cameras usually leave out the Huffman tables and expect the standard
+ * ones from ITU T.81 Annex K.3 to be implied. A single DHT segment holding
+ * all four tables is inserted right after the start of image marker.
+ *
+ * With user memory, camera frames are captured past a reserved prefix and
+ * the start of image and tables are written just before the frame, so the
+ * decoder reads them contiguously without any copy of the payload. Shared
+ * dma-buf frames have no room for them, so a frame is probed at setup and
+ * frames are copied to decoder memory along with the tables when missing.
+ *
+ * Frames are also validated before reaching the decoder, since a corrupt
+ * frame only fails after the decoder times out. Entropy-coded data is
+ * scanned for stray markers with memchr, that is vectorized by the C library.
+ */
+
+#define JPEG_MARKER_SOF0	0xc0
+#define JPEG_MARKER_SOF1	0xc1
+#define JPEG_MARKER_SOF2	0xc2
+#define JPEG_MARKER_DHT		0xc4
+#define JPEG_MARKER_RST0	0xd0
+#define JPEG_MARKER_RST7	0xd7
+#define JPEG_MARKER_SOI		0xd8
+#define JPEG_MARKER_EOI		0xd9
+#define JPEG_MARKER_SOS		0xda
+#define JPEG_MARKER_DQT		0xdb
+#define JPEG_MARKER_DRI		0xdd
+
+struct demo_mjpeg_table {
+	uint8_t class_id;
+	uint8_t bits[16];
+	const uint8_t *values;
+	unsigned int values_count;
+};
+
+static const uint8_t demo_mjpeg_dc_values[] = {
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b,
+};
+
+static const uint8_t demo_mjpeg_ac_luma_values[] = {
+	0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12,
+	0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+	0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08,
+	0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+	0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16,
+	0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+	0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39,
+	0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+	0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+	0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+	0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79,
+	0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+	0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98,
+	0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+	0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
+	0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+	0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4,
+	0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+	0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea,
+	0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+	0xf9, 0xfa,
+};
+
+static const uint8_t demo_mjpeg_ac_chroma_values[] = {
+	0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21,
+	0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+	0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+	0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+	0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34,
+	0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+	0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38,
+	0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+	0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+	0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+	0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78,
+	0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+	0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96,
+	0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+	0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+	0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+	0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2,
+	0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+	0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9,
+	0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+	0xf9, 0xfa,
+};
+
+static const struct demo_mjpeg_table demo_mjpeg_tables[] = {
+	{
+		.class_id = 0x00,
+		.bits = { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 },
+		.values = demo_mjpeg_dc_values,
+		.values_count = sizeof(demo_mjpeg_dc_values),
+	},
+	{
+		.class_id = 0x01,
+		.bits = { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 },
+		.values = demo_mjpeg_dc_values,
+		.values_count = sizeof(demo_mjpeg_dc_values),
+	},
+	{
+		.class_id = 0x10,
+		.bits = { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d },
+		.values = demo_mjpeg_ac_luma_values,
+		.values_count = sizeof(demo_mjpeg_ac_luma_values),
+	},
+	{
+		.class_id = 0x11,
+		.bits = { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 },
+		.values = demo_mjpeg_ac_chroma_values,
+		.values_count = sizeof(demo_mjpeg_ac_chroma_values),
+	},
+};
+
+/* Start of image and DHT segment with all the standard tables. */
+#define DEMO_MJPEG_TABLES_SIZE	(2 + 4 + 4 * 17 + 2 * 12 + 2 * 162)
+
+static void demo_mjpeg_tables_write(uint8_t *data)
+{
+	const struct demo_mjpeg_table *table;
+	unsigned int length = DEMO_MJPEG_TABLES_SIZE - 4;
+	unsigned int i;
+
+	*data++ = 0xff;
+	*data++ = JPEG_MARKER_SOI;
+	*data++ = 0xff;
+	*data++ = JPEG_MARKER_DHT;
+	*data++ = length >> 8;
+	*data++ = length & 0xff;
+
+	for (i = 0; i < sizeof(demo_mjpeg_tables) /
+			sizeof(demo_mjpeg_tables[0]); i++) {
+		table = &demo_mjpeg_tables[i];
+
+		*data++ = table->class_id;
+
+		memcpy(data, table->bits, sizeof(table->bits));
+		data += sizeof(table->bits);
+
+		memcpy(data, table->values, table->values_count);
+		data += table->values_count;
+	}
+}
+
+/* Only headers up to the first scan are looked at. */
+static int demo_mjpeg_tables_check(const uint8_t *data, unsigned int size)
+{
+	const uint8_t *end = data + size;
+	const uint8_t *p = data + 2;
+	unsigned int length;
+	uint8_t marker;
+
+	if (size < 4 || data[0] != 0xff || data[1] != JPEG_MARKER_SOI)
+		return -EINVAL;
+
+	while (end - p >= 4) {
+		if (p[0] != 0xff)
+			return -EINVAL;
+
+		marker = p[1];
+
+		if (marker == 0xff) {
+			p++;
+			continue;
+		}
+
+		if (marker == JPEG_MARKER_DHT)
+			return DEMO_MJPEG_TABLES_PRESENT;
+		else if (marker == JPEG_MARKER_SOS)
+			return DEMO_MJPEG_TABLES_MISSING;
+
+		length = (p[2] << 8) | p[3];
+		if (length < 2)
+			return -EINVAL;
+
+		p += 2 + length;
+	}
+
+	return -EINVAL;
+}
+
+static const char *demo_mjpeg_frame_check(struct demo *demo,
+					  const uint8_t *data,
+					  const uint8_t *end)
+{
+	struct demo_decoder *decoder = &demo->decoder;
+	unsigned int components_count;
+	unsigned int width;
+	unsigned int height;
+	unsigned int h;
+	unsigned int v;
+	unsigned int i;
+	bool hybrid = demo->scheduler.threads_count;
+
+	/* Sequential Huffman frames, progressive ones only in software. */
+	if (data[1] == JPEG_MARKER_SOF2 && !hybrid)
+		return "progressive";
+	else if (data[1] != JPEG_MARKER_SOF0 && data[1] != JPEG_MARKER_SOF1 &&
+		 data[1] != JPEG_MARKER_SOF2)
+		return "unsupported frame type";
+
+	if (end - data < 10 || data[4] != 8)
+		return "invalid frame header";
+
+	height = (data[5] << 8) | data[6];
+	width = (data[7] << 8) | data[8];
+	components_count = data[9];
+
+	if ((width != decoder->output_width ||
+	     height != decoder->output_height) && !hybrid)
+		return "size mismatch";
+
+	if ((components_count != 1 && components_count != 3) ||
+	    end - data < 10 + components_count * 3)
+		return "invalid components";
+
+	/* Any sampling is left to the software decoder. */
+	if (components_count == 1 || hybrid)
+		return NULL;
+
+	/* 4:4:4, 4:2:2, 4:2:0 and vertical 4:2:2 with 1x1 chroma. */
+	h = data[11] >> 4;
+	v = data[11] & 0xf;
+
+	if (h < 1 || h > 2 || v < 1 || v > 2)
+		return "unsupported subsampling";
+
+	for (i = 1; i < components_count; i++)
+		if (data[11 + i * 3] != 0x11)
+			return "unsupported subsampling";
+
+	return NULL;
+}
+
+/* Returns the marker ending entropy-coded data, NULL on stray markers. */
+static const uint8_t *demo_mjpeg_entropy_check(const uint8_t *data,
+					       const uint8_t *end,
+					       bool restart)
+{
+	const uint8_t *p = data;
+	unsigned int index = 0;
+	uint8_t marker;
+
+	while (p < end) {
+		p = memchr(p, 0xff, end - p);
+		if (!p || end - p < 2)
+			return NULL;
+
+		marker = p[1];
+
+		if (marker == 0x00 || marker == 0xff) {
+			p++;
+			continue;
+		}
+
+		if (marker >= JPEG_MARKER_RST0 && marker <= JPEG_MARKER_RST7) {
+			/* Restart markers come in sequence, when enabled. */
+			if (!restart || marker - JPEG_MARKER_RST0 != index)
+				return NULL;
+
+			index = (index + 1) % 8;
+			p += 2;
+			continue;
+		}
+
+		/* Only tables, another scan or the end may follow a scan. */
+		if (marker == JPEG_MARKER_EOI || marker == JPEG_MARKER_SOS ||
+		    marker == JPEG_MARKER_DHT || marker == JPEG_MARKER_DQT ||
+		    marker == JPEG_MARKER_DRI)
+			return p;
+
+		return NULL;
+	}
+
+	return NULL;
+}
+
+int demo_mjpeg_validate(struct demo *demo, const void *data,
+			unsigned int size)
+{
+	const uint8_t *base = data;
+	const uint8_t *end = base + size;
+	const char *reason = NULL;
+	const uint8_t *p;
+	unsigned int length;
+	bool restart = false;
+	bool frame = false;
+	bool scan = false;
+	uint8_t marker;
+
+	if (!demo || !data)
+		return -EINVAL;
+
+	/* Cameras may pad frames with zeros past the end of image. */
+	while (end - base > 4 && !end[-1])
+		end--;
+
+	if (end - base < 4 || base[0] != 0xff || base[1] != JPEG_MARKER_SOI ||
+	    end[-2] != 0xff || end[-1] != JPEG_MARKER_EOI) {
+		reason = "truncated";
+		goto reject;
+	}
+
+	p = base + 2;
+
+	while (end - p >= 2) {
+		if (p[0] != 0xff)
+			goto reject;
+
+		marker = p[1];
+
+		if (marker == 0xff) {
+			p++;
+			continue;
+		}
+
+		if (marker == JPEG_MARKER_EOI)
+			break;
+
+		if (marker == JPEG_MARKER_SOI || end - p < 4)
+			goto reject;
+
+		length = (p[2] << 8) | p[3];
+		if (length < 2 || length > end - p - 2)
+			goto reject;
+
+		if (marker >= JPEG_MARKER_SOF0 && marker <= 0xcf &&
+		    marker != JPEG_MARKER_DHT && marker != 0xc8 &&
+		    marker != 0xcc) {
+			if (frame)
+				goto reject;
+
+			reason = demo_mjpeg_frame_check(demo, p,
+							p + 2 + length);
+			if (reason)
+				goto reject;
+
+			frame = true;
+		} else if (marker == JPEG_MARKER_DRI) {
+			restart = length >= 4 && (p[4] || p[5]);
+		}
+
+		p += 2 + length;
+
+		if (marker == JPEG_MARKER_SOS) {
+			if (!frame)
+				goto reject;
+
+			scan = true;
+
+			p = demo_mjpeg_entropy_check(p, end, restart);
+			if (!p) {
+				reason = "stray marker in scan";
+				goto reject;
+			}
+		}
+	}
+
+	if (scan && p == end - 2)
+		return 0;
+
+reject:
+	fprintf(stderr, "Rejecting invalid frame (%s)\n",
+		reason ? reason : "corrupted structure");
+
+	return -EBADMSG;
+}
+
+static int demo_mjpeg_copy(struct demo_buffer *output_buffer,
+			   const uint8_t *data, unsigned int size, bool tables)
+{
+	struct perf perf = { 0 };
+	unsigned int length;
+	unsigned int needed;
+	uint8_t *target;
+
+	v4l2_buffer_plane_length(&output_buffer->buffer, 0, &length);
+
+	needed = tables ? size - 2 + DEMO_MJPEG_TABLES_SIZE : size;
+	if (length < needed)
+		return -ENOSPC;
+
+	target = output_buffer->data[0];
+
+	perf_before(&perf);
+
+	if (tables) {
+		demo_mjpeg_tables_write(target);
+		memcpy(target + DEMO_MJPEG_TABLES_SIZE, data + 2, size - 2);
+	} else {
+		memcpy(target, data, size);
+	}
+
+	perf_after(&perf);
+
+	perf_print(&perf, "camera copy");
+
+	return 0;
+}
+
+/* Returns whether the camera leaves out the tables, from a single frame. */
+int demo_mjpeg_tables_probe(struct demo *demo)
+{
+	struct demo_camera *camera = &demo->camera;
+	struct demo_buffer *buffer;
+	unsigned int index;
+	unsigned int size;
+	int tables = -EINVAL;
+	int stop;
+	int ret;
+
+	ret = demo_camera_start(demo);
+	if (ret)
+		return ret;
+
+	ret = demo_camera_capture(demo, &index);
+	if (ret)
+		goto complete;
+
+	buffer = &camera->capture_buffers[index];
+
+	v4l2_buffer_plane_length_used(&buffer->buffer, 0, &size);
+
+	ret = demo_buffer_access_begin(buffer);
+	if (ret)
+		goto complete;
+
+	tables = demo_mjpeg_tables_check(buffer->data[0], size);
+
+	ret = demo_buffer_access_finish(buffer);
+
+complete:
+	/* Stopping gives all the buffers back, including the probed one. */
+	stop = demo_camera_stop(demo);
+	if (!ret)
+		ret = stop;
+
+	if (ret)
+		return ret;
+
+	return tables < 0 ? DEMO_MJPEG_TABLES_UNKNOWN : tables;
+}
+
+/*
+ * Returns the frame size and how far ahead of the camera buffer data the
+ * frame now starts, which is only the case with a prefix. Frames are copied
+ * to output buffers with their own memory. Invalid frames are reported with
+ * -EBADMSG.
+ */
+int demo_mjpeg_normalize(struct demo *demo, struct demo_buffer *camera_buffer,
+			 struct demo_buffer *output_buffer,
+			 unsigned int *offset, unsigned int *size)
+{
+	struct demo_camera *camera = &demo->camera;
+	uint8_t *data;
+	uint8_t *frame;
+	long flags;
+	bool insert;
+	bool copy;
+	int tables;
+	int finish;
+	int ret;
+
+	if (!demo || !camera_buffer || !output_buffer || !offset || !size)
+		return -EINVAL;
+
+	v4l2_buffer_plane_length_used(&camera_buffer->buffer, 0, size);
+
+	*offset = 0;
+
+	copy = output_buffer->buffer.memory == V4L2_MEMORY_MMAP;
+
+	/* Mapping shared frames is only worth it until tables were seen. */
+	if (camera->tables == DEMO_MJPEG_TABLES_PRESENT &&
+	    !camera->capture_prefix && !demo->validate && !copy)
+		return 0;
+
+	/* Tables are written to the camera buffer unless copying. */
+	flags = copy ? DMA_BUF_SYNC_READ : DMA_BUF_SYNC_RW;
+
+	ret = demo_buffer_access_begin_flags(camera_buffer, flags);
+	if (ret)
+		return ret;
+
+	if (copy) {
+		ret = demo_buffer_access_begin(output_buffer);
+		if (ret)
+			goto complete;
+	}
+
+	data = camera_buffer->data[0];
+
+	/* Frames that cannot be parsed are left to validation. */
+	tables = demo_mjpeg_tables_check(data, *size);
+
+	if (tables >= 0 && camera->tables != tables) {
+		if (tables == DEMO_MJPEG_TABLES_MISSING)
+			printf("Inserting standard Huffman tables in camera "
+			       "frames\n");
+
+		camera->tables = tables;
+	}
+
+	insert = tables == DEMO_MJPEG_TABLES_MISSING;
+
+	if (copy) {
+		ret = demo_mjpeg_copy(output_buffer, data, *size, insert);
+		if (ret == -ENOSPC) {
+			fprintf(stderr, "Rejecting frame too large for decoder "
+				"buffer\n");
+			ret = -EBADMSG;
+		}
+
+		if (ret)
+			goto complete_output;
+
+		frame = output_buffer->data[0];
+	} else if (insert) {
+		/* The start of image is overwritten by the end of the tables. */
+		if (camera->capture_prefix < DEMO_MJPEG_TABLES_SIZE - 2) {
+			fprintf(stderr, "Rejecting frame without room for "
+				"tables\n");
+			ret = -EBADMSG;
+			goto complete;
+		}
+
+		*offset = DEMO_MJPEG_TABLES_SIZE - 2;
+		demo_mjpeg_tables_write(data - *offset);
+
+		frame = data - *offset;
+	} else {
+		frame = data;
+	}
+
+	if (insert)
+		*size += DEMO_MJPEG_TABLES_SIZE - 2;
+
+	if (demo->validate)
+		ret = demo_mjpeg_validate(demo, frame, *size);
+
+complete_output:
+	if (copy) {
+		finish = demo_buffer_access_finish(output_buffer);
+		if (!ret)
+			ret = finish;
+	}
+
+complete:
+	finish = demo_buffer_access_finish_flags(camera_buffer, flags);
+	if (!ret)
+		ret = finish;
+
+	return ret;
+}
@@ -0,0 +1,629 @@
+/*
+ * Copyright (C) 2024 Paul Kocialkowski <contact@paulk.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "demo.h"
+#include "ring.h"
+#include "perf.h"
+
+/*
+ * Stages hand buffer indices to each other through the pipeline rings:
+ *
+ * input -decode-> submit -pending-> reap -process-> process -dump-> output
+ *   ^                ^                |                              |
+ *   +--output_free---|----------------+                              |
+ *                    +-----------------capture_free------------------+
+ *
+ * Each ring has a single producer and a single consumer stage. The end of the
+ * stream is signaled by pushing an end entry that every stage forwards.
+ * When a stage fails, the error is recorded and all stages keep forwarding
+ * indices without doing any work until the end entry reaches them.
+ */
+
+#define DEMO_PIPELINE_END		UINT_MAX
+
+#define demo_pipeline_entry(output, capture) \
+	((output) | ((capture) << 16))
+#define demo_pipeline_entry_output(entry) \
+	((entry) & 0xffff)
+#define demo_pipeline_entry_capture(entry) \
+	((entry) >> 16)
+
+static void demo_pipeline_error_set(struct demo_pipeline *pipeline, int error)
+{
+	int expected = 0;
+
+	atomic_compare_exchange_strong(&pipeline->error, &expected, error);
+}
+
+static bool demo_pipeline_error_check(struct demo_pipeline *pipeline)
+{
+	return atomic_load(&pipeline->error) != 0;
+}
+
+static int demo_pipeline_input_file(struct demo *demo)
+{
+	struct demo_pipeline *pipeline = &demo->pipeline;
+	struct demo_decoder *decoder = &demo->decoder;
+	struct demo_buffer *buffer;
+	unsigned int index;
+	unsigned int i;
+	bool held = false;
+	int ret = 0;
+
+	for (i = 0; i < demo->source_paths_count; i++) {
+		if (demo_pipeline_error_check(pipeline))
+			break;
+
+		/* Buffers holding rejected frames are reused right away. */
+		if (!held) {
+			ret = ring_pop_wait(&pipeline->output_free, &index);
+			if (ret)
+				return ret;
+
+			held = true;
+		}
+
+		ret = demo_file_open(demo, demo->source_paths[i]);
+		if (ret)
+			goto complete;
+
+		buffer = &decoder->output_buffers[index];
+
+		ret = demo_file_read_buffer(demo, buffer);
+
+		demo_file_close(demo);
+
+		if (ret == -EBADMSG) {
+			ret = 0;
+			continue;
+		} else if (ret) {
+			goto complete;
+		}
+
+		ret = ring_push_wait(&pipeline->decode, index);
+		if (ret)
+			goto complete;
+
+		held = false;
+	}
+
+complete:
+	/* A buffer left holding no frame goes back to the free ring. */
+	if (held)
+		ring_push(&pipeline->output_free, index);
+
+	return ret;
+}
+
+static int demo_pipeline_input_stream(struct demo *demo)
+{
+	struct demo_pipeline *pipeline = &demo->pipeline;
+	struct demo_decoder *decoder = &demo->decoder;
+	struct demo_buffer *buffer;
+	const void *data;
+	uint64_t timestamp;
+	unsigned int index;
+	unsigned int size;
+	int ret;
+
+	while (!demo_pipeline_error_check(pipeline)) {
+		ret = demo_stream_frame_next(demo, &data, &size, &timestamp);
+		if (ret == -ENODATA)
+			break;
+		else if (ret)
+			return ret;
+
+		if (demo->validate && demo_mjpeg_validate(demo, data, size)) {
+			demo->frames_rejected++;
+			continue;
+		}
+
+		ret = ring_pop_wait(&pipeline->output_free, &index);
+		if (ret)
+			return ret;
+
+		buffer = &decoder->output_buffers[index];
+
+		ret = demo_stream_frame_load(demo, buffer, data, size,
+					     timestamp);
+		if (ret) {
+			ring_push(&pipeline->output_free, index);
+			return ret;
+		}
+
+		ret = ring_push_wait(&pipeline->decode, index);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int demo_pipeline_input_camera(struct demo *demo)
+{
+	struct demo_pipeline *pipeline = &demo->pipeline;
+	struct demo_decoder *decoder = &demo->decoder;
+	struct demo_camera *camera = &demo->camera;
+	struct demo_buffer *output_buffer;
+	struct demo_buffer *camera_buffer;
+	unsigned int free_indexes[DEMO_PIPELINE_BUFFERS_MAX];
+	unsigned int free_count = 0;
+	unsigned int queued_count;
+	unsigned int camera_index;
+	unsigned int index;
+	unsigned int i;
+	bool wait;
+	int ret;
+
+	ret = demo_camera_start(demo);
+	if (ret)
+		return ret;
+
+	queued_count = camera->capture_buffers_count;
+
+	for (i = 0; i < demo->frames_count; i++) {
+		if (demo_pipeline_error_check(pipeline))
+			break;
+
+		/*
+		 * Give camera buffers bound to released decoder output buffers
+		 * back to the camera. Wait when no output buffer is free or
+		 * when the decoder is holding all camera buffers.
+		 */
+		while (1) {
+			wait = !free_count || !queued_count;
+
+			if (wait)
+				ret = ring_pop_wait(&pipeline->output_free,
+						    &index);
+			else
+				ret = ring_pop(&pipeline->output_free, &index);
+
+			if (ret == -EAGAIN)
+				break;
+			else if (ret)
+				return ret;
+
+			output_buffer = &decoder->output_buffers[index];
+			camera_buffer = output_buffer->import_buffer;
+
+			if (camera_buffer) {
+				camera_index = camera_buffer->buffer.index;
+
+				ret = demo_camera_release(demo, camera_index);
+				if (ret)
+					return ret;
+
+				queued_count++;
+			}
+
+			free_indexes[free_count++] = index;
+		}
+
+		ret = demo_camera_capture(demo, &camera_index);
+		if (ret)
+			return ret;
+
+		queued_count--;
+
+		camera_buffer = &camera->capture_buffers[camera_index];
+
+		/* Bind any free output buffer to the captured buffer. */
+		index = free_indexes[--free_count];
+		output_buffer = &decoder->output_buffers[index];
+
+		ret = demo_decoder_output_import(demo, output_buffer,
+						 camera_buffer);
+		if (ret == -EBADMSG) {
+			/* Invalid frames never reach the decoder. */
+			free_indexes[free_count++] = index;
+
+			ret = demo_camera_release(demo, camera_index);
+			if (ret)
+				return ret;
+
+			queued_count++;
+			continue;
+		} else if (ret) {
+			return ret;
+		}
+
+		ret = ring_push_wait(&pipeline->decode, index);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static void *demo_pipeline_input(void *data)
+{
+	struct demo *demo = data;
+	struct demo_pipeline *pipeline = &demo->pipeline;
+	int ret;
+
+	if (demo->source == DEMO_SOURCE_CAMERA)
+		ret = demo_pipeline_input_camera(demo);
+	else if (demo->source == DEMO_SOURCE_STREAM)
+		ret = demo_pipeline_input_stream(demo);
+	else
+		ret = demo_pipeline_input_file(demo);
+
+	if (ret)
+		demo_pipeline_error_set(pipeline, ret);
+
+	ring_push_wait(&pipeline->decode, DEMO_PIPELINE_END);
+
+	return NULL;
+}
+
+static void *demo_pipeline_submit(void *data)
+{
+	struct demo *demo = data;
+	struct demo_pipeline *pipeline = &demo->pipeline;
+	struct demo_decoder *decoder = &demo->decoder;
+	struct demo_buffer *output_buffer;
+	struct demo_buffer *capture_buffer;
+	unsigned int output_index;
+	unsigned int capture_index;
+	int ret;
+
+	while (1) {
+		ring_pop_wait(&pipeline->decode, &output_index);
+		if (output_index == DEMO_PIPELINE_END)
+			break;
+
+		ring_pop_wait(&pipeline->capture_free, &capture_index);
+
+		output_buffer = &decoder->output_buffers[output_index];
+		capture_buffer = &decoder->capture_buffers[capture_index];
+
+		if (demo_pipeline_error_check(pipeline))
+			ret = 0;
+		else if (demo->scheduler.threads_count)
+			ret = demo_scheduler_submit(demo, output_index,
+						    capture_index);
+		else
+			ret = demo_decoder_submit(demo, output_buffer,
+						  capture_buffer);
+
+		if (ret)
+			demo_pipeline_error_set(pipeline, ret);
+
+		ring_push_wait(&pipeline->pending,
+			       demo_pipeline_entry(output_index,
+						   capture_index));
+	}
+
+	ring_push_wait(&pipeline->pending, DEMO_PIPELINE_END);
+
+	return NULL;
+}
+
+static void *demo_pipeline_reap(void *data)
+{
+	struct demo *demo = data;
+	struct demo_pipeline *pipeline = &demo->pipeline;
+	unsigned int output_index;
+	unsigned int capture_index;
+	unsigned int entry;
+	int ret;
+
+	while (1) {
+		ring_pop_wait(&pipeline->pending, &entry);
+		if (entry == DEMO_PIPELINE_END)
+			break;
+
+		output_index = demo_pipeline_entry_output(entry);
+		capture_index = demo_pipeline_entry_capture(entry);
+
+		if (!demo_pipeline_error_check(pipeline)) {
+			if (demo->scheduler.threads_count)
+				ret = demo_scheduler_reap(demo, &output_index,
+							  &capture_index);
+			else
+				ret = demo_decoder_reap(demo, &output_index,
+							&capture_index);
+			if (ret) {
+				demo_pipeline_error_set(pipeline, ret);
+
+				output_index =
+					demo_pipeline_entry_output(entry);
+				capture_index =
+					demo_pipeline_entry_capture(entry);
+			} else {
+				demo_realtime_frame(demo);
+			}
+		}
+
+		ring_push_wait(&pipeline->output_free, output_index);
+		ring_push_wait(&pipeline->process, capture_index);
+	}
+
+	ring_push_wait(&pipeline->process, DEMO_PIPELINE_END);
+
+	return NULL;
+}
+
+static void *demo_pipeline_process(void *data)
+{
+	struct demo *demo = data;
+	struct demo_pipeline *pipeline = &demo->pipeline;
+	struct demo_decoder *decoder = &demo->decoder;
+	struct demo_buffer *buffer;
+	unsigned int index;
+	int ret;
+
+	while (1) {
+		ring_pop_wait(&pipeline->process, &index);
+		if (index == DEMO_PIPELINE_END)
+			break;
+
+		buffer = &decoder->capture_buffers[index];
+
+		if (!demo_pipeline_error_check(pipeline)) {
+			ret = demo_buffer_access_begin(buffer);
+			if (ret)
+				demo_pipeline_error_set(pipeline, ret);
+			else
+				pipeline->capture_access[index] = true;
+		}
+
+		ring_push_wait(&pipeline->dump, index);
+	}
+
+	ring_push_wait(&pipeline->dump, DEMO_PIPELINE_END);
+
+	return NULL;
+}
+
+static void *demo_pipeline_output(void *data)
+{
+	struct demo *demo = data;
+	struct demo_pipeline *pipeline = &demo->pipeline;
+	struct demo_decoder *decoder = &demo->decoder;
+	struct demo_buffer *buffer;
+	unsigned int index;
+	int ret;
+
+	while (1) {
+		ring_pop_wait(&pipeline->dump, &index);
+		if (index == DEMO_PIPELINE_END)
+			break;
+
+		buffer = &decoder->capture_buffers[index];
+
+		/* Access is balanced even when an error came in meanwhile. */
+		if (!pipeline->capture_access[index])
+			goto release;
+
+		pipeline->capture_access[index] = false;
+
+		if (demo_pipeline_error_check(pipeline))
+			goto finish;
+
+		ret = demo_sink_write(demo, buffer);
+		if (ret) {
+			demo_pipeline_error_set(pipeline, ret);
+			goto finish;
+		}
+
+		pipeline->frames_count++;
+
+finish:
+		ret = demo_buffer_access_finish(buffer);
+		if (ret)
+			demo_pipeline_error_set(pipeline, ret);
+
+release:
+		ring_push_wait(&pipeline->capture_free, index);
+	}
+
+	return NULL;
+}
+
+struct demo_pipeline_stage {
+	const char *name;
+	pthread_t *thread;
+	void *(*routine)(void *data);
+	struct ring *input;
+};
+
+/* Stages are started from the output end, so consumers always run first. */
+static int demo_pipeline_threads_start(struct demo *demo)
+{
+	struct demo_pipeline *pipeline = &demo->pipeline;
+	struct demo_pipeline_stage stages[] = {
+		{ "output", &pipeline->output_thread, demo_pipeline_output,
+		  &pipeline->dump },
+		{ "process", &pipeline->process_thread, demo_pipeline_process,
+		  &pipeline->process },
+		{ "reap", &pipeline->reap_thread, demo_pipeline_reap,
+		  &pipeline->pending },
+		{ "submit", &pipeline->submit_thread, demo_pipeline_submit,
+		  &pipeline->decode },
+		{ "input", &pipeline->input_thread, demo_pipeline_input,
+		  NULL },
+	};
+	unsigned int count = sizeof(stages) / sizeof(stages[0]);
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < count; i++) {
+		ret = demo_realtime_thread_create(demo, stages[i].name,
+						  stages[i].thread,
+						  stages[i].routine, demo);
+		if (ret) {
+			fprintf(stderr, "Failed to create pipeline %s thread: "
+				"%s\n", stages[i].name, strerror(-ret));
+			goto error;
+		}
+	}
+
+	return 0;
+
+error:
+	/* Started stages forward the end entry down to the output stage. */
+	if (i)
+		ring_push_wait(stages[i - 1].input, DEMO_PIPELINE_END);
+
+	while (i--)
+		pthread_join(*stages[i].thread, NULL);
+
+	return ret;
+}
+
+int demo_pipeline_run(struct demo *demo)
+{
+	struct demo_pipeline *pipeline = &demo->pipeline;
+	struct demo_decoder *decoder = &demo->decoder;
+	struct perf perf = { 0 };
+	unsigned int output_count;
+	unsigned int capture_count;
+	uint64_t duration;
+	unsigned int i;
+	int ret;
+
+	if (!demo)
+		return -EINVAL;
+
+	output_count = decoder->output_buffers_count;
+	capture_count = decoder->capture_buffers_count;
+
+	if (output_count > DEMO_PIPELINE_BUFFERS_MAX ||
+	    capture_count > DEMO_PIPELINE_BUFFERS_MAX)
+		return -EINVAL;
+
+	atomic_init(&pipeline->error, 0);
+	pipeline->frames_count = 0;
+
+	for (i = 0; i < capture_count; i++)
+		pipeline->capture_access[i] = false;
+
+	/* Leave room for the end entry in every ring. */
+	ret = ring_setup(&pipeline->output_free, output_count + 1);
+	if (ret)
+		return ret;
+
+	ret = ring_setup(&pipeline->decode, output_count + 1);
+	if (ret)
+		goto error_ring_decode;
+
+	ret = ring_setup(&pipeline->pending, output_count + 1);
+	if (ret)
+		goto error_ring_pending;
+
+	ret = ring_setup(&pipeline->process, capture_count + 1);
+	if (ret)
+		goto error_ring_process;
+
+	ret = ring_setup(&pipeline->dump, capture_count + 1);
+	if (ret)
+		goto error_ring_dump;
+
+	ret = ring_setup(&pipeline->capture_free, capture_count + 1);
+	if (ret)
+		goto error_ring_capture_free;
+
+	for (i = 0; i < output_count; i++)
+		ring_push(&pipeline->output_free, i);
+
+	for (i = 0; i < capture_count; i++)
+		ring_push(&pipeline->capture_free, i);
+
+	ret = demo_decoder_start(demo);
+	if (ret)
+		goto error_decoder;
+
+	perf_before(&perf);
+
+	ret = demo_pipeline_threads_start(demo);
+	if (ret) {
+		demo_decoder_stop(demo);
+		goto error_decoder;
+	}
+
+	pthread_join(pipeline->input_thread, NULL);
+	pthread_join(pipeline->submit_thread, NULL);
+	pthread_join(pipeline->reap_thread, NULL);
+	pthread_join(pipeline->process_thread, NULL);
+	pthread_join(pipeline->output_thread, NULL);
+
+	perf_after(&perf);
+
+	duration = timespec_diff(perf.before, perf.after) / 1000UL;
+
+	printf("Pipeline processed %u frames in %"PRIu64" us",
+	       pipeline->frames_count, duration);
+
+	if (pipeline->frames_count && duration)
+		printf(" (%"PRIu64" fps)",
+		       pipeline->frames_count * 1000000UL / duration);
+
+	printf("\n");
+
+	if (demo->frames_rejected)
+		printf("Rejected %u invalid frames\n", demo->frames_rejected);
+
+	if (demo->scheduler.threads_count)
+		demo_scheduler_report(demo);
+
+	demo_decoder_wait_report(demo);
+	demo_realtime_report(demo);
+
+	perf_ioctl_report(pipeline->frames_count);
+
+	ret = atomic_load(&pipeline->error);
+
+	demo_decoder_stop(demo);
+
+	if (demo->source == DEMO_SOURCE_CAMERA) {
+		demo_camera_stop(demo);
+		demo_camera_rate_report(demo);
+	}
+
+error_decoder:
+	ring_cleanup(&pipeline->capture_free);
+
+error_ring_capture_free:
+	ring_cleanup(&pipeline->dump);
+
+error_ring_dump:
+	ring_cleanup(&pipeline->process);
+
+error_ring_process:
+	ring_cleanup(&pipeline->pending);
+
+error_ring_pending:
+	ring_cleanup(&pipeline->decode);
+
+error_ring_decode:
+	ring_cleanup(&pipeline->output_free);
+
+	return ret;
+}
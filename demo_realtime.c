@@ -0,0 +1,280 @@
+/*
+ * Copyright (C) 2024 Paul Kocialkowski <contact@paulk.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "demo.h"
+
+/*
+ * Pipeline threads are created pinned and at SCHED_FIFO priority, so they
+ * never run with default attributes, leaving CPU decode and compression
+ * workers to the regular scheduler since they would starve the system at
+ * real-time priority.
+ */
+
+static int demo_realtime_cpus_parse(const char *list, cpu_set_t *cpus)
+{
+	unsigned long first;
+	unsigned long last;
+	char *end;
+
+	CPU_ZERO(cpus);
+
+	while (*list) {
+		first = strtoul(list, &end, 10);
+		if (end == list)
+			return -EINVAL;
+
+		last = first;
+
+		if (*end == '-') {
+			list = end + 1;
+			last = strtoul(list, &end, 10);
+			if (end == list || last < first)
+				return -EINVAL;
+		}
+
+		if (last >= CPU_SETSIZE)
+			return -EINVAL;
+
+		for (; first <= last; first++)
+			CPU_SET(first, cpus);
+
+		if (*end == ',')
+			end++;
+		else if (*end)
+			return -EINVAL;
+
+		list = end;
+	}
+
+	if (!CPU_COUNT(cpus))
+		return -EINVAL;
+
+	return 0;
+}
+
+static int demo_realtime_attr_setup(struct demo *demo, pthread_attr_t *attr,
+				    bool priority)
+{
+	struct demo_realtime *realtime = &demo->realtime;
+	struct sched_param param = { 0 };
+	cpu_set_t cpus;
+	int ret;
+
+	/* The list was checked at setup. */
+	if (realtime->cpus) {
+		demo_realtime_cpus_parse(realtime->cpus, &cpus);
+
+		ret = pthread_attr_setaffinity_np(attr, sizeof(cpus), &cpus);
+		if (ret)
+			return -ret;
+	}
+
+	if (!priority)
+		return 0;
+
+	param.sched_priority = realtime->priority;
+
+	ret = pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+	if (ret)
+		return -ret;
+
+	ret = pthread_attr_setschedpolicy(attr, SCHED_FIFO);
+	if (ret)
+		return -ret;
+
+	ret = pthread_attr_setschedparam(attr, &param);
+	if (ret)
+		return -ret;
+
+	return 0;
+}
+
+static int demo_realtime_thread_create_attr(struct demo *demo,
+					    pthread_t *thread,
+					    void *(*routine)(void *),
+					    void *data, bool priority)
+{
+	pthread_attr_t attr;
+	int ret;
+
+	ret = pthread_attr_init(&attr);
+	if (ret)
+		return -ret;
+
+	ret = demo_realtime_attr_setup(demo, &attr, priority);
+	if (!ret)
+		ret = -pthread_create(thread, &attr, routine, data);
+
+	pthread_attr_destroy(&attr);
+
+	return ret;
+}
+
+/* Threads run at normal priority, then unpinned, when not permitted. */
+int demo_realtime_thread_create(struct demo *demo, const char *name,
+				pthread_t *thread, void *(*routine)(void *),
+				void *data)
+{
+	struct demo_realtime *realtime = &demo->realtime;
+	int ret;
+
+	if (realtime->priority) {
+		ret = demo_realtime_thread_create_attr(demo, thread, routine,
+						       data, true);
+		if (!ret)
+			return 0;
+
+		fprintf(stderr, "Failed to create %s thread with real-time "
+			"priority: %s\n", name, strerror(-ret));
+	}
+
+	if (realtime->cpus) {
+		ret = demo_realtime_thread_create_attr(demo, thread, routine,
+						       data, false);
+		if (!ret)
+			return 0;
+
+		fprintf(stderr, "Failed to create %s thread on CPUs %s: %s\n",
+			name, realtime->cpus, strerror(-ret));
+	}
+
+	return -pthread_create(thread, NULL, routine, data);
+}
+
+/* Threads already running, such as the main one, are changed in place. */
+void demo_realtime_self_setup(struct demo *demo, const char *name)
+{
+	struct demo_realtime *realtime = &demo->realtime;
+	struct sched_param param = { 0 };
+	pthread_t self = pthread_self();
+	cpu_set_t cpus;
+	int ret;
+
+	if (realtime->cpus) {
+		demo_realtime_cpus_parse(realtime->cpus, &cpus);
+
+		ret = pthread_setaffinity_np(self, sizeof(cpus), &cpus);
+		if (ret)
+			fprintf(stderr, "Failed to pin %s thread to CPUs %s: "
+				"%s\n", name, realtime->cpus, strerror(ret));
+	}
+
+	if (!realtime->priority)
+		return;
+
+	param.sched_priority = realtime->priority;
+
+	ret = pthread_setschedparam(self, SCHED_FIFO, &param);
+	if (ret)
+		fprintf(stderr, "Failed to set %s thread real-time priority: "
+			"%s\n", name, strerror(ret));
+}
+
+void demo_realtime_frame(struct demo *demo)
+{
+	struct demo_realtime *realtime = &demo->realtime;
+	struct timespec now;
+	uint64_t timestamp;
+	uint64_t interval;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timestamp = timespec_ns(now);
+
+	if (realtime->frame_last) {
+		interval = timestamp - realtime->frame_last;
+
+		perf_histogram_add(&realtime->interval, interval);
+
+		if (!realtime->interval_min || interval < realtime->interval_min)
+			realtime->interval_min = interval;
+	}
+
+	realtime->frame_last = timestamp;
+}
+
+void demo_realtime_report(struct demo *demo)
+{
+	struct demo_realtime *realtime = &demo->realtime;
+	struct perf_histogram *interval = &realtime->interval;
+
+	if (!interval->count)
+		return;
+
+	/* Jitter is the spread between the shortest and longest interval. */
+	printf("Frame interval mean %"PRIu64" us min %"PRIu64" us max %"PRIu64
+	       " us, jitter %"PRIu64" us\n",
+	       interval->total / interval->count / 1000,
+	       realtime->interval_min / 1000, interval->max / 1000,
+	       (interval->max - realtime->interval_min) / 1000);
+
+	perf_histogram_print(interval);
+}
+
+int demo_realtime_setup(struct demo *demo)
+{
+	struct demo_realtime *realtime = &demo->realtime;
+	cpu_set_t cpus;
+	int priority_min;
+	int priority_max;
+	int ret;
+
+	if (realtime->cpus) {
+		ret = demo_realtime_cpus_parse(realtime->cpus, &cpus);
+		if (ret) {
+			fprintf(stderr, "Invalid CPU list %s\n",
+				realtime->cpus);
+			return ret;
+		}
+	}
+
+	if (realtime->priority) {
+		priority_min = sched_get_priority_min(SCHED_FIFO);
+		priority_max = sched_get_priority_max(SCHED_FIFO);
+
+		if (realtime->priority < priority_min ||
+		    realtime->priority > priority_max) {
+			fprintf(stderr, "Real-time priority must be within "
+				"%d and %d\n", priority_min, priority_max);
+			return -EINVAL;
+		}
+	}
+
+	if (!realtime->lock)
+		return 0;
+
+	/* Mappings created later are locked and faulted in when created. */
+	ret = mlockall(MCL_CURRENT | MCL_FUTURE);
+	if (ret) {
+		ret = -errno;
+		fprintf(stderr, "Failed to lock memory: %s\n", strerror(-ret));
+		return ret;
+	}
+
+	return 0;
+}
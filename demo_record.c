@@ -0,0 +1,245 @@
+/*
+ * Copyright (C) 2024 Paul Kocialkowski <contact@paulk.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+#include "demo.h"
+
+/*
+ * Camera MJPEG payloads are appended to the record file as they are
+ * dequeued, each preceded by a frame header and padded to 8 bytes:
+ *
+ * header | frame header + payload ... | index entries | footer
+ *
+ * The trailing index gives the offset of each payload for seeking, while
+ * frame headers keep the file readable when recording was interrupted.
+ * All fields are stored in host byte order.
+ */
+
+static int demo_record_writev(int fd, struct iovec *iov, unsigned int count)
+{
+	ssize_t ret;
+
+	while (count) {
+		ret = writev(fd, iov, count);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return -errno;
+		}
+
+		while (count && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			count--;
+		}
+
+		if (count) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+
+static int demo_record_entry_append(struct demo_record *record,
+				    struct demo_record_entry *entry)
+{
+	struct demo_record_entry *entries;
+	unsigned int size;
+
+	if (record->entries_count == record->entries_size) {
+		size = record->entries_size ? record->entries_size * 2 : 64;
+
+		entries = realloc(record->entries, size * sizeof(*entries));
+		if (!entries)
+			return -ENOMEM;
+
+		record->entries = entries;
+		record->entries_size = size;
+	}
+
+	record->entries[record->entries_count++] = *entry;
+
+	return 0;
+}
+
+static int demo_record_frame(struct demo *demo, struct demo_buffer *buffer)
+{
+	static const uint8_t padding[8] = { 0 };
+	struct demo_record *record = &demo->record;
+	struct demo_record_frame frame = { 0 };
+	struct demo_record_entry entry = { 0 };
+	struct iovec iov[3];
+	unsigned int size;
+	uint64_t timestamp;
+	int finish;
+	int ret;
+
+	v4l2_buffer_plane_length_used(&buffer->buffer, 0, &size);
+	v4l2_buffer_timestamp(&buffer->buffer, &timestamp);
+
+	frame.timestamp = timestamp;
+	frame.size = size;
+	frame.sequence = buffer->buffer.sequence;
+
+	ret = demo_buffer_access_begin(buffer);
+	if (ret)
+		return ret;
+
+	iov[0].iov_base = &frame;
+	iov[0].iov_len = sizeof(frame);
+	iov[1].iov_base = buffer->data[0];
+	iov[1].iov_len = size;
+	iov[2].iov_base = (void *)padding;
+	iov[2].iov_len = (8 - size % 8) % 8;
+
+	ret = demo_record_writev(record->fd, iov, 3);
+
+	finish = demo_buffer_access_finish(buffer);
+
+	if (ret) {
+		fprintf(stderr, "Failed to write record file\n");
+		return ret;
+	}
+
+	if (finish)
+		return finish;
+
+	entry.offset = record->offset + sizeof(frame);
+	entry.timestamp = timestamp;
+	entry.size = size;
+	entry.sequence = frame.sequence;
+
+	record->offset += sizeof(frame) + size + iov[2].iov_len;
+
+	return demo_record_entry_append(record, &entry);
+}
+
+static int demo_record_index_write(struct demo *demo)
+{
+	struct demo_record *record = &demo->record;
+	struct demo_record_footer footer = { 0 };
+	struct iovec iov[2];
+
+	footer.index_offset = record->offset;
+	footer.index_count = record->entries_count;
+	memcpy(footer.magic, DEMO_RECORD_INDEX_MAGIC, sizeof(footer.magic));
+
+	iov[0].iov_base = record->entries;
+	iov[0].iov_len = record->entries_count * sizeof(*record->entries);
+	iov[1].iov_base = &footer;
+	iov[1].iov_len = sizeof(footer);
+
+	return demo_record_writev(record->fd, iov, 2);
+}
+
+int demo_record_run(struct demo *demo)
+{
+	struct demo_record *record = &demo->record;
+	struct demo_camera *camera = &demo->camera;
+	struct demo_record_header header = { 0 };
+	struct demo_buffer *buffer;
+	struct iovec iov;
+	unsigned int index;
+	unsigned int i;
+	int release;
+	int ret;
+
+	if (!demo || !record->path || !demo->frames_count)
+		return -EINVAL;
+
+	record->fd = open(record->path, O_WRONLY | O_TRUNC | O_CREAT, 0644);
+	if (record->fd < 0) {
+		fprintf(stderr, "Failed to open record file\n");
+		return -errno;
+	}
+
+	memcpy(header.magic, DEMO_RECORD_MAGIC, sizeof(header.magic));
+	header.version = DEMO_RECORD_VERSION;
+	header.pixel_format = camera->capture_pixel_format;
+	header.width = camera->capture_width;
+	header.height = camera->capture_height;
+	header.interval_numerator = camera->interval.numerator;
+	header.interval_denominator = camera->interval.denominator;
+
+	iov.iov_base = &header;
+	iov.iov_len = sizeof(header);
+
+	ret = demo_record_writev(record->fd, &iov, 1);
+	if (ret)
+		goto complete;
+
+	record->offset = sizeof(header);
+	record->entries_count = 0;
+
+	ret = demo_camera_start(demo);
+	if (ret)
+		goto complete;
+
+	for (i = 0; i < demo->frames_count; i++) {
+		ret = demo_camera_capture(demo, &index);
+		if (ret)
+			break;
+
+		buffer = &camera->capture_buffers[index];
+
+		ret = demo_record_frame(demo, buffer);
+
+		/* The buffer goes back to the camera even when writing failed. */
+		release = demo_camera_release(demo, index);
+		if (!ret)
+			ret = release;
+
+		if (ret)
+			break;
+	}
+
+	demo_camera_stop(demo);
+
+	/* Keep what was recorded replayable even after a failure. */
+	if (record->entries_count) {
+		if (demo_record_index_write(demo))
+			fprintf(stderr, "Failed to write record index\n");
+		else
+			printf("Recorded %u frames (%"PRIu64" bytes) to %s\n",
+			       record->entries_count, record->offset,
+			       record->path);
+	}
+
+	demo_camera_rate_report(demo);
+
+complete:
+	close(record->fd);
+	record->fd = -1;
+
+	free(record->entries);
+	record->entries = NULL;
+	record->entries_size = 0;
+
+	return ret;
+}
@@ -0,0 +1,707 @@
+/*
+ * Copyright (C) 2024 Paul Kocialkowski <contact@paulk.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <linux/dma-buf.h>
+
+#include "demo.h"
+#include "jpeg.h"
+#include "perf.h"
+
+/*
+ * Frames are routed to the hardware decoder or to a pool of CPU workers
+ * running the software decoder, from their headers and the hardware load:
+ * - frames the hardware cannot decode always go to the CPU workers;
+ * - supported frames overflow to an idle CPU worker when the number of
+ *   frames queued to the hardware or its recent latency reach a threshold.
+ *
+ * CPU workers write to the same capture buffers as the hardware, so frames
+ * are reaped in submission order whatever their route. Frames with restart
+ * markers are split in ranges of MCU rows decoded by several workers at once,
+ * each writing its own rows of the capture buffer.
+ */
+
+/* Weight of the last hardware latency in its running average, as 1/2^n. */
+#define DEMO_SCHEDULER_LATENCY_WEIGHT	3
+
+struct demo_scheduler_job {
+	int route;
+	unsigned int capture_index;
+	uint64_t submit_time;
+	uint64_t complete_time;
+
+	/* Frame headers and slices, shared by the workers decoding it. */
+	struct jpeg jpeg;
+	unsigned int slices_pending;
+
+	bool done;
+	int error;
+};
+
+struct demo_scheduler_worker {
+	struct demo *demo;
+	pthread_t thread;
+
+	/* Private state for whole frames and context for slices. */
+	struct jpeg jpeg;
+	struct jpeg_context context;
+};
+
+static const char *demo_scheduler_route_names[] = {
+	[DEMO_SCHEDULER_ROUTE_HARDWARE]	= "hardware",
+	[DEMO_SCHEDULER_ROUTE_SOFTWARE]	= "software",
+	[DEMO_SCHEDULER_ROUTE_OVERFLOW]	= "overflow",
+};
+
+static uint64_t demo_scheduler_time(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return timespec_ns(now);
+}
+
+/* Same criteria as frame validation without the hybrid mode. */
+static bool demo_scheduler_hardware_check(struct demo *demo, struct jpeg *jpeg)
+{
+	struct demo_decoder *decoder = &demo->decoder;
+	struct jpeg_component *component;
+	unsigned int i;
+
+	if (jpeg->progressive)
+		return false;
+
+	if (decoder->capture_packed)
+		return false;
+
+	if (jpeg->width != decoder->output_width ||
+	    jpeg->height != decoder->output_height)
+		return false;
+
+	if (jpeg->components_count == 1)
+		return true;
+
+	component = &jpeg->components[0];
+	if (component->h > 2 || component->v > 2)
+		return false;
+
+	for (i = 1; i < jpeg->components_count; i++) {
+		component = &jpeg->components[i];
+		if (component->h != 1 || component->v != 1)
+			return false;
+	}
+
+	return true;
+}
+
+int demo_scheduler_classify(struct demo *demo, struct jpeg *jpeg,
+			    struct demo_buffer *output_buffer)
+{
+	unsigned int size;
+	int route = DEMO_SCHEDULER_ROUTE_HARDWARE;
+	int ret;
+
+	v4l2_buffer_plane_length_used(&output_buffer->buffer, 0, &size);
+
+	ret = demo_buffer_access_begin(output_buffer);
+	if (ret)
+		return ret;
+
+	/* Frames the software decoder cannot parse are left to hardware. */
+	ret = jpeg_parse(jpeg, output_buffer->data[0], size);
+	if (!ret && !demo_scheduler_hardware_check(demo, jpeg))
+		route = DEMO_SCHEDULER_ROUTE_SOFTWARE;
+
+	demo_buffer_access_finish(output_buffer);
+
+	return route;
+}
+
+/*
+ * Capture buffers are only written by workers, with a single write access for
+ * all the slices of a frame so that no slice invalidates what others wrote.
+ */
+static int demo_scheduler_access_begin(struct demo_buffer *output_buffer,
+				       struct demo_buffer *capture_buffer)
+{
+	int ret;
+
+	ret = demo_buffer_access_begin(output_buffer);
+	if (ret)
+		return ret;
+
+	ret = demo_buffer_access_begin_flags(capture_buffer,
+					     DMA_BUF_SYNC_WRITE);
+	if (ret) {
+		demo_buffer_access_finish(output_buffer);
+		return ret;
+	}
+
+	return 0;
+}
+
+static void demo_scheduler_access_finish(struct demo_buffer *output_buffer,
+					 struct demo_buffer *capture_buffer)
+{
+	demo_buffer_access_finish_flags(capture_buffer, DMA_BUF_SYNC_WRITE);
+	demo_buffer_access_finish(output_buffer);
+}
+
+static int demo_scheduler_output_setup(struct demo *demo,
+				       struct demo_buffer *capture_buffer,
+				       struct jpeg_output *output)
+{
+	struct demo_decoder *decoder = &demo->decoder;
+	const struct demo_format *format;
+	unsigned int width, height;
+	unsigned int stride;
+	unsigned int length;
+	uint8_t *data;
+
+	format = demo_format_find(decoder->capture_pixel_format);
+	if (!format || format->tile_width)
+		return -EINVAL;
+
+	demo_decoder_layout(demo, &stride, &width, &height);
+
+	v4l2_buffer_plane_length(&capture_buffer->buffer, 0, &length);
+	if (demo_format_frame_size(format, stride, height) > length)
+		return -EINVAL;
+
+	data = capture_buffer->data[0];
+
+	output->luma = data;
+	output->stride = stride;
+	output->chroma_shift = format->chroma_shift;
+
+	demo_format_chroma(format, data, stride, height, &output->chroma,
+			   &output->chroma_cr, &output->chroma_stride);
+
+	output->width = decoder->capture_width < width ?
+			decoder->capture_width : width;
+	output->height = decoder->capture_height < height ?
+			 decoder->capture_height : height;
+	output->x = decoder->capture_x;
+	output->y = decoder->capture_y;
+	output->scale = decoder->scale;
+
+	return 0;
+}
+
+static void demo_scheduler_complete(struct demo *demo,
+				    struct demo_buffer *output_buffer,
+				    struct demo_buffer *capture_buffer)
+{
+	const struct demo_format *format;
+	unsigned int width, height;
+	unsigned int stride;
+	uint64_t timestamp;
+	size_t size;
+
+	format = demo_format_find(demo->decoder.capture_pixel_format);
+
+	demo_decoder_layout(demo, &stride, &width, &height);
+
+	size = demo_format_frame_size(format, stride, height);
+	v4l2_buffer_setup_plane_length_used(&capture_buffer->buffer, 0, size);
+
+	/* Timestamps are carried over, as by memory-to-memory drivers. */
+	v4l2_buffer_timestamp(&output_buffer->buffer, &timestamp);
+	v4l2_buffer_setup_timestamp(&capture_buffer->buffer, timestamp);
+}
+
+static int demo_scheduler_decode(struct demo *demo, struct jpeg *jpeg,
+				 struct demo_buffer *output_buffer,
+				 struct demo_buffer *capture_buffer)
+{
+	struct jpeg_output output;
+	unsigned int size;
+	int ret;
+
+	v4l2_buffer_plane_length_used(&output_buffer->buffer, 0, &size);
+
+	ret = demo_scheduler_access_begin(output_buffer, capture_buffer);
+	if (ret)
+		return ret;
+
+	ret = demo_scheduler_output_setup(demo, capture_buffer, &output);
+	if (!ret)
+		ret = jpeg_decode(jpeg, output_buffer->data[0], size, &output);
+
+	demo_scheduler_access_finish(output_buffer, capture_buffer);
+
+	if (ret) {
+		fprintf(stderr, "Failed to decode frame in software\n");
+		return ret;
+	}
+
+	demo_scheduler_complete(demo, output_buffer, capture_buffer);
+
+	return 0;
+}
+
+static int demo_scheduler_slice_decode(struct demo *demo,
+				       struct demo_scheduler_job *job,
+				       struct jpeg_context *context,
+				       unsigned int slice,
+				       struct demo_buffer *output_buffer,
+				       struct demo_buffer *capture_buffer)
+{
+	struct jpeg_output output;
+	unsigned int size;
+	int ret;
+
+	v4l2_buffer_plane_length_used(&output_buffer->buffer, 0, &size);
+
+	/* Buffers are accessed for the whole job, across its slices. */
+	ret = demo_scheduler_output_setup(demo, capture_buffer, &output);
+	if (!ret)
+		ret = jpeg_slice_decode(&job->jpeg, context,
+					output_buffer->data[0], size, slice,
+					&output);
+
+	if (ret)
+		fprintf(stderr, "Failed to decode frame slice %u in software\n",
+			slice);
+
+	return ret;
+}
+
+/* Frames are split across workers when their restart markers allow it. */
+static int demo_scheduler_slices_setup(struct demo *demo,
+				       struct demo_scheduler_job *job,
+				       struct demo_buffer *output_buffer)
+{
+	struct demo_scheduler *scheduler = &demo->scheduler;
+	unsigned int size;
+	int ret;
+
+	job->jpeg.slices_count = 1;
+
+	if (scheduler->slices_max < 2)
+		return 1;
+
+	v4l2_buffer_plane_length_used(&output_buffer->buffer, 0, &size);
+
+	ret = demo_buffer_access_begin(output_buffer);
+	if (ret)
+		return ret;
+
+	ret = jpeg_slices_setup(&job->jpeg, output_buffer->data[0], size,
+				scheduler->slices_max);
+
+	demo_buffer_access_finish(output_buffer);
+
+	return ret;
+}
+
+static void *demo_scheduler_work(void *data)
+{
+	struct demo_scheduler_worker *worker = data;
+	struct demo *demo = worker->demo;
+	struct demo_scheduler *scheduler = &demo->scheduler;
+	struct demo_decoder *decoder = &demo->decoder;
+	struct demo_buffer *output_buffer;
+	struct demo_buffer *capture_buffer;
+	struct demo_scheduler_job *job;
+	unsigned int index;
+	unsigned int slice;
+	unsigned int task;
+	int ret;
+
+	while (1) {
+		pthread_mutex_lock(&scheduler->lock);
+
+		while (!scheduler->queue_count && !scheduler->stopping)
+			pthread_cond_wait(&scheduler->job_cond,
+					  &scheduler->lock);
+
+		if (!scheduler->queue_count) {
+			pthread_mutex_unlock(&scheduler->lock);
+			break;
+		}
+
+		task = scheduler->queue[scheduler->queue_head];
+		scheduler->queue_head = (scheduler->queue_head + 1) %
+					scheduler->queue_size;
+		scheduler->queue_count--;
+
+		pthread_mutex_unlock(&scheduler->lock);
+
+		index = task / scheduler->slices_max;
+		slice = task % scheduler->slices_max;
+
+		job = &scheduler->jobs[index];
+		output_buffer = &decoder->output_buffers[index];
+		capture_buffer = &decoder->capture_buffers[job->capture_index];
+
+		if (job->jpeg.slices_count > 1)
+			ret = demo_scheduler_slice_decode(demo, job,
+							  &worker->context,
+							  slice, output_buffer,
+							  capture_buffer);
+		else
+			ret = demo_scheduler_decode(demo, &worker->jpeg,
+						    output_buffer,
+						    capture_buffer);
+
+		pthread_mutex_lock(&scheduler->lock);
+
+		if (ret && !job->error)
+			job->error = ret;
+
+		scheduler->busy_count--;
+		job->slices_pending--;
+
+		/* The last slice completes the frame. */
+		if (!job->slices_pending) {
+			if (job->jpeg.slices_count > 1)
+				demo_scheduler_access_finish(output_buffer,
+							     capture_buffer);
+
+			if (job->jpeg.slices_count > 1 && !job->error)
+				demo_scheduler_complete(demo, output_buffer,
+							capture_buffer);
+
+			job->complete_time = demo_scheduler_time();
+			job->done = true;
+
+			pthread_cond_broadcast(&scheduler->done_cond);
+		}
+
+		pthread_mutex_unlock(&scheduler->lock);
+	}
+
+	return NULL;
+}
+
+static bool demo_scheduler_overflow_check(struct demo *demo)
+{
+	struct demo_scheduler *scheduler = &demo->scheduler;
+	unsigned int depth;
+	uint64_t latency;
+	bool idle;
+
+	depth = atomic_load(&scheduler->hardware_depth);
+	latency = atomic_load(&scheduler->hardware_latency);
+
+	if ((!scheduler->overflow_depth || depth < scheduler->overflow_depth) &&
+	    (!scheduler->overflow_latency ||
+	     latency < scheduler->overflow_latency * 1000ULL))
+		return false;
+
+	/* Queueing behind busy workers would only add latency. */
+	pthread_mutex_lock(&scheduler->lock);
+	idle = scheduler->busy_count < scheduler->threads_count;
+	pthread_mutex_unlock(&scheduler->lock);
+
+	return idle;
+}
+
+int demo_scheduler_submit(struct demo *demo, unsigned int output_index,
+			  unsigned int capture_index)
+{
+	struct demo_scheduler *scheduler = &demo->scheduler;
+	struct demo_decoder *decoder = &demo->decoder;
+	struct demo_scheduler_job *job;
+	struct demo_buffer *output_buffer;
+	struct demo_buffer *capture_buffer;
+	unsigned int slices_count;
+	unsigned int i;
+	int route;
+	int ret;
+
+	if (!demo || output_index >= scheduler->jobs_count)
+		return -EINVAL;
+
+	job = &scheduler->jobs[output_index];
+	output_buffer = &decoder->output_buffers[output_index];
+	capture_buffer = &decoder->capture_buffers[capture_index];
+
+	route = demo_scheduler_classify(demo, &job->jpeg, output_buffer);
+	if (route < 0)
+		return route;
+
+	if (route == DEMO_SCHEDULER_ROUTE_HARDWARE &&
+	    demo_scheduler_overflow_check(demo))
+		route = DEMO_SCHEDULER_ROUTE_OVERFLOW;
+
+	job->route = route;
+	job->capture_index = capture_index;
+	job->submit_time = demo_scheduler_time();
+	job->done = false;
+	job->error = 0;
+
+	if (route == DEMO_SCHEDULER_ROUTE_HARDWARE) {
+		atomic_fetch_add(&scheduler->hardware_depth, 1);
+
+		return demo_decoder_submit(demo, output_buffer,
+					   capture_buffer);
+	}
+
+	ret = demo_scheduler_slices_setup(demo, job, output_buffer);
+	if (ret < 0)
+		return ret;
+
+	slices_count = ret;
+
+	/* Sink slots are bound in submission order, as for the hardware. */
+	if (decoder->capture_memory == V4L2_MEMORY_USERPTR) {
+		ret = demo_sink_frame_bind(demo, capture_buffer);
+		if (ret)
+			return ret;
+	}
+
+	/* Slices share an access, finished along with the last one. */
+	if (slices_count > 1) {
+		ret = demo_scheduler_access_begin(output_buffer,
+						  capture_buffer);
+		if (ret)
+			return ret;
+	}
+
+	pthread_mutex_lock(&scheduler->lock);
+
+	job->slices_pending = slices_count;
+
+	/* Jobs never outnumber the output buffers, nor slices the workers. */
+	for (i = 0; i < slices_count; i++) {
+		scheduler->queue[scheduler->queue_tail] =
+			output_index * scheduler->slices_max + i;
+		scheduler->queue_tail = (scheduler->queue_tail + 1) %
+					scheduler->queue_size;
+		scheduler->queue_count++;
+		scheduler->busy_count++;
+	}
+
+	if (slices_count > 1)
+		pthread_cond_broadcast(&scheduler->job_cond);
+	else
+		pthread_cond_signal(&scheduler->job_cond);
+
+	pthread_mutex_unlock(&scheduler->lock);
+
+	return 0;
+}
+
+int demo_scheduler_reap(struct demo *demo, unsigned int *output_index,
+			unsigned int *capture_index)
+{
+	struct demo_scheduler *scheduler = &demo->scheduler;
+	struct demo_scheduler_job *job;
+	uint64_t latency;
+	uint64_t average;
+	int ret;
+
+	if (!demo || !output_index || !capture_index ||
+	    *output_index >= scheduler->jobs_count)
+		return -EINVAL;
+
+	job = &scheduler->jobs[*output_index];
+
+	if (job->route == DEMO_SCHEDULER_ROUTE_HARDWARE) {
+		ret = demo_decoder_reap(demo, output_index, capture_index);
+
+		atomic_fetch_sub(&scheduler->hardware_depth, 1);
+
+		if (ret)
+			return ret;
+
+		latency = demo_scheduler_time() - job->submit_time;
+
+		average = atomic_load(&scheduler->hardware_latency);
+		average += ((int64_t)latency - (int64_t)average) /
+			   (1 << DEMO_SCHEDULER_LATENCY_WEIGHT);
+		atomic_store(&scheduler->hardware_latency, average);
+	} else {
+		pthread_mutex_lock(&scheduler->lock);
+
+		while (!job->done)
+			pthread_cond_wait(&scheduler->done_cond,
+					  &scheduler->lock);
+
+		pthread_mutex_unlock(&scheduler->lock);
+
+		if (job->error)
+			return job->error;
+
+		latency = job->complete_time - job->submit_time;
+		*capture_index = job->capture_index;
+	}
+
+	perf_histogram_add(&scheduler->stats[job->route], latency);
+
+	return 0;
+}
+
+void demo_scheduler_report(struct demo *demo)
+{
+	struct demo_scheduler *scheduler = &demo->scheduler;
+	struct perf_histogram *stats;
+	unsigned int route;
+
+	for (route = 0; route < DEMO_SCHEDULER_ROUTES_COUNT; route++) {
+		stats = &scheduler->stats[route];
+		if (!stats->count)
+			continue;
+
+		printf("Routed %u frames to %s, latency mean %"PRIu64" us "
+		       "max %"PRIu64" us\n", stats->count,
+		       demo_scheduler_route_names[route],
+		       stats->total / stats->count / 1000,
+		       stats->max / 1000);
+
+		perf_histogram_print(stats);
+	}
+}
+
+int demo_scheduler_start(struct demo *demo)
+{
+	struct demo_scheduler *scheduler = &demo->scheduler;
+	struct demo_decoder *decoder = &demo->decoder;
+	unsigned int i;
+	int ret;
+
+	if (!demo || !scheduler->threads_count)
+		return -EINVAL;
+
+	scheduler->jobs_count = decoder->output_buffers_count;
+	scheduler->slices_max = scheduler->threads_count < JPEG_SLICES_MAX ?
+				scheduler->threads_count : JPEG_SLICES_MAX;
+	scheduler->queue_size = scheduler->jobs_count * scheduler->slices_max;
+	scheduler->queue_head = 0;
+	scheduler->queue_tail = 0;
+	scheduler->queue_count = 0;
+	scheduler->busy_count = 0;
+	scheduler->stopping = false;
+
+	atomic_init(&scheduler->hardware_depth, 0);
+	atomic_init(&scheduler->hardware_latency, 0);
+
+	memset(scheduler->stats, 0, sizeof(scheduler->stats));
+
+	scheduler->jobs = calloc(scheduler->jobs_count,
+				 sizeof(*scheduler->jobs));
+	scheduler->queue = calloc(scheduler->queue_size,
+				  sizeof(*scheduler->queue));
+	scheduler->workers = calloc(scheduler->threads_count,
+				    sizeof(*scheduler->workers));
+	if (!scheduler->jobs || !scheduler->queue || !scheduler->workers) {
+		demo_scheduler_cleanup(demo);
+		return -ENOMEM;
+	}
+
+	pthread_mutex_init(&scheduler->lock, NULL);
+	pthread_cond_init(&scheduler->job_cond, NULL);
+	pthread_cond_init(&scheduler->done_cond, NULL);
+
+	for (i = 0; i < scheduler->threads_count; i++) {
+		scheduler->workers[i].demo = demo;
+
+		ret = pthread_create(&scheduler->workers[i].thread, NULL,
+				     demo_scheduler_work,
+				     &scheduler->workers[i]);
+		if (ret) {
+			fprintf(stderr, "Failed to create scheduler worker "
+				"thread: %s\n", strerror(ret));
+			goto error;
+		}
+	}
+
+	printf("Hybrid decoding with %u CPU workers\n",
+	       scheduler->threads_count);
+
+	return 0;
+
+error:
+	pthread_mutex_lock(&scheduler->lock);
+	scheduler->stopping = true;
+	pthread_cond_broadcast(&scheduler->job_cond);
+	pthread_mutex_unlock(&scheduler->lock);
+
+	while (i--)
+		pthread_join(scheduler->workers[i].thread, NULL);
+
+	pthread_mutex_destroy(&scheduler->lock);
+	pthread_cond_destroy(&scheduler->job_cond);
+	pthread_cond_destroy(&scheduler->done_cond);
+
+	demo_scheduler_cleanup(demo);
+
+	return -ret;
+}
+
+void demo_scheduler_stop(struct demo *demo)
+{
+	struct demo_scheduler *scheduler = &demo->scheduler;
+	unsigned int i;
+
+	if (!demo || !scheduler->workers)
+		return;
+
+	pthread_mutex_lock(&scheduler->lock);
+	scheduler->stopping = true;
+	pthread_cond_broadcast(&scheduler->job_cond);
+	pthread_mutex_unlock(&scheduler->lock);
+
+	for (i = 0; i < scheduler->threads_count; i++)
+		pthread_join(scheduler->workers[i].thread, NULL);
+
+	pthread_mutex_destroy(&scheduler->lock);
+	pthread_cond_destroy(&scheduler->job_cond);
+	pthread_cond_destroy(&scheduler->done_cond);
+
+	demo_scheduler_cleanup(demo);
+}
+
+void demo_scheduler_cleanup(struct demo *demo)
+{
+	struct demo_scheduler *scheduler = &demo->scheduler;
+	unsigned int i;
+
+	if (scheduler->workers) {
+		for (i = 0; i < scheduler->threads_count; i++) {
+			jpeg_cleanup(&scheduler->workers[i].jpeg);
+			jpeg_context_cleanup(&scheduler->workers[i].context);
+		}
+
+		free(scheduler->workers);
+		scheduler->workers = NULL;
+	}
+
+	if (scheduler->jobs) {
+		for (i = 0; i < scheduler->jobs_count; i++)
+			jpeg_cleanup(&scheduler->jobs[i].jpeg);
+
+		free(scheduler->jobs);
+		scheduler->jobs = NULL;
+	}
+
+	free(scheduler->queue);
+	scheduler->queue = NULL;
+
+	jpeg_cleanup(&scheduler->jpeg);
+}
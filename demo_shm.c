@@ -0,0 +1,211 @@
+/*
+ * Copyright (C) 2024 Paul Kocialkowski <contact@paulk.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "demo.h"
+
+/*
+ * Decoded frames are published to a sealed memfd that reader processes map
+ * through /proc/<pid>/fd/<fd>. Only the header needs to be mapped writable,
+ * for readers to register as waiting. The writer never waits for readers
+ * and overwrites the oldest slot, so readers always get the latest frames.
+ *
+ * Each slot carries a sequence number, odd while the frame is written and
+ * set to 2 * (frame + 1) once complete. Readers wait on the header sequence
+ * futex for the next frame, then check the slot sequence before and after
+ * copying to detect frames overwritten meanwhile:
+ *
+ * frame = header->sequence - 1
+ * slot = &header->slots[frame % header->slots_count]
+ * s1 = slot->sequence, copy, s2 = slot->sequence
+ * valid when s1 == s2 == 2 * (frame + 1)
+ */
+
+#define DEMO_SHM_MAGIC		"CJDS"
+#define DEMO_SHM_VERSION	1
+#define DEMO_SHM_ALIGN		4096
+
+static void demo_shm_futex_wake(atomic_uint *address)
+{
+	/* Readers live in other processes, so the futex is not private. */
+	syscall(SYS_futex, address, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+int demo_shm_publish(struct demo *demo, struct demo_buffer *buffer)
+{
+	struct demo_shm *shm = &demo->shm;
+	struct demo_shm_header *header = shm->header;
+	struct demo_shm_slot *slot;
+	uint64_t timestamp;
+	unsigned int frame;
+	unsigned int size;
+	void *data;
+
+	if (!demo || !buffer || !header)
+		return -EINVAL;
+
+	v4l2_buffer_plane_length_used(&buffer->buffer, 0, &size);
+	if (size > header->slot_size)
+		return -EINVAL;
+
+	v4l2_buffer_timestamp(&buffer->buffer, &timestamp);
+
+	frame = shm->frames_count;
+	slot = &header->slots[frame % header->slots_count];
+	data = (char *)shm->data + header->data_offset +
+	       (size_t)(frame % header->slots_count) * header->slot_size;
+
+	/* Mark the slot as being written before touching its data. */
+	atomic_store_explicit(&slot->sequence, 2 * frame + 1,
+			      memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	memcpy(data, buffer->data[0], size);
+
+	slot->frame = frame;
+	slot->size = size;
+	slot->timestamp = timestamp;
+
+	atomic_store_explicit(&slot->sequence, 2 * (frame + 1),
+			      memory_order_release);
+
+	/* Sequential consistency orders the store against the waiting count. */
+	atomic_store(&header->sequence, frame + 1);
+
+	if (atomic_load(&header->readers_waiting))
+		demo_shm_futex_wake(&header->sequence);
+
+	shm->frames_count++;
+
+	return 0;
+}
+
+int demo_shm_setup(struct demo *demo)
+{
+	struct demo_shm *shm = &demo->shm;
+	struct demo_sink *sink = &demo->sink;
+	struct demo_shm_header *header;
+	unsigned int data_offset;
+	unsigned int slot_size;
+	unsigned int pixel_format;
+	size_t size;
+	void *data;
+	int ret;
+
+	if (!demo || !shm->slots_count || !sink->frame_size)
+		return -EINVAL;
+
+	data_offset = sizeof(*header) +
+		      shm->slots_count * sizeof(struct demo_shm_slot);
+	data_offset = (data_offset + DEMO_SHM_ALIGN - 1) &
+		      ~(DEMO_SHM_ALIGN - 1);
+
+	slot_size = (sink->frame_size + DEMO_SHM_ALIGN - 1) &
+		    ~(DEMO_SHM_ALIGN - 1);
+
+	size = data_offset + (size_t)shm->slots_count * slot_size;
+
+	shm->fd = memfd_create("cedrus-jpeg-decode-demo",
+			       MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (shm->fd < 0) {
+		fprintf(stderr, "Failed to create shared memory\n");
+		return -errno;
+	}
+
+	ret = ftruncate(shm->fd, size);
+	if (ret) {
+		ret = -errno;
+		goto error;
+	}
+
+	/* Readers can rely on the size never changing under their mapping. */
+	ret = fcntl(shm->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+		    F_SEAL_SEAL);
+	if (ret) {
+		ret = -errno;
+		goto error;
+	}
+
+	data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0);
+	if (data == MAP_FAILED) {
+		ret = -errno;
+		goto error;
+	}
+
+	shm->data = data;
+	shm->size = size;
+	shm->header = header = data;
+	shm->frames_count = 0;
+
+	v4l2_format_pixel(&demo->decoder.capture_format, NULL, NULL,
+			  &pixel_format);
+
+	memcpy(header->magic, DEMO_SHM_MAGIC, sizeof(header->magic));
+	header->version = DEMO_SHM_VERSION;
+	header->slots_count = shm->slots_count;
+	header->slot_size = slot_size;
+	header->data_offset = data_offset;
+	header->width = sink->width;
+	header->height = sink->height;
+	header->stride = sink->stride;
+	header->pixel_format = pixel_format;
+
+	atomic_init(&header->sequence, 0);
+	atomic_init(&header->readers_waiting, 0);
+
+	printf("Publishing frames to /proc/%d/fd/%d (%u slots)\n", getpid(),
+	       shm->fd, shm->slots_count);
+
+	return 0;
+
+error:
+	fprintf(stderr, "Failed to setup shared memory\n");
+
+	close(shm->fd);
+	shm->fd = -1;
+
+	return ret;
+}
+
+void demo_shm_cleanup(struct demo *demo)
+{
+	struct demo_shm *shm = &demo->shm;
+
+	if (shm->data) {
+		munmap(shm->data, shm->size);
+		shm->data = NULL;
+		shm->header = NULL;
+	}
+
+	if (shm->fd >= 0) {
+		close(shm->fd);
+		shm->fd = -1;
+	}
+}
@@ -0,0 +1,635 @@
+/*
+ * Copyright (C) 2024 Paul Kocialkowski <contact@paulk.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "demo.h"
+#include "perf.h"
+
+/*
+ * Frames are appended to a single raw or Y4M file, or written to one file
+ * per frame when the dump path is a printf pattern (e.g. frame-%04u.yuv).
+ *
+ * In the single file case, frames are copied to aligned staging slots and
+ * written together with a single writev call, optionally bypassing the page
+ * cache with O_DIRECT. Frames are converted on the way when the requested
+ * pixel format differs from the capture one, and always for Y4M.
+ *
+ * When publishing, frames go to the shared memory ring instead of a file.
+ *
+ * With compression, frames are handed to the compression workers, that
+ * write their own framed container to the dump file.
+ *
+ * In mmap mode, the dump file is preallocated for all frames and mapped so
+ * that decoder capture buffers point straight at its pages (using user
+ * pointers) and the decoder writes the final bytes without any copy.
+ */
+
+#define DEMO_SINK_ALIGN		4096
+
+static const char demo_sink_y4m_frame[] = "FRAME\n";
+
+static size_t demo_sink_align(size_t size)
+{
+	return (size + DEMO_SINK_ALIGN - 1) & ~((size_t)DEMO_SINK_ALIGN - 1);
+}
+
+static size_t demo_sink_convert(struct demo_sink *sink, const uint8_t *src,
+				uint8_t *dst)
+{
+	struct perf perf = { 0 };
+
+	perf_before(&perf);
+	demo_format_convert(sink->convert_format, src, sink->stride,
+			    sink->lines, sink->convert_target, dst,
+			    sink->width, sink->height);
+	perf_after(&perf);
+
+	perf_print(&perf, "format convert");
+
+	return demo_format_frame_size(sink->convert_target, sink->width,
+				      sink->height);
+}
+
+static int demo_sink_frame_stage(struct demo_sink *sink,
+				 struct demo_buffer *buffer, void *slot,
+				 size_t *size)
+{
+	unsigned int size_used;
+
+	if (sink->convert_target) {
+		*size = demo_sink_convert(sink, buffer->data[0], slot);
+		return 0;
+	}
+
+	v4l2_buffer_plane_length_used(&buffer->buffer, 0, &size_used);
+	if (size_used > sink->staging_slot_size)
+		return -EINVAL;
+
+	if (sink->direct && size_used % DEMO_SINK_ALIGN) {
+		fprintf(stderr, "Unaligned frame size for direct write\n");
+		return -EINVAL;
+	}
+
+	memcpy(slot, buffer->data[0], size_used);
+	*size = size_used;
+
+	return 0;
+}
+
+static int demo_sink_writev(int fd, struct iovec *iov, unsigned int count)
+{
+	ssize_t ret;
+
+	while (count) {
+		ret = writev(fd, iov, count);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return -errno;
+		}
+
+		/* Skip over what was written and retry the rest. */
+		while (count && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			count--;
+		}
+
+		if (count) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+
+static int demo_sink_flush(struct demo *demo)
+{
+	struct demo_sink *sink = &demo->sink;
+	struct iovec iov[DEMO_SINK_STAGING_COUNT * 2];
+	struct perf perf = { 0 };
+	unsigned int iov_count = 0;
+	size_t size = 0;
+	unsigned int i;
+	int ret;
+
+	if (!sink->staging_count)
+		return 0;
+
+	for (i = 0; i < sink->staging_count; i++) {
+		if (sink->format == DEMO_SINK_FORMAT_Y4M) {
+			iov[iov_count].iov_base = (void *)demo_sink_y4m_frame;
+			iov[iov_count].iov_len = strlen(demo_sink_y4m_frame);
+			size += iov[iov_count].iov_len;
+			iov_count++;
+		}
+
+		iov[iov_count].iov_base = (char *)sink->staging +
+					  i * sink->staging_slot_size;
+		iov[iov_count].iov_len = sink->staging_sizes[i];
+		size += iov[iov_count].iov_len;
+		iov_count++;
+	}
+
+	perf_before(&perf);
+	ret = demo_sink_writev(sink->fd, iov, iov_count);
+	perf_after(&perf);
+
+	if (ret) {
+		fprintf(stderr, "Failed to write data to output file\n");
+		return ret;
+	}
+
+	printf("Wrote %zu bytes (%u frames) to dump file\n", size,
+	       sink->staging_count);
+
+	perf_print(&perf, "dump write");
+
+	sink->staging_count = 0;
+
+	return 0;
+}
+
+/*
+ * Dump paths are used as the format string for frame file names, so they
+ * must hold a single %u or %d conversion with an optional width and no
+ * other conversion than %%.
+ */
+bool demo_sink_pattern_check(const char *path)
+{
+	unsigned int count = 0;
+
+	while ((path = strchr(path, '%'))) {
+		path++;
+
+		if (*path == '%') {
+			path++;
+			continue;
+		}
+
+		while (*path >= '0' && *path <= '9')
+			path++;
+
+		if (*path != 'u' && *path != 'd')
+			return false;
+
+		path++;
+		count++;
+	}
+
+	return count == 1;
+}
+
+static int demo_sink_write_pattern(struct demo *demo,
+				   struct demo_buffer *buffer)
+{
+	struct demo_sink *sink = &demo->sink;
+	struct iovec iov[3];
+	unsigned int iov_count = 0;
+	unsigned int size_used;
+	char path[256];
+	int fd;
+	int ret;
+
+	snprintf(path, sizeof(path), demo->dump_path, sink->frames_written);
+
+	fd = open(path, O_WRONLY | O_TRUNC | O_CREAT, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open dump file %s\n", path);
+		return -errno;
+	}
+
+	if (sink->format == DEMO_SINK_FORMAT_Y4M) {
+		iov[iov_count].iov_base = sink->header;
+		iov[iov_count].iov_len = sink->header_size;
+		iov_count++;
+
+		iov[iov_count].iov_base = (void *)demo_sink_y4m_frame;
+		iov[iov_count].iov_len = strlen(demo_sink_y4m_frame);
+		iov_count++;
+	}
+
+	if (sink->convert_target) {
+		iov[iov_count].iov_base = sink->staging;
+		iov[iov_count].iov_len = demo_sink_convert(sink,
+							   buffer->data[0],
+							   sink->staging);
+		iov_count++;
+	} else {
+		v4l2_buffer_plane_length_used(&buffer->buffer, 0, &size_used);
+
+		iov[iov_count].iov_base = buffer->data[0];
+		iov[iov_count].iov_len = size_used;
+		iov_count++;
+	}
+
+	ret = demo_sink_writev(fd, iov, iov_count);
+	if (ret)
+		fprintf(stderr, "Failed to write data to %s\n", path);
+	else
+		printf("Wrote frame to dump file %s\n", path);
+
+	close(fd);
+
+	return ret;
+}
+
+int demo_sink_frame_bind(struct demo *demo, struct demo_buffer *buffer)
+{
+	struct demo_sink *sink = &demo->sink;
+	void *data;
+
+	if (!demo || !buffer || !sink->mmap || !sink->data)
+		return -EINVAL;
+
+	if (sink->frame_index >= sink->frames_count) {
+		fprintf(stderr, "No space left in mapped dump file\n");
+		return -ENOSPC;
+	}
+
+	data = (char *)sink->data +
+	       (size_t)sink->frame_index * sink->frame_size;
+
+	v4l2_buffer_setup_userptr(&buffer->buffer, 0, data);
+	buffer->data[0] = data;
+
+	sink->frame_index++;
+
+	return 0;
+}
+
+int demo_sink_write(struct demo *demo, struct demo_buffer *buffer)
+{
+	struct demo_sink *sink = &demo->sink;
+	unsigned int index;
+	unsigned int size;
+	void *slot;
+	int ret;
+
+	if (!demo || !buffer)
+		return -EINVAL;
+
+	if (sink->mmap) {
+		/* Frames complete in the order their slots were bound. */
+		v4l2_buffer_plane_length_used(&buffer->buffer, 0, &size);
+		if (size > sink->frame_size)
+			return -EINVAL;
+
+		printf("Decoded %u bytes in place to dump file\n", size);
+	} else if (demo->shm.slots_count) {
+		ret = demo_shm_publish(demo, buffer);
+		if (ret)
+			return ret;
+	} else if (demo->compress.codec != DEMO_COMPRESS_CODEC_NONE) {
+		ret = demo_compress_frame(demo, buffer);
+		if (ret)
+			return ret;
+	} else if (sink->pattern) {
+		ret = demo_sink_write_pattern(demo, buffer);
+		if (ret)
+			return ret;
+	} else {
+		index = sink->staging_count;
+		slot = (char *)sink->staging + index * sink->staging_slot_size;
+
+		ret = demo_sink_frame_stage(sink, buffer, slot,
+					    &sink->staging_sizes[index]);
+		if (ret)
+			return ret;
+
+		sink->staging_count++;
+
+		if (sink->staging_count == DEMO_SINK_STAGING_COUNT) {
+			ret = demo_sink_flush(demo);
+			if (ret)
+				return ret;
+		}
+	}
+
+	sink->frames_written++;
+
+	return 0;
+}
+
+static int demo_sink_mmap_open(struct demo *demo)
+{
+	struct demo_sink *sink = &demo->sink;
+	size_t size;
+	void *data;
+	int ret;
+
+	if (!sink->frames_count || !sink->frame_size)
+		return -EINVAL;
+
+	size = (size_t)sink->frames_count * sink->frame_size;
+
+	/* Reserve blocks upfront to avoid faulting on a sparse file. */
+	ret = posix_fallocate(sink->fd, 0, size);
+	if (ret) {
+		fprintf(stderr, "Failed to allocate dump file\n");
+		return -ret;
+	}
+
+	data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, sink->fd,
+		    0);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "Failed to map dump file\n");
+		return -errno;
+	}
+
+	sink->data = data;
+	sink->size = size;
+
+	printf("Mapped %zu bytes dump file for %u frames\n", size,
+	       sink->frames_count);
+
+	return 0;
+}
+
+/* Y4M has no semi-planar formats, so its frames are always converted. */
+const struct demo_format *demo_sink_pixel_format(struct demo *demo)
+{
+	struct demo_sink *sink = &demo->sink;
+	const struct demo_format *format;
+
+	format = demo_format_find(sink->pixel_format);
+
+	if (sink->format == DEMO_SINK_FORMAT_Y4M)
+		return demo_format_planar(format);
+
+	return format;
+}
+
+static void demo_sink_layout_setup(struct demo *demo)
+{
+	struct demo_decoder *decoder = &demo->decoder;
+	struct demo_sink *sink = &demo->sink;
+	struct demo_camera *camera = &demo->camera;
+	const struct demo_format *target;
+	unsigned int width, height;
+	unsigned int stride;
+	unsigned int rate_numerator = 30;
+	unsigned int rate_denominator = 1;
+
+	demo_decoder_layout(demo, &stride, &width, &height);
+
+	sink->stride = stride;
+	sink->lines = height;
+
+	sink->convert_format = demo_format_find(decoder->capture_pixel_format);
+	sink->convert_target = NULL;
+
+	target = demo_sink_pixel_format(demo);
+	if (sink->format == DEMO_SINK_FORMAT_Y4M ||
+	    sink->convert_format != target)
+		sink->convert_target = target;
+
+	sink->width = decoder->capture_width < width ?
+		      decoder->capture_width : width;
+	sink->height = decoder->capture_height < height ?
+		       decoder->capture_height : height;
+
+	if (demo->source == DEMO_SOURCE_CAMERA && camera->interval.numerator) {
+		rate_numerator = camera->interval.denominator;
+		rate_denominator = camera->interval.numerator;
+	}
+
+	if (sink->format == DEMO_SINK_FORMAT_Y4M)
+		sink->header_size =
+			snprintf(sink->header, sizeof(sink->header),
+				 "YUV4MPEG2 W%u H%u F%u:%u Ip A1:1 %s\n",
+				 sink->width, sink->height, rate_numerator,
+				 rate_denominator, target->chroma_shift ?
+				 "C420jpeg" : "C422");
+	else
+		sink->header_size = 0;
+}
+
+static int demo_sink_file_open(struct demo *demo)
+{
+	struct demo_sink *sink = &demo->sink;
+	int flags = O_WRONLY | O_TRUNC | O_CREAT;
+
+	sink->direct = false;
+
+	if (sink->direct_request) {
+		if (sink->format != DEMO_SINK_FORMAT_RAW ||
+		    sink->staging_slot_size != sink->frame_size)
+			printf("Direct write needs raw frames aligned to %u "
+			       "bytes, using buffered writes\n",
+			       DEMO_SINK_ALIGN);
+		else
+			sink->direct = true;
+	}
+
+	if (sink->direct) {
+		sink->fd = open(demo->dump_path, flags | O_DIRECT, 0644);
+		if (sink->fd >= 0)
+			return 0;
+
+		printf("Direct write not supported, using buffered writes\n");
+		sink->direct = false;
+	}
+
+	sink->fd = open(demo->dump_path, flags, 0644);
+	if (sink->fd < 0) {
+		fprintf(stderr, "Failed to open dump file\n");
+		return -errno;
+	}
+
+	return 0;
+}
+
+int demo_sink_open(struct demo *demo)
+{
+	struct demo_decoder *decoder = &demo->decoder;
+	struct demo_sink *sink = &demo->sink;
+	struct iovec iov;
+	unsigned int length;
+	unsigned int count;
+	size_t size;
+	int ret;
+
+	if (!demo || !demo->dump_path)
+		return -EINVAL;
+
+	sink->frame_index = 0;
+	sink->frames_written = 0;
+	sink->staging_count = 0;
+	sink->pattern = strchr(demo->dump_path, '%') != NULL;
+
+	demo_sink_layout_setup(demo);
+
+	if (sink->mmap) {
+		sink->fd = open(demo->dump_path, O_RDWR | O_TRUNC | O_CREAT,
+				0644);
+		if (sink->fd < 0) {
+			fprintf(stderr, "Failed to open dump file\n");
+			return -errno;
+		}
+
+		ret = demo_sink_mmap_open(demo);
+		if (ret)
+			goto error;
+
+		ret = demo_decoder_capture_userptr_validate(demo);
+		sink->frame_index = 0;
+		if (ret)
+			goto error_mmap;
+
+		if (decoder->capture_memory == V4L2_MEMORY_USERPTR)
+			return 0;
+
+		/* Frames are copied to the dump file instead. */
+		munmap(sink->data, sink->size);
+		sink->data = NULL;
+		sink->mmap = false;
+
+		close(sink->fd);
+		sink->fd = -1;
+	}
+
+	/* Staging slots are page-aligned for direct writes. */
+	v4l2_buffer_plane_length(&decoder->capture_buffers[0].buffer, 0,
+				 &length);
+
+	sink->frame_size = length;
+
+	if (demo->shm.slots_count)
+		return demo_shm_setup(demo);
+
+	if (demo->compress.codec != DEMO_COMPRESS_CODEC_NONE) {
+		sink->fd = open(demo->dump_path, O_WRONLY | O_TRUNC | O_CREAT,
+				0644);
+		if (sink->fd < 0) {
+			fprintf(stderr, "Failed to open dump file\n");
+			return -errno;
+		}
+
+		ret = demo_compress_start(demo, sink->fd);
+		if (ret)
+			goto error;
+
+		return 0;
+	}
+
+	if (sink->convert_target)
+		size = demo_format_frame_size(sink->convert_target,
+					      sink->width, sink->height);
+	else
+		size = length;
+
+	sink->staging_slot_size = demo_sink_align(size);
+
+	count = sink->pattern ? 1 : DEMO_SINK_STAGING_COUNT;
+
+	ret = posix_memalign(&sink->staging, DEMO_SINK_ALIGN,
+			     count * sink->staging_slot_size);
+	if (ret) {
+		sink->staging = NULL;
+		return -ret;
+	}
+
+	/* Each frame file is opened when written. */
+	if (sink->pattern)
+		return 0;
+
+	ret = demo_sink_file_open(demo);
+	if (ret)
+		goto error_staging;
+
+	if (sink->header_size) {
+		iov.iov_base = sink->header;
+		iov.iov_len = sink->header_size;
+
+		ret = demo_sink_writev(sink->fd, &iov, 1);
+		if (ret) {
+			fprintf(stderr, "Failed to write dump file header\n");
+			goto error;
+		}
+	}
+
+	return 0;
+
+error_mmap:
+	munmap(sink->data, sink->size);
+	sink->data = NULL;
+
+error:
+	close(sink->fd);
+	sink->fd = -1;
+
+error_staging:
+	if (sink->staging) {
+		free(sink->staging);
+		sink->staging = NULL;
+	}
+
+	return ret;
+}
+
+void demo_sink_close(struct demo *demo)
+{
+	struct demo_sink *sink = &demo->sink;
+	size_t size;
+
+	if (!demo)
+		return;
+
+	if (sink->fd >= 0 && sink->staging_count)
+		demo_sink_flush(demo);
+
+	if (demo->compress.workers)
+		demo_compress_finish(demo);
+
+	if (demo->shm.header)
+		demo_shm_cleanup(demo);
+
+	if (sink->staging) {
+		free(sink->staging);
+		sink->staging = NULL;
+	}
+
+	if (sink->fd < 0)
+		return;
+
+	if (sink->data) {
+		munmap(sink->data, sink->size);
+		sink->data = NULL;
+
+		/* Drop slots that were never filled. */
+		size = (size_t)sink->frames_written * sink->frame_size;
+		if (ftruncate(sink->fd, size))
+			fprintf(stderr, "Failed to truncate dump file\n");
+	}
+
+	close(sink->fd);
+	sink->fd = -1;
+}
@@ -0,0 +1,553 @@
+/*
+ * Copyright (C) 2024 Paul Kocialkowski <contact@paulk.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "demo.h"
+#include "perf.h"
+
+/*
+ * Concatenated MJPEG streams (SOI...EOI repeated, possibly with multipart
+ * headers in between) are mapped and split into frames in place. Marker
+ * bytes are located with memchr, that is vectorized by the C library.
+ *
+ * Marker segments are skipped using their length so that embedded
+ * thumbnails do not end the frame early. Entropy-coded data is scanned for
+ * the next marker, ignoring stuffed bytes and restart markers.
+ *
+ * Camera record files are detected by their magic and replayed through their
+ * index instead, paced after the recorded timestamps unless running at max
+ * speed.
+ *
+ * Frames are handed to the decoder as user pointers into the mapping when
+ * aligned, and copied to a page-aligned bounce slot of their buffer otherwise
+ * since single-plane buffers have no data offset to skip leading bytes.
+ */
+
+#define DEMO_STREAM_ALIGN		64
+#define DEMO_STREAM_BOUNCE_ALIGN	4096
+
+#define JPEG_MARKER_SOI		0xd8
+#define JPEG_MARKER_EOI		0xd9
+#define JPEG_MARKER_SOS		0xda
+
+static bool demo_stream_marker_standalone(uint8_t marker)
+{
+	/* TEM, RSTn, SOI and EOI have no length. */
+	return marker == 0x01 || (marker >= 0xd0 && marker <= 0xd9);
+}
+
+static const uint8_t *demo_stream_soi_find(const uint8_t *data,
+					   const uint8_t *end)
+{
+	const uint8_t *p = data;
+
+	while (p < end) {
+		p = memchr(p, 0xff, end - p);
+		if (!p || end - p < 3)
+			return NULL;
+
+		/* Start of image is always followed by another marker. */
+		if (p[1] == JPEG_MARKER_SOI && p[2] == 0xff)
+			return p;
+
+		p++;
+	}
+
+	return NULL;
+}
+
+static const uint8_t *demo_stream_entropy_skip(const uint8_t *data,
+					       const uint8_t *end)
+{
+	const uint8_t *p = data;
+
+	while (p < end) {
+		p = memchr(p, 0xff, end - p);
+		if (!p || end - p < 2)
+			return NULL;
+
+		/* Stuffed zero bytes, restart markers and fill bytes. */
+		if (p[1] == 0x00 || (p[1] >= 0xd0 && p[1] <= 0xd7))
+			p += 2;
+		else if (p[1] == 0xff)
+			p++;
+		else
+			return p;
+	}
+
+	return NULL;
+}
+
+/* Returns the end of the frame, NULL when truncated or corrupted. */
+static const uint8_t *demo_stream_eoi_find(const uint8_t *data,
+					   const uint8_t *end)
+{
+	const uint8_t *p = data + 2;
+	unsigned int length;
+	bool scan = false;
+	uint8_t marker;
+
+	while (end - p >= 2) {
+		if (p[0] != 0xff)
+			return NULL;
+
+		marker = p[1];
+
+		if (marker == 0xff) {
+			p++;
+			continue;
+		}
+
+		/* Frames without any scan are not worth decoding. */
+		if (marker == JPEG_MARKER_EOI)
+			return scan ? p + 2 : NULL;
+
+		/* Another frame started before this one ended. */
+		if (marker == JPEG_MARKER_SOI)
+			return NULL;
+
+		if (demo_stream_marker_standalone(marker)) {
+			p += 2;
+			continue;
+		}
+
+		if (end - p < 4)
+			return NULL;
+
+		length = (p[2] << 8) | p[3];
+		if (length < 2)
+			return NULL;
+
+		p += 2 + length;
+
+		if (marker == JPEG_MARKER_SOS) {
+			scan = true;
+
+			if (p > end)
+				return NULL;
+
+			p = demo_stream_entropy_skip(p, end);
+			if (!p)
+				return NULL;
+		}
+	}
+
+	return NULL;
+}
+
+static int demo_stream_frame_scan(struct demo *demo, const void **data,
+				  unsigned int *size, bool verbose)
+{
+	struct demo_stream *stream = &demo->stream;
+	const uint8_t *base = stream->data;
+	const uint8_t *end = base + stream->size;
+	const uint8_t *start;
+	const uint8_t *stop;
+	const uint8_t *p;
+
+	if (!demo || !data || !size)
+		return -EINVAL;
+
+	p = base + stream->offset;
+
+	while (1) {
+		start = demo_stream_soi_find(p, end);
+		if (!start) {
+			stream->offset = stream->size;
+			return -ENODATA;
+		}
+
+		stop = demo_stream_eoi_find(start, end);
+		if (stop)
+			break;
+
+		/* Resynchronize on the next start of image. */
+		if (verbose)
+			fprintf(stderr, "Skipping corrupted frame at offset "
+				"%zu\n", (size_t)(start - base));
+
+		p = start + 2;
+	}
+
+	stream->offset = stop - base;
+
+	*data = start;
+	*size = stop - start;
+
+	return 0;
+}
+
+static int demo_stream_entry_next(struct demo *demo, const void **data,
+				  unsigned int *size, uint64_t *timestamp)
+{
+	struct demo_stream *stream = &demo->stream;
+	const struct demo_record_entry *entry;
+	struct timespec now;
+	struct timespec target;
+	uint64_t delta;
+	uint64_t time;
+
+	if (stream->entry_index >= stream->frames_count)
+		return -ENODATA;
+
+	entry = &stream->entries[stream->entry_index];
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (!stream->entry_index) {
+		stream->timestamp_first = entry->timestamp;
+		stream->replay_start = timespec_ns(now);
+	}
+
+	time = timespec_ns(now);
+
+	if (stream->speed > 0 && entry->timestamp > stream->timestamp_first) {
+		delta = entry->timestamp - stream->timestamp_first;
+		time = stream->replay_start + (uint64_t)(delta / stream->speed);
+
+		target.tv_sec = time / 1000000000ULL;
+		target.tv_nsec = time % 1000000000ULL;
+
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &target,
+				       NULL) == EINTR);
+	}
+
+	*data = (const uint8_t *)stream->data + entry->offset;
+	*size = entry->size;
+
+	/* Frames are stamped as if captured live at replay time. */
+	if (timestamp)
+		*timestamp = time;
+
+	stream->entry_index++;
+
+	return 0;
+}
+
+int demo_stream_frame_next(struct demo *demo, const void **data,
+			   unsigned int *size, uint64_t *timestamp)
+{
+	if (!demo || !data || !size)
+		return -EINVAL;
+
+	if (demo->stream.entries)
+		return demo_stream_entry_next(demo, data, size, timestamp);
+
+	if (timestamp)
+		*timestamp = 0;
+
+	return demo_stream_frame_scan(demo, data, size, true);
+}
+
+static int demo_stream_bounce(struct demo *demo, struct demo_buffer *buffer,
+			      const void *data, unsigned int size)
+{
+	struct demo_stream *stream = &demo->stream;
+	struct perf perf = { 0 };
+	unsigned int index = buffer->buffer.index;
+	uint8_t *bounce;
+
+	if (!stream->bounce || size > stream->bounce_slot_size)
+		return -ENOMEM;
+
+	bounce = (uint8_t *)stream->bounce + index * stream->bounce_slot_size;
+
+	perf_before(&perf);
+	memcpy(bounce, data, size);
+	perf_after(&perf);
+
+	perf_print(&perf, "stream bounce");
+
+	v4l2_buffer_setup_userptr(&buffer->buffer, 0, bounce);
+	buffer->data[0] = bounce;
+
+	return 0;
+}
+
+/* Retries a frame refused by the decoder from its bounce slot. */
+int demo_stream_frame_bounce(struct demo *demo, struct demo_buffer *buffer)
+{
+	struct demo_stream *stream = &demo->stream;
+	unsigned int index = buffer->buffer.index;
+	unsigned int size;
+
+	if (!demo || !buffer || buffer->buffer.memory != V4L2_MEMORY_USERPTR)
+		return -EINVAL;
+
+	/* Already bounced, nothing else to try. */
+	if (stream->bounce && buffer->data[0] == (uint8_t *)stream->bounce +
+	    index * stream->bounce_slot_size)
+		return -EINVAL;
+
+	v4l2_buffer_plane_length_used(&buffer->buffer, 0, &size);
+
+	return demo_stream_bounce(demo, buffer, buffer->data[0], size);
+}
+
+int demo_stream_frame_load(struct demo *demo, struct demo_buffer *buffer,
+			   const void *data, unsigned int size,
+			   uint64_t timestamp)
+{
+	struct perf perf = { 0 };
+	unsigned int length;
+	int ret;
+
+	if (!demo || !buffer || !data)
+		return -EINVAL;
+
+	if (buffer->buffer.memory == V4L2_MEMORY_USERPTR &&
+	    (uintptr_t)data % DEMO_STREAM_ALIGN) {
+		ret = demo_stream_bounce(demo, buffer, data, size);
+		if (ret)
+			return ret;
+	} else if (buffer->buffer.memory == V4L2_MEMORY_USERPTR) {
+		/* The decoder reads straight from the input mapping. */
+		v4l2_buffer_setup_userptr(&buffer->buffer, 0, (void *)data);
+		buffer->data[0] = (void *)data;
+	} else {
+		v4l2_buffer_plane_length(&buffer->buffer, 0, &length);
+		if (length < size)
+			return -ENOMEM;
+
+		ret = demo_buffer_access_begin(buffer);
+		if (ret)
+			return ret;
+
+		perf_before(&perf);
+		memcpy(buffer->data[0], data, size);
+		perf_after(&perf);
+
+		ret = demo_buffer_access_finish(buffer);
+		if (ret)
+			return ret;
+
+		perf_print(&perf, "stream copy");
+	}
+
+	v4l2_buffer_setup_plane_length_used(&buffer->buffer, 0, size);
+
+	if (timestamp)
+		v4l2_buffer_setup_timestamp(&buffer->buffer, timestamp);
+
+	return 0;
+}
+
+static int demo_stream_record_open(struct demo *demo)
+{
+	struct demo_stream *stream = &demo->stream;
+	const struct demo_record_header *header = stream->data;
+	const struct demo_record_footer *footer;
+	const struct demo_record_entry *entry;
+	uint64_t index_size;
+	unsigned int i;
+
+	if (stream->size < sizeof(*header) + sizeof(*footer) ||
+	    memcmp(header->magic, DEMO_RECORD_MAGIC, sizeof(header->magic)))
+		return -ENOENT;
+
+	footer = (const void *)((const uint8_t *)stream->data + stream->size -
+				sizeof(*footer));
+
+	if (header->version != DEMO_RECORD_VERSION ||
+	    memcmp(footer->magic, DEMO_RECORD_INDEX_MAGIC,
+		   sizeof(footer->magic))) {
+		fprintf(stderr, "Unsupported or unfinished record file\n");
+		return -EINVAL;
+	}
+
+	index_size = (uint64_t)footer->index_count * sizeof(*entry);
+
+	if (footer->index_offset < sizeof(*header) ||
+	    footer->index_offset % 8 ||
+	    footer->index_offset + index_size + sizeof(*footer) !=
+	    stream->size)
+		goto error;
+
+	stream->entries = (const void *)((const uint8_t *)stream->data +
+					 footer->index_offset);
+
+	for (i = 0; i < footer->index_count; i++) {
+		entry = &stream->entries[i];
+
+		if (entry->offset < sizeof(*header) ||
+		    entry->offset > footer->index_offset ||
+		    entry->size > footer->index_offset - entry->offset)
+			goto error;
+	}
+
+	stream->frames_count = footer->index_count;
+	stream->entry_index = 0;
+
+	printf("Replaying %u frames recorded at %ux%u\n", stream->frames_count,
+	       header->width, header->height);
+
+	return 0;
+
+error:
+	fprintf(stderr, "Corrupted record file index\n");
+
+	stream->entries = NULL;
+
+	return -EINVAL;
+}
+
+int demo_stream_open(struct demo *demo, char *path)
+{
+	struct demo_stream *stream = &demo->stream;
+	struct demo_decoder *decoder = &demo->decoder;
+	struct stat stat;
+	const void *data;
+	unsigned int length;
+	unsigned int size;
+	size_t tail;
+	void *base;
+	void *map;
+	int ret;
+
+	if (!demo || !path)
+		return -EINVAL;
+
+	stream->fd = open(path, O_RDONLY);
+	if (stream->fd < 0) {
+		fprintf(stderr, "Failed to open input stream\n");
+		return -errno;
+	}
+
+	ret = fstat(stream->fd, &stat);
+	if (ret) {
+		ret = -errno;
+		goto error;
+	}
+
+	if (!stat.st_size) {
+		ret = -ENODATA;
+		goto error;
+	}
+
+	stream->size = stat.st_size;
+
+	/*
+	 * User pointers must cover a whole buffer from the start of the last
+	 * frame, so reserve anonymous memory past the end of the file.
+	 */
+	v4l2_buffer_plane_length(&decoder->output_buffers[0].buffer, 0,
+				 &length);
+
+	tail = length;
+
+	base = mmap(NULL, stream->size + tail, PROT_READ,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED) {
+		ret = -errno;
+		goto error;
+	}
+
+	map = mmap(base, stream->size, PROT_READ, MAP_PRIVATE | MAP_FIXED,
+		   stream->fd, 0);
+	if (map == MAP_FAILED) {
+		ret = -errno;
+		munmap(base, stream->size + tail);
+		goto error;
+	}
+
+	stream->data = map;
+	stream->map_size = stream->size + tail;
+
+	madvise((void *)stream->data, stream->size, MADV_SEQUENTIAL);
+
+	ret = demo_decoder_output_userptr_validate(demo, (void *)stream->data);
+	if (ret)
+		goto error_map;
+
+	if (decoder->output_memory == V4L2_MEMORY_USERPTR) {
+		stream->bounce_slot_size = length + DEMO_STREAM_BOUNCE_ALIGN - 1;
+		stream->bounce_slot_size &= ~((size_t)DEMO_STREAM_BOUNCE_ALIGN - 1);
+
+		ret = posix_memalign(&stream->bounce, DEMO_STREAM_BOUNCE_ALIGN,
+				     decoder->output_buffers_count *
+				     stream->bounce_slot_size);
+		if (ret) {
+			stream->bounce = NULL;
+			ret = -ret;
+			goto error_map;
+		}
+	}
+
+	ret = demo_stream_record_open(demo);
+	if (!ret)
+		return 0;
+	else if (ret != -ENOENT)
+		goto error_bounce;
+
+	/* Count frames upfront, for a sized dump file in mmap mode. */
+	stream->offset = 0;
+	stream->frames_count = 0;
+
+	while (!demo_stream_frame_scan(demo, &data, &size, false))
+		stream->frames_count++;
+
+	stream->offset = 0;
+
+	printf("Found %u frames in input stream\n", stream->frames_count);
+
+	return 0;
+
+error_bounce:
+	free(stream->bounce);
+	stream->bounce = NULL;
+
+error_map:
+	munmap((void *)stream->data, stream->map_size);
+	stream->data = NULL;
+
+error:
+	fprintf(stderr, "Failed to map input stream\n");
+
+	close(stream->fd);
+	stream->fd = -1;
+
+	return ret;
+}
+
+void demo_stream_close(struct demo *demo)
+{
+	struct demo_stream *stream = &demo->stream;
+
+	if (stream->data) {
+		munmap((void *)stream->data, stream->map_size);
+		stream->data = NULL;
+		stream->entries = NULL;
+	}
+
+	free(stream->bounce);
+	stream->bounce = NULL;
+
+	if (stream->fd >= 0) {
+		close(stream->fd);
+		stream->fd = -1;
+	}
+}
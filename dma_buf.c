@@ -20,6 +20,7 @@
 #include <linux/dma-buf.h>
 
 #include "dma_buf.h"
+#include "perf.h"
 
 int dma_buf_sync(int fd, long flags)
 {
@@ -28,7 +29,7 @@ int dma_buf_sync(int fd, long flags)
 
 	sync.flags = flags;
 
-	ret = ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+	ret = perf_ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
 	if (ret)
 		return -errno;
 
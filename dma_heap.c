@@ -23,6 +23,7 @@
 #include <linux/dma-heap.h>
 
 #include "dma_heap.h"
+#include "perf.h"
 
 int dma_heap_open(const char *name)
 {
@@ -53,7 +54,7 @@ int dma_heap_alloc(int fd, unsigned int size, int flags)
 	allocation_data.len = size;
 	allocation_data.fd_flags = flags;
 
-	ret = ioctl(fd, DMA_HEAP_IOCTL_ALLOC, &allocation_data);
+	ret = perf_ioctl(fd, DMA_HEAP_IOCTL_ALLOC, &allocation_data);
 	if (ret)
 		return -errno;
 
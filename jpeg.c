@@ -0,0 +1,1877 @@
+/*
+ * Copyright (C) 2024 Paul Kocialkowski <contact@paulk.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+
+#include "jpeg.h"
+
+#define JPEG_MARKER_SOF0	0xc0
+#define JPEG_MARKER_SOF1	0xc1
+#define JPEG_MARKER_SOF2	0xc2
+#define JPEG_MARKER_DHT		0xc4
+#define JPEG_MARKER_RST0	0xd0
+#define JPEG_MARKER_RST7	0xd7
+#define JPEG_MARKER_SOI		0xd8
+#define JPEG_MARKER_EOI		0xd9
+#define JPEG_MARKER_SOS		0xda
+#define JPEG_MARKER_DQT		0xdb
+#define JPEG_MARKER_DRI		0xdd
+
+/* Fixed-point IDCT constants, with 12 fractional bits. */
+#define JPEG_FIX(x)		((int)((x) * 4096 + 0.5))
+
+/* Zig-zag to natural order, padded for runs past the end of a block. */
+static const uint8_t jpeg_zigzag[64 + 16] = {
+	 0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+	12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+	63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63, 63,
+};
+
+static unsigned int jpeg_read16(const uint8_t *data)
+{
+	return (data[0] << 8) | data[1];
+}
+
+static uint64_t jpeg_read64(const uint8_t *data)
+{
+	uint64_t value;
+
+	memcpy(&value, data, sizeof(value));
+
+	return be64toh(value);
+}
+
+/* Bit reader */
+
+static void jpeg_bits_setup(struct jpeg_bits *bits, const uint8_t *data,
+			    const uint8_t *end)
+{
+	bits->data = data;
+	bits->end = end;
+	bits->buffer = 0;
+	bits->count = 0;
+}
+
+static void jpeg_bits_fill(struct jpeg_bits *bits)
+{
+	unsigned int count;
+	uint64_t mask;
+	uint64_t word;
+	uint8_t byte;
+
+	/*
+	 * Load as many whole bytes as fit at once when the next 8 bytes have
+	 * no 0xff, which is checked for without branching on each byte.
+	 */
+	if (bits->end - bits->data >= 8) {
+		word = jpeg_read64(bits->data);
+
+		if (!((~word - 0x0101010101010101ULL) & word &
+		      0x8080808080808080ULL)) {
+			count = (64 - bits->count) / 8;
+			mask = ~0ULL << (64 - bits->count - count * 8);
+
+			bits->buffer |= (word >> bits->count) & mask;
+			bits->data += count;
+			bits->count += count * 8;
+
+			return;
+		}
+	}
+
+	while (bits->count <= 56) {
+		byte = 0;
+
+		/* Markers end entropy-coded data, zeros are fed past them. */
+		if (bits->data < bits->end) {
+			if (bits->data[0] != 0xff) {
+				byte = *bits->data++;
+			} else if (bits->end - bits->data >= 2 &&
+				   bits->data[1] == 0x00) {
+				byte = 0xff;
+				bits->data += 2;
+			}
+		}
+
+		bits->buffer |= (uint64_t)byte << (56 - bits->count);
+		bits->count += 8;
+	}
+}
+
+static unsigned int jpeg_bits_get(struct jpeg_bits *bits, unsigned int count)
+{
+	unsigned int value;
+
+	if (!count)
+		return 0;
+
+	if (bits->count < count)
+		jpeg_bits_fill(bits);
+
+	value = bits->buffer >> (64 - count);
+	bits->buffer <<= count;
+	bits->count -= count;
+
+	return value;
+}
+
+static int jpeg_extend(unsigned int value, unsigned int count)
+{
+	if (count && value < (1U << (count - 1)))
+		return (int)value - (1 << count) + 1;
+
+	return value;
+}
+
+/* Huffman */
+
+/*
+ * Codes up to the lookahead length are decoded with a single lookup of the
+ * next bits, along with the magnitude bits following them when these fit.
+ */
+static void jpeg_huffman_lookahead_setup(struct jpeg_huffman *huffman,
+					 bool dc)
+{
+	struct jpeg_huffman_entry *entry;
+	unsigned int index = 0;
+	unsigned int code = 0;
+	unsigned int length;
+	unsigned int shift;
+	unsigned int size;
+	unsigned int fill;
+	unsigned int magnitude;
+	unsigned int i;
+	uint8_t symbol;
+
+	memset(huffman->lookahead, 0, sizeof(huffman->lookahead));
+
+	for (length = 1; length <= JPEG_HUFFMAN_LOOKAHEAD; length++) {
+		shift = JPEG_HUFFMAN_LOOKAHEAD - length;
+
+		for (i = 0; i < huffman->bits[length]; i++, index++, code++) {
+			symbol = huffman->values[index];
+			size = dc ? symbol : symbol & 0xf;
+
+			for (fill = 0; fill < (1U << shift); fill++) {
+				entry = &huffman->lookahead[(code << shift) |
+							    fill];
+				entry->symbol = symbol;
+				entry->code_length = length;
+
+				if (size > shift)
+					continue;
+
+				magnitude = (fill >> (shift - size)) &
+					    ((1U << size) - 1);
+
+				entry->length = length + size;
+				entry->value = jpeg_extend(magnitude, size);
+			}
+		}
+
+		code <<= 1;
+	}
+}
+
+static int jpeg_huffman_setup(struct jpeg_huffman *huffman, bool dc,
+			      bool lookahead)
+{
+	int32_t code = 0;
+	unsigned int index = 0;
+	unsigned int length;
+
+	for (length = 1; length <= 16; length++) {
+		huffman->valptr[length] = index;
+		huffman->mincode[length] = code;
+
+		code += huffman->bits[length];
+		index += huffman->bits[length];
+
+		if (code > (1 << length))
+			return -EBADMSG;
+
+		huffman->maxcode[length] = code - 1;
+		if (!huffman->bits[length])
+			huffman->maxcode[length] = -1;
+
+		code <<= 1;
+	}
+
+	huffman->maxcode[17] = INT32_MAX;
+	huffman->present = true;
+
+	/* Without lookahead, all codes are decoded one bit at a time. */
+	if (lookahead)
+		jpeg_huffman_lookahead_setup(huffman, dc);
+	else
+		memset(huffman->lookahead, 0, sizeof(huffman->lookahead));
+
+	return 0;
+}
+
+static void jpeg_bits_skip(struct jpeg_bits *bits, unsigned int count)
+{
+	bits->buffer <<= count;
+	bits->count -= count;
+}
+
+static int jpeg_huffman_decode(struct jpeg_bits *bits,
+			       const struct jpeg_huffman *huffman)
+{
+	const struct jpeg_huffman_entry *entry;
+	unsigned int length;
+	int32_t code;
+
+	if (bits->count < 16)
+		jpeg_bits_fill(bits);
+
+	entry = &huffman->lookahead[bits->buffer >>
+				    (64 - JPEG_HUFFMAN_LOOKAHEAD)];
+	if (entry->code_length) {
+		jpeg_bits_skip(bits, entry->code_length);
+		return entry->symbol;
+	}
+
+	for (length = 1; length <= 16; length++) {
+		code = bits->buffer >> (64 - length);
+
+		if (code <= huffman->maxcode[length]) {
+			jpeg_bits_skip(bits, length);
+			return huffman->values[huffman->valptr[length] + code -
+					       huffman->mincode[length]];
+		}
+	}
+
+	return -EBADMSG;
+}
+
+/* Decode a symbol and the signed value of the magnitude bits following it. */
+static int jpeg_huffman_decode_value(struct jpeg_bits *bits,
+				     const struct jpeg_huffman *huffman,
+				     unsigned int size_mask, int *value)
+{
+	const struct jpeg_huffman_entry *entry;
+	unsigned int size;
+	int symbol;
+
+	if (bits->count < 16)
+		jpeg_bits_fill(bits);
+
+	entry = &huffman->lookahead[bits->buffer >>
+				    (64 - JPEG_HUFFMAN_LOOKAHEAD)];
+	if (entry->length) {
+		jpeg_bits_skip(bits, entry->length);
+		*value = entry->value;
+		return entry->symbol;
+	}
+
+	symbol = jpeg_huffman_decode(bits, huffman);
+	if (symbol < 0)
+		return symbol;
+
+	size = symbol & size_mask;
+	if (size > 16)
+		return -EBADMSG;
+
+	*value = jpeg_extend(jpeg_bits_get(bits, size), size);
+
+	return symbol;
+}
+
+/* Segments */
+
+static int jpeg_segment_dqt(struct jpeg *jpeg, const uint8_t *data,
+			    unsigned int length)
+{
+	unsigned int precision;
+	unsigned int table;
+	unsigned int size;
+	unsigned int i;
+
+	while (length) {
+		precision = data[0] >> 4;
+		table = data[0] & 0xf;
+		size = 1 + 64 * (precision ? 2 : 1);
+
+		if (table >= JPEG_TABLES_MAX || precision > 1 || length < size)
+			return -EBADMSG;
+
+		for (i = 0; i < 64; i++)
+			jpeg->quant[table][jpeg_zigzag[i]] = precision ?
+				jpeg_read16(&data[1 + i * 2]) : data[1 + i];
+
+		data += size;
+		length -= size;
+	}
+
+	return 0;
+}
+
+static int jpeg_segment_dht(struct jpeg *jpeg, const uint8_t *data,
+			    unsigned int length)
+{
+	struct jpeg_huffman *huffman;
+	unsigned int class;
+	unsigned int table;
+	unsigned int count;
+	unsigned int i;
+	int ret;
+
+	while (length) {
+		if (length < 17)
+			return -EBADMSG;
+
+		class = data[0] >> 4;
+		table = data[0] & 0xf;
+
+		if (class > 1 || table >= JPEG_TABLES_MAX)
+			return -EBADMSG;
+
+		huffman = class ? &jpeg->ac[table] : &jpeg->dc[table];
+
+		for (i = 1, count = 0; i <= 16; i++) {
+			huffman->bits[i] = data[i];
+			count += data[i];
+		}
+
+		if (count > 256 || length < 17 + count)
+			return -EBADMSG;
+
+		memcpy(huffman->values, &data[17], count);
+
+		ret = jpeg_huffman_setup(huffman, !class, !jpeg->reference);
+		if (ret)
+			return ret;
+
+		data += 17 + count;
+		length -= 17 + count;
+	}
+
+	return 0;
+}
+
+static int jpeg_segment_sof(struct jpeg *jpeg, unsigned int marker,
+			    const uint8_t *data, unsigned int length)
+{
+	struct jpeg_component *component;
+	unsigned int count;
+	unsigned int i;
+
+	/* Only a single frame is supported. */
+	if (jpeg->components_count || length < 6)
+		return -EBADMSG;
+
+	if (data[0] != 8)
+		return -ENOTSUP;
+
+	jpeg->height = jpeg_read16(&data[1]);
+	jpeg->width = jpeg_read16(&data[3]);
+	jpeg->progressive = marker == JPEG_MARKER_SOF2;
+	count = data[5];
+
+	if (!jpeg->width || !jpeg->height)
+		return -ENOTSUP;
+
+	if (count != 1 && count != JPEG_COMPONENTS_MAX)
+		return -ENOTSUP;
+
+	if (length < 6 + count * 3)
+		return -EBADMSG;
+
+	jpeg->hmax = 1;
+	jpeg->vmax = 1;
+
+	for (i = 0; i < count; i++) {
+		component = &jpeg->components[i];
+		component->id = data[6 + i * 3];
+		component->h = data[7 + i * 3] >> 4;
+		component->v = data[7 + i * 3] & 0xf;
+		component->tq = data[8 + i * 3];
+
+		if (component->h < 1 || component->h > 4 ||
+		    component->v < 1 || component->v > 4 ||
+		    component->tq >= JPEG_TABLES_MAX)
+			return -EBADMSG;
+
+		/* A single component is coded as one block per MCU. */
+		if (count == 1) {
+			component->h = 1;
+			component->v = 1;
+		}
+
+		if (component->h > jpeg->hmax)
+			jpeg->hmax = component->h;
+
+		if (component->v > jpeg->vmax)
+			jpeg->vmax = component->v;
+	}
+
+	jpeg->mcus_x = (jpeg->width + jpeg->hmax * 8 - 1) / (jpeg->hmax * 8);
+	jpeg->mcus_y = (jpeg->height + jpeg->vmax * 8 - 1) / (jpeg->vmax * 8);
+
+	for (i = 0; i < count; i++) {
+		component = &jpeg->components[i];
+		component->blocks_w = jpeg->mcus_x * component->h;
+		component->blocks_h = jpeg->mcus_y * component->v;
+		component->width_blocks =
+			((jpeg->width * component->h + jpeg->hmax - 1) /
+			 jpeg->hmax + 7) / 8;
+		component->height_blocks =
+			((jpeg->height * component->v + jpeg->vmax - 1) /
+			 jpeg->vmax + 7) / 8;
+	}
+
+	jpeg->components_count = count;
+
+	return 0;
+}
+
+static int jpeg_segment_sos(struct jpeg *jpeg, const uint8_t *data,
+			    unsigned int length)
+{
+	struct jpeg_component *component;
+	struct jpeg_scan *scan = &jpeg->scan;
+	unsigned int count;
+	unsigned int i, j;
+
+	if (!jpeg->components_count || length < 1)
+		return -EBADMSG;
+
+	count = data[0];
+
+	if (!count || count > jpeg->components_count ||
+	    length < 4 + count * 2)
+		return -EBADMSG;
+
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < jpeg->components_count; j++)
+			if (jpeg->components[j].id == data[1 + i * 2])
+				break;
+
+		if (j == jpeg->components_count)
+			return -EBADMSG;
+
+		component = &jpeg->components[j];
+		component->td = data[2 + i * 2] >> 4;
+		component->ta = data[2 + i * 2] & 0xf;
+
+		if (component->td >= JPEG_TABLES_MAX ||
+		    component->ta >= JPEG_TABLES_MAX)
+			return -EBADMSG;
+
+		scan->components[i] = j;
+	}
+
+	scan->components_count = count;
+	scan->ss = data[1 + count * 2];
+	scan->se = data[2 + count * 2];
+	scan->ah = data[3 + count * 2] >> 4;
+	scan->al = data[3 + count * 2] & 0xf;
+
+	if (!jpeg->progressive) {
+		if (scan->ss != 0 || scan->se != 63 || scan->ah || scan->al)
+			return -EBADMSG;
+	} else {
+		if (scan->ss > scan->se || scan->se > 63 || scan->al > 13)
+			return -EBADMSG;
+
+		/* Spectral selection splits DC and AC, one component AC. */
+		if ((scan->ss == 0 && scan->se != 0) ||
+		    (scan->ss != 0 && count != 1))
+			return -EBADMSG;
+	}
+
+	for (i = 0; i < count; i++) {
+		component = &jpeg->components[scan->components[i]];
+
+		if (scan->ss == 0 && !scan->ah &&
+		    !jpeg->dc[component->td].present)
+			return -EBADMSG;
+
+		if (scan->se != 0 && !jpeg->ac[component->ta].present)
+			return -EBADMSG;
+	}
+
+	return 0;
+}
+
+/*
+ * Process segments until the header of the next scan, leaving the data
+ * pointer at its entropy-coded data. Returns 1 for a scan, 0 at the end.
+ */
+static int jpeg_segments(struct jpeg *jpeg, const uint8_t **data,
+			 const uint8_t *end)
+{
+	const uint8_t *p = *data;
+	unsigned int marker;
+	unsigned int length;
+	int ret;
+
+	while (1) {
+		if (end - p < 2 || p[0] != 0xff)
+			return -EBADMSG;
+
+		/* Fill bytes may precede any marker. */
+		while (p < end && p[0] == 0xff)
+			p++;
+
+		if (p == end)
+			return -EBADMSG;
+
+		marker = *p++;
+
+		if (marker == JPEG_MARKER_EOI) {
+			*data = p;
+			return 0;
+		}
+
+		if ((marker >= JPEG_MARKER_RST0 &&
+		     marker <= JPEG_MARKER_RST7) || marker == JPEG_MARKER_SOI)
+			continue;
+
+		if (end - p < 2)
+			return -EBADMSG;
+
+		length = jpeg_read16(p);
+		if (length < 2 || (unsigned int)(end - p) < length)
+			return -EBADMSG;
+
+		p += 2;
+		length -= 2;
+
+		switch (marker) {
+		case JPEG_MARKER_SOF0:
+		case JPEG_MARKER_SOF1:
+		case JPEG_MARKER_SOF2:
+			ret = jpeg_segment_sof(jpeg, marker, p, length);
+			break;
+		case JPEG_MARKER_DHT:
+			ret = jpeg_segment_dht(jpeg, p, length);
+			break;
+		case JPEG_MARKER_DQT:
+			ret = jpeg_segment_dqt(jpeg, p, length);
+			break;
+		case JPEG_MARKER_DRI:
+			if (length < 2)
+				return -EBADMSG;
+
+			jpeg->restart_interval = jpeg_read16(p);
+			ret = 0;
+			break;
+		case JPEG_MARKER_SOS:
+			ret = jpeg_segment_sos(jpeg, p, length);
+			if (ret)
+				return ret;
+
+			*data = p + length;
+			return 1;
+		default:
+			/* Lossless, arithmetic and hierarchical frames. */
+			if (marker >= JPEG_MARKER_SOF0 && marker <= 0xcf &&
+			    marker != JPEG_MARKER_DHT && marker != 0xc8 &&
+			    marker != 0xcc)
+				return -ENOTSUP;
+
+			ret = 0;
+			break;
+		}
+
+		if (ret)
+			return ret;
+
+		p += length;
+	}
+}
+
+static void jpeg_reset(struct jpeg *jpeg)
+{
+	unsigned int i;
+
+	jpeg->width = 0;
+	jpeg->height = 0;
+	jpeg->progressive = false;
+	jpeg->components_count = 0;
+	jpeg->restart_interval = 0;
+	jpeg->slices_count = 0;
+
+	for (i = 0; i < JPEG_TABLES_MAX; i++) {
+		jpeg->dc[i].present = false;
+		jpeg->ac[i].present = false;
+	}
+}
+
+int jpeg_parse(struct jpeg *jpeg, const void *data, unsigned int size)
+{
+	const uint8_t *p = data;
+	const uint8_t *end = p + size;
+	int ret;
+
+	if (!jpeg || !data)
+		return -EINVAL;
+
+	jpeg_reset(jpeg);
+
+	if (size < 4 || p[0] != 0xff || p[1] != JPEG_MARKER_SOI)
+		return -EBADMSG;
+
+	p += 2;
+
+	ret = jpeg_segments(jpeg, &p, end);
+	if (ret < 0)
+		return ret;
+
+	/* The frame header must come before the first scan. */
+	if (!ret)
+		return -EBADMSG;
+
+	jpeg->scan_offset = p - (const uint8_t *)data;
+
+	return 0;
+}
+
+/* Blocks */
+
+static int jpeg_block_dc(struct jpeg *jpeg, struct jpeg_context *context,
+			 struct jpeg_component *component, int16_t *block)
+{
+	struct jpeg_bits *bits = &context->bits;
+	int *predictor;
+	int value;
+	int size;
+
+	predictor = &context->dc_predictors[component - jpeg->components];
+
+	size = jpeg_huffman_decode_value(bits, &jpeg->dc[component->td], 0xff,
+					 &value);
+	if (size < 0 || size > 11)
+		return -EBADMSG;
+
+	*predictor += value;
+	block[0] = *predictor * (1 << jpeg->scan.al);
+
+	return 0;
+}
+
+static int jpeg_block_baseline(struct jpeg *jpeg, struct jpeg_context *context,
+			       struct jpeg_component *component,
+			       int16_t *block)
+{
+	const struct jpeg_huffman *ac = &jpeg->ac[component->ta];
+	const uint16_t *quant = jpeg->quant[component->tq];
+	struct jpeg_bits *bits = &context->bits;
+	unsigned int run;
+	unsigned int k;
+	int symbol;
+	int value;
+	int ret;
+
+	ret = jpeg_block_dc(jpeg, context, component, block);
+	if (ret)
+		return ret;
+
+	/* Sequential coefficients are dequantized as they are decoded. */
+	block[0] = block[0] * quant[0];
+
+	for (k = 1; k < 64; k++) {
+		symbol = jpeg_huffman_decode_value(bits, ac, 0xf, &value);
+		if (symbol < 0)
+			return symbol;
+
+		run = symbol >> 4;
+
+		if (!(symbol & 0xf)) {
+			if (run != 15)
+				break;
+
+			k += 15;
+			continue;
+		}
+
+		k += run;
+		if (k > 63)
+			return -EBADMSG;
+
+		block[jpeg_zigzag[k]] = value * quant[jpeg_zigzag[k]];
+	}
+
+	return 0;
+}
+
+static int jpeg_block_dc_refine(struct jpeg *jpeg,
+				struct jpeg_context *context, int16_t *block)
+{
+	if (jpeg_bits_get(&context->bits, 1))
+		block[0] |= 1 << jpeg->scan.al;
+
+	return 0;
+}
+
+static int jpeg_block_ac_first(struct jpeg *jpeg, struct jpeg_context *context,
+			       struct jpeg_component *component,
+			       int16_t *block)
+{
+	const struct jpeg_huffman *ac = &jpeg->ac[component->ta];
+	struct jpeg_bits *bits = &context->bits;
+	struct jpeg_scan *scan = &jpeg->scan;
+	unsigned int run;
+	unsigned int k;
+	int symbol;
+	int value;
+
+	if (context->eobrun) {
+		context->eobrun--;
+		return 0;
+	}
+
+	for (k = scan->ss; k <= scan->se; k++) {
+		symbol = jpeg_huffman_decode_value(bits, ac, 0xf, &value);
+		if (symbol < 0)
+			return symbol;
+
+		run = symbol >> 4;
+
+		if (!(symbol & 0xf)) {
+			if (run < 15) {
+				context->eobrun = (1 << run) - 1 +
+					       jpeg_bits_get(bits, run);
+				break;
+			}
+
+			k += 15;
+			continue;
+		}
+
+		k += run;
+		if (k > 63)
+			return -EBADMSG;
+
+		block[jpeg_zigzag[k]] = value * (1 << scan->al);
+	}
+
+	return 0;
+}
+
+static void jpeg_coefficient_refine(struct jpeg_bits *bits, int16_t *value,
+				    int bit)
+{
+	if (!jpeg_bits_get(bits, 1) || (*value & bit))
+		return;
+
+	*value += *value >= 0 ? bit : -bit;
+}
+
+static int jpeg_block_ac_refine(struct jpeg *jpeg,
+				struct jpeg_context *context,
+				struct jpeg_component *component,
+				int16_t *block)
+{
+	const struct jpeg_huffman *ac = &jpeg->ac[component->ta];
+	struct jpeg_bits *bits = &context->bits;
+	struct jpeg_scan *scan = &jpeg->scan;
+	int bit = 1 << scan->al;
+	unsigned int k = scan->ss;
+	int16_t *coefficient;
+	int run, value;
+	int symbol;
+
+	if (!context->eobrun) {
+		for (; k <= scan->se; k++) {
+			symbol = jpeg_huffman_decode(bits, ac);
+			if (symbol < 0)
+				return symbol;
+
+			run = symbol >> 4;
+			value = 0;
+
+			if (symbol & 0xf) {
+				value = jpeg_bits_get(bits, 1) ? bit : -bit;
+			} else if (run != 15) {
+				context->eobrun = (1 << run) +
+					       jpeg_bits_get(bits, run);
+				break;
+			}
+
+			/*
+			 * Skip zero coefficients up to the new one, refining
+			 * the non-zero ones on the way.
+			 */
+			for (; k <= scan->se; k++) {
+				coefficient = &block[jpeg_zigzag[k]];
+
+				if (*coefficient)
+					jpeg_coefficient_refine(bits,
+								coefficient,
+								bit);
+				else if (run-- == 0)
+					break;
+			}
+
+			if (value && k <= 63)
+				block[jpeg_zigzag[k]] = value;
+		}
+	}
+
+	if (context->eobrun) {
+		for (; k <= scan->se; k++) {
+			coefficient = &block[jpeg_zigzag[k]];
+
+			if (*coefficient)
+				jpeg_coefficient_refine(bits, coefficient, bit);
+		}
+
+		context->eobrun--;
+	}
+
+	return 0;
+}
+
+static int jpeg_block_decode(struct jpeg *jpeg, struct jpeg_context *context,
+			     struct jpeg_component *component, int16_t *block)
+{
+	struct jpeg_scan *scan = &jpeg->scan;
+
+	if (!jpeg->progressive)
+		return jpeg_block_baseline(jpeg, context, component, block);
+
+	if (scan->ss == 0)
+		return scan->ah ?
+		       jpeg_block_dc_refine(jpeg, context, block) :
+		       jpeg_block_dc(jpeg, context, component, block);
+
+	return scan->ah ?
+	       jpeg_block_ac_refine(jpeg, context, component, block) :
+	       jpeg_block_ac_first(jpeg, context, component, block);
+}
+
+/* IDCT */
+
+static uint8_t jpeg_clamp(int value)
+{
+	if ((unsigned int)value > 255)
+		return value < 0 ? 0 : 255;
+
+	return value;
+}
+
+/* Even part in x, odd part in t, as for the libjpeg islow IDCT. */
+static void jpeg_idct_1d(const int *s, int *x, int *t)
+{
+	int p1, p2, p3, p4, p5;
+	int t0, t1, t2, t3;
+
+	p2 = s[2];
+	p3 = s[6];
+	p1 = (p2 + p3) * JPEG_FIX(0.5411961);
+	t2 = p1 + p3 * JPEG_FIX(-1.847759065);
+	t3 = p1 + p2 * JPEG_FIX(0.765366865);
+
+	p2 = s[0];
+	p3 = s[4];
+	t0 = (p2 + p3) * 4096;
+	t1 = (p2 - p3) * 4096;
+
+	x[0] = t0 + t3;
+	x[3] = t0 - t3;
+	x[1] = t1 + t2;
+	x[2] = t1 - t2;
+
+	t0 = s[7];
+	t1 = s[5];
+	t2 = s[3];
+	t3 = s[1];
+
+	p3 = t0 + t2;
+	p4 = t1 + t3;
+	p1 = t0 + t3;
+	p2 = t1 + t2;
+	p5 = (p3 + p4) * JPEG_FIX(1.175875602);
+
+	t0 *= JPEG_FIX(0.298631336);
+	t1 *= JPEG_FIX(2.053119869);
+	t2 *= JPEG_FIX(3.072711026);
+	t3 *= JPEG_FIX(1.501321110);
+	p1 = p5 + p1 * JPEG_FIX(-0.899976223);
+	p2 = p5 + p2 * JPEG_FIX(-2.562915447);
+	p3 *= JPEG_FIX(-1.961570560);
+	p4 *= JPEG_FIX(-0.390180644);
+
+	t[3] = t3 + p1 + p4;
+	t[2] = t2 + p2 + p3;
+	t[1] = t1 + p2 + p4;
+	t[0] = t0 + p1 + p3;
+}
+
+/* Progressive coefficients are only dequantized once complete. */
+static void jpeg_dequantize(int16_t *block, const uint16_t *quant)
+{
+	unsigned int i;
+
+	for (i = 0; i < 64; i++)
+		block[i] = block[i] * quant[i];
+}
+
+/* Transform a dequantized block, in natural order, to samples. */
+static void jpeg_idct(const int16_t *block, uint8_t *samples,
+		      unsigned int stride)
+{
+	int values[64];
+	int s[8], x[4], t[4];
+	unsigned int i, j;
+	int *v;
+
+	for (i = 0; i < 8; i++) {
+		v = &values[i];
+
+		for (j = 1; j < 8; j++)
+			if (block[j * 8 + i])
+				break;
+
+		/* Columns with DC only are flat. */
+		if (j == 8) {
+			int dc = block[i] * 4;
+
+			for (j = 0; j < 8; j++)
+				v[j * 8] = dc;
+
+			continue;
+		}
+
+		for (j = 0; j < 8; j++)
+			s[j] = block[j * 8 + i];
+
+		jpeg_idct_1d(s, x, t);
+
+		/* Keep 2 more bits of precision between passes. */
+		for (j = 0; j < 4; j++) {
+			x[j] += 512;
+			v[j * 8] = (x[j] + t[3 - j]) >> 10;
+			v[(7 - j) * 8] = (x[j] - t[3 - j]) >> 10;
+		}
+	}
+
+	for (i = 0; i < 8; i++) {
+		v = &values[i * 8];
+
+		jpeg_idct_1d(v, x, t);
+
+		/* Round and level shift by 128. */
+		for (j = 0; j < 4; j++) {
+			x[j] += 65536 + (128 << 17);
+			samples[j] = jpeg_clamp((x[j] + t[3 - j]) >> 17);
+			samples[7 - j] = jpeg_clamp((x[j] - t[3 - j]) >> 17);
+		}
+
+		samples += stride;
+	}
+}
+
+/*
+ * Reduced transforms to 4x4 and 2x2 samples, for downscaling by 2 and 4, as
+ * for the libjpeg reduced IDCTs. Coefficients past the output size are not
+ * used, apart from the odd part.
+ */
+static void jpeg_idct_4x4_1d(const int *s, int *x, int *t)
+{
+	int t0, t2;
+
+	t0 = s[0] * 8192;
+	t2 = s[2] * JPEG_FIX(1.847759065) - s[6] * JPEG_FIX(0.765366865);
+
+	x[0] = t0 + t2;
+	x[1] = t0 - t2;
+
+	t[0] = -s[7] * JPEG_FIX(0.211164243) + s[5] * JPEG_FIX(1.451774981) -
+	       s[3] * JPEG_FIX(2.172734803) + s[1] * JPEG_FIX(1.061594337);
+	t[1] = -s[7] * JPEG_FIX(0.509795579) - s[5] * JPEG_FIX(0.601344887) +
+	       s[3] * JPEG_FIX(0.899976223) + s[1] * JPEG_FIX(2.562915447);
+}
+
+static void jpeg_idct_4x4(const int16_t *block, uint8_t *samples,
+			  unsigned int stride)
+{
+	int values[8 * 4];
+	int s[8], x[2], t[2];
+	unsigned int i, j;
+	int *v;
+
+	for (i = 0; i < 8; i++) {
+		v = &values[i];
+
+		if (i == 4)
+			continue;
+
+		for (j = 1; j < 8; j++)
+			if (block[j * 8 + i])
+				break;
+
+		if (j == 8) {
+			for (j = 0; j < 4; j++)
+				v[j * 8] = block[i] * 4;
+
+			continue;
+		}
+
+		for (j = 0; j < 8; j++)
+			s[j] = block[j * 8 + i];
+
+		jpeg_idct_4x4_1d(s, x, t);
+
+		v[0] = (x[0] + t[1] + 1024) >> 11;
+		v[3 * 8] = (x[0] - t[1] + 1024) >> 11;
+		v[1 * 8] = (x[1] + t[0] + 1024) >> 11;
+		v[2 * 8] = (x[1] - t[0] + 1024) >> 11;
+	}
+
+	for (i = 0; i < 4; i++) {
+		v = &values[i * 8];
+
+		jpeg_idct_4x4_1d(v, x, t);
+
+		for (j = 0; j < 2; j++)
+			x[j] += (1 << 17) + (128 << 18);
+
+		samples[0] = jpeg_clamp((x[0] + t[1]) >> 18);
+		samples[3] = jpeg_clamp((x[0] - t[1]) >> 18);
+		samples[1] = jpeg_clamp((x[1] + t[0]) >> 18);
+		samples[2] = jpeg_clamp((x[1] - t[0]) >> 18);
+
+		samples += stride;
+	}
+}
+
+static int jpeg_idct_2x2_1d(const int *s)
+{
+	return -s[7] * JPEG_FIX(0.720959822) + s[5] * JPEG_FIX(0.850430095) -
+	       s[3] * JPEG_FIX(1.272758580) + s[1] * JPEG_FIX(3.624509785);
+}
+
+static void jpeg_idct_2x2(const int16_t *block, uint8_t *samples,
+			  unsigned int stride)
+{
+	int values[8 * 2];
+	int s[8], x, t;
+	unsigned int i, j;
+
+	for (i = 0; i < 8; i++) {
+		/* Only the odd columns and DC contribute. */
+		if (i != 0 && !(i & 1))
+			continue;
+
+		for (j = 0; j < 8; j++)
+			s[j] = block[j * 8 + i];
+
+		x = s[0] * 16384;
+		t = jpeg_idct_2x2_1d(s);
+
+		values[i] = (x + t + 2048) >> 12;
+		values[8 + i] = (x - t + 2048) >> 12;
+	}
+
+	for (i = 0; i < 2; i++) {
+		x = values[i * 8] * 16384 + (1 << 18) + (128 << 19);
+		t = jpeg_idct_2x2_1d(&values[i * 8]);
+
+		samples[0] = jpeg_clamp((x + t) >> 19);
+		samples[1] = jpeg_clamp((x - t) >> 19);
+
+		samples += stride;
+	}
+}
+
+/* Transform a block to its scaled size, from 8x8 down to a single sample. */
+static void jpeg_idct_scaled(const int16_t *block, uint8_t *samples,
+			     unsigned int stride, unsigned int scale)
+{
+	switch (scale) {
+	case 2:
+		jpeg_idct_4x4(block, samples, stride);
+		break;
+	case 4:
+		jpeg_idct_2x2(block, samples, stride);
+		break;
+	case 8:
+		samples[0] = jpeg_clamp(((block[0] + 4) >> 3) + 128);
+		break;
+	default:
+		jpeg_idct(block, samples, stride);
+		break;
+	}
+}
+
+/* Output */
+
+/* MCU rows intersecting the output region. */
+static void jpeg_output_rows(struct jpeg *jpeg, struct jpeg_output *output,
+			     unsigned int *row_start, unsigned int *row_end)
+{
+	unsigned int lines = jpeg->vmax * 8 / output->scale;
+
+	*row_start = output->y / lines;
+	*row_end = (output->y + output->height + lines - 1) / lines;
+
+	if (*row_end > jpeg->mcus_y)
+		*row_end = jpeg->mcus_y;
+}
+
+static void jpeg_row_convert(struct jpeg *jpeg, struct jpeg_context *context,
+			     unsigned int row, struct jpeg_output *output)
+{
+	struct jpeg_component *component;
+	unsigned int size = 8 / output->scale;
+	unsigned int width, height;
+	unsigned int y, y_start, y_end;
+	unsigned int line, line_chroma;
+	unsigned int stride;
+	unsigned int step;
+	unsigned int x, c;
+	const uint8_t *source;
+	uint8_t *luma, *chroma, *chroma_cr;
+	uint8_t *destination;
+
+	width = (jpeg->width + output->scale - 1) / output->scale;
+	if (output->x >= width)
+		return;
+
+	width -= output->x;
+	if (width > output->width)
+		width = output->width;
+
+	height = (jpeg->height + output->scale - 1) / output->scale;
+	if (height > output->y + output->height)
+		height = output->y + output->height;
+
+	y_start = row * jpeg->vmax * size;
+	y_end = y_start + jpeg->vmax * size;
+	if (y_end > height)
+		y_end = height;
+
+	for (y = y_start; y < y_end; y++) {
+		if (y < output->y)
+			continue;
+
+		line = y - y_start;
+		luma = output->luma + (y - output->y) * output->stride;
+
+		component = &jpeg->components[0];
+		stride = component->blocks_w * size;
+		source = context->row_samples[0] +
+			 line * component->v / jpeg->vmax * stride;
+
+		if (component->h == jpeg->hmax)
+			memcpy(luma, source + output->x, width);
+		else
+			for (x = 0; x < width; x++)
+				luma[x] = source[(output->x + x) *
+						 component->h / jpeg->hmax];
+
+		/* Vertically subsampled chroma is taken from even lines. */
+		if ((y - output->y) & ((1 << output->chroma_shift) - 1))
+			continue;
+
+		line_chroma = (y - output->y) >> output->chroma_shift;
+		chroma = output->chroma + line_chroma * output->chroma_stride;
+
+		if (output->chroma_cr) {
+			chroma_cr = output->chroma_cr +
+				    line_chroma * output->chroma_stride;
+			step = 1;
+		} else {
+			chroma_cr = chroma + 1;
+			step = 2;
+		}
+
+		if (jpeg->components_count == 1) {
+			for (x = 0; x < width / 2; x++) {
+				chroma[x * step] = 128;
+				chroma_cr[x * step] = 128;
+			}
+
+			continue;
+		}
+
+		/* Chroma is resampled to half horizontal resolution. */
+		for (c = 1; c < jpeg->components_count; c++) {
+			component = &jpeg->components[c];
+			stride = component->blocks_w * size;
+			source = context->row_samples[c] +
+				 line * component->v / jpeg->vmax * stride;
+			destination = c == 1 ? chroma : chroma_cr;
+
+			if (component->h == jpeg->hmax)
+				for (x = 0; x < width / 2; x++)
+					destination[x * step] =
+						(source[output->x + x * 2] +
+						 source[output->x + x * 2 + 1] +
+						 1) >> 1;
+			else
+				for (x = 0; x < width / 2; x++)
+					destination[x * step] =
+						source[(output->x + x * 2) *
+						       component->h /
+						       jpeg->hmax];
+		}
+	}
+}
+
+/* Only blocks of the MCU columns intersecting the output are transformed. */
+static void jpeg_row_output(struct jpeg *jpeg, struct jpeg_context *context,
+			    int16_t **coefficients, unsigned int row,
+			    struct jpeg_output *output)
+{
+	struct jpeg_component *component;
+	unsigned int size = 8 / output->scale;
+	unsigned int columns = jpeg->hmax * size;
+	unsigned int mx_start, mx_end;
+	unsigned int bx_start, bx_end;
+	const uint16_t *quant;
+	unsigned int stride;
+	unsigned int bx, by;
+	unsigned int c;
+	uint8_t *samples;
+	int16_t *block;
+
+	mx_start = output->x / columns;
+	mx_end = (output->x + output->width + columns - 1) / columns;
+
+	for (c = 0; c < jpeg->components_count; c++) {
+		component = &jpeg->components[c];
+		quant = jpeg->quant[component->tq];
+		stride = component->blocks_w * size;
+
+		bx_start = mx_start * component->h;
+		bx_end = mx_end * component->h;
+		if (bx_end > component->width_blocks)
+			bx_end = component->width_blocks;
+
+		for (by = 0; by < component->v; by++) {
+			if (row * component->v + by >= component->height_blocks)
+				break;
+
+			for (bx = bx_start; bx < bx_end; bx++) {
+				block = coefficients[c] +
+					(by * component->blocks_w + bx) * 64;
+
+				if (jpeg->progressive)
+					jpeg_dequantize(block, quant);
+
+				samples = context->row_samples[c] +
+					  (by * stride + bx) * size;
+
+				jpeg_idct_scaled(block, samples, stride,
+						 output->scale);
+			}
+		}
+	}
+
+	jpeg_row_convert(jpeg, context, row, output);
+}
+
+/* Scans */
+
+static int jpeg_restart(struct jpeg *jpeg, struct jpeg_context *context)
+{
+	struct jpeg_bits *bits = &context->bits;
+	const uint8_t *p = bits->data;
+	unsigned int i;
+
+	/* Look for the marker past any stuffed bytes or padding. */
+	while (p + 1 < bits->end &&
+	       (p[0] != 0xff || p[1] < JPEG_MARKER_RST0 ||
+		p[1] > JPEG_MARKER_RST7)) {
+		if (p[0] == 0xff && p[1] != 0x00 && p[1] != 0xff)
+			return -EBADMSG;
+
+		p++;
+	}
+
+	if (p + 1 >= bits->end)
+		return -EBADMSG;
+
+	jpeg_bits_setup(bits, p + 2, bits->end);
+
+	for (i = 0; i < jpeg->components_count; i++)
+		context->dc_predictors[i] = 0;
+
+	context->eobrun = 0;
+
+	return 0;
+}
+
+static int jpeg_context_setup(struct jpeg *jpeg, struct jpeg_context *context)
+{
+	struct jpeg_component *component;
+	size_t rows_size = 0;
+	unsigned int i;
+	void *buffer;
+	uint8_t *p;
+
+	for (i = 0; i < jpeg->components_count; i++) {
+		component = &jpeg->components[i];
+		rows_size += component->blocks_w * component->v * 64 *
+			     (sizeof(int16_t) + 1);
+	}
+
+	if (rows_size > context->rows_size) {
+		buffer = realloc(context->rows, rows_size);
+		if (!buffer)
+			return -ENOMEM;
+
+		context->rows = buffer;
+		context->rows_size = rows_size;
+	}
+
+	p = context->rows;
+
+	for (i = 0; i < jpeg->components_count; i++) {
+		component = &jpeg->components[i];
+
+		context->row_coefficients[i] = (int16_t *)p;
+		p += component->blocks_w * component->v * 64 * sizeof(int16_t);
+	}
+
+	for (i = 0; i < jpeg->components_count; i++) {
+		component = &jpeg->components[i];
+
+		context->row_samples[i] = p;
+		p += component->blocks_w * component->v * 64;
+	}
+
+	return 0;
+}
+
+static void jpeg_context_reset(struct jpeg *jpeg, struct jpeg_context *context,
+			       const uint8_t *data, const uint8_t *end)
+{
+	unsigned int i;
+
+	for (i = 0; i < jpeg->components_count; i++)
+		context->dc_predictors[i] = 0;
+
+	context->eobrun = 0;
+
+	jpeg_bits_setup(&context->bits, data, end);
+}
+
+static int jpeg_buffers_setup(struct jpeg *jpeg)
+{
+	struct jpeg_component *component;
+	size_t coefficients_size = 0;
+	unsigned int i;
+	void *buffer;
+	int ret;
+
+	ret = jpeg_context_setup(jpeg, &jpeg->context);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < jpeg->components_count && jpeg->progressive; i++) {
+		component = &jpeg->components[i];
+		coefficients_size += component->blocks_w * component->blocks_h *
+				     64 * sizeof(int16_t);
+	}
+
+	if (coefficients_size > jpeg->coefficients_size) {
+		buffer = realloc(jpeg->coefficients, coefficients_size);
+		if (!buffer)
+			return -ENOMEM;
+
+		jpeg->coefficients = buffer;
+		jpeg->coefficients_size = coefficients_size;
+	}
+
+	if (coefficients_size)
+		memset(jpeg->coefficients, 0, coefficients_size);
+
+	buffer = jpeg->coefficients;
+
+	for (i = 0; i < jpeg->components_count && jpeg->progressive; i++) {
+		component = &jpeg->components[i];
+
+		component->coefficients = buffer;
+		buffer = component->coefficients +
+			 component->blocks_w * component->blocks_h * 64;
+	}
+
+	return 0;
+}
+
+/* MCUs are counted from a restart boundary. */
+static int jpeg_restart_check(struct jpeg *jpeg, struct jpeg_context *context,
+			      unsigned int mcu)
+{
+	if (!jpeg->restart_interval || !mcu || mcu % jpeg->restart_interval)
+		return 0;
+
+	return jpeg_restart(jpeg, context);
+}
+
+/*
+ * Decode an interleaved MCU to the blocks of each component, starting from
+ * the given row of blocks in units of MCU rows.
+ */
+static int jpeg_mcu_decode(struct jpeg *jpeg, struct jpeg_context *context,
+			   int16_t **coefficients, unsigned int mx,
+			   unsigned int my)
+{
+	struct jpeg_component *component;
+	unsigned int bx, by;
+	unsigned int index;
+	unsigned int c;
+	int16_t *block;
+	int ret;
+
+	for (c = 0; c < jpeg->scan.components_count; c++) {
+		index = jpeg->scan.components[c];
+		component = &jpeg->components[index];
+
+		for (by = 0; by < component->v; by++) {
+			block = coefficients[index] +
+				((my * component->v + by) *
+				 component->blocks_w + mx * component->h) * 64;
+
+			for (bx = 0; bx < component->h; bx++, block += 64) {
+				ret = jpeg_block_decode(jpeg, context,
+							component, block);
+				if (ret)
+					return ret;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Sequential scans are decoded and output one MCU row at a time, from a row
+ * starting at a restart boundary.
+ */
+static int jpeg_scan_rows(struct jpeg *jpeg, struct jpeg_context *context,
+			  unsigned int row_start, unsigned int row_end,
+			  struct jpeg_output *output)
+{
+	struct jpeg_component *component;
+	unsigned int output_start, output_end;
+	unsigned int mx, my;
+	unsigned int mcu = 0;
+	unsigned int c;
+	int ret;
+
+	/* Rows past the output region are left undecoded. */
+	jpeg_output_rows(jpeg, output, &output_start, &output_end);
+	if (row_end > output_end)
+		row_end = output_end;
+
+	for (my = row_start; my < row_end; my++) {
+		for (c = 0; c < jpeg->components_count; c++) {
+			component = &jpeg->components[c];
+			memset(context->row_coefficients[c], 0,
+			       component->blocks_w * component->v * 64 *
+			       sizeof(int16_t));
+		}
+
+		for (mx = 0; mx < jpeg->mcus_x; mx++, mcu++) {
+			ret = jpeg_restart_check(jpeg, context, mcu);
+			if (ret)
+				return ret;
+
+			ret = jpeg_mcu_decode(jpeg, context,
+					      context->row_coefficients, mx, 0);
+			if (ret)
+				return ret;
+		}
+
+		if (my >= output_start)
+			jpeg_row_output(jpeg, context,
+					context->row_coefficients, my, output);
+	}
+
+	return 0;
+}
+
+/* Progressive scans accumulate whole frame coefficients. */
+static int jpeg_scan_coefficients(struct jpeg *jpeg,
+				  struct jpeg_context *context)
+{
+	int16_t *coefficients[JPEG_COMPONENTS_MAX];
+	struct jpeg_scan *scan = &jpeg->scan;
+	struct jpeg_component *component;
+	unsigned int mx, my;
+	unsigned int bx, by;
+	unsigned int mcu = 0;
+	unsigned int c;
+	int16_t *block;
+	int ret;
+
+	/* Non-interleaved scans only cover the component blocks. */
+	if (scan->components_count == 1) {
+		component = &jpeg->components[scan->components[0]];
+
+		for (by = 0; by < component->height_blocks; by++) {
+			block = component->coefficients +
+				by * component->blocks_w * 64;
+
+			for (bx = 0; bx < component->width_blocks; bx++) {
+				ret = jpeg_restart_check(jpeg, context, mcu++);
+				if (ret)
+					return ret;
+
+				ret = jpeg_block_decode(jpeg, context,
+							component,
+							block + bx * 64);
+				if (ret)
+					return ret;
+			}
+		}
+
+		return 0;
+	}
+
+	for (c = 0; c < jpeg->components_count; c++)
+		coefficients[c] = jpeg->components[c].coefficients;
+
+	for (my = 0; my < jpeg->mcus_y; my++)
+		for (mx = 0; mx < jpeg->mcus_x; mx++, mcu++) {
+			ret = jpeg_restart_check(jpeg, context, mcu);
+			if (ret)
+				return ret;
+
+			ret = jpeg_mcu_decode(jpeg, context, coefficients, mx,
+					      my);
+			if (ret)
+				return ret;
+		}
+
+	return 0;
+}
+
+static int jpeg_scan_decode(struct jpeg *jpeg, const uint8_t **data,
+			    const uint8_t *end, struct jpeg_output *output)
+{
+	struct jpeg_context *context = &jpeg->context;
+	const uint8_t *p;
+	int ret;
+
+	jpeg_context_reset(jpeg, context, *data, end);
+
+	if (!jpeg->progressive) {
+		if (jpeg->scan.components_count != jpeg->components_count)
+			return -ENOTSUP;
+
+		ret = jpeg_scan_rows(jpeg, context, 0, jpeg->mcus_y, output);
+	} else {
+		ret = jpeg_scan_coefficients(jpeg, context);
+	}
+
+	if (ret)
+		return ret;
+
+	/* Resume at the next marker, past the entropy-coded data. */
+	p = context->bits.data;
+
+	while (p + 1 < end && (p[0] != 0xff || p[1] == 0x00 ||
+			       (p[1] >= JPEG_MARKER_RST0 &&
+				p[1] <= JPEG_MARKER_RST7)))
+		p++;
+
+	*data = p;
+
+	return 0;
+}
+
+static bool jpeg_output_check(struct jpeg_output *output)
+{
+	if (!output)
+		return false;
+
+	/* Chroma samples are interleaved in pairs. */
+	if (output->x % 2 || output->chroma_shift > 1)
+		return false;
+
+	return output->scale == 1 || output->scale == 2 || output->scale == 4 ||
+	       output->scale == 8;
+}
+
+int jpeg_decode(struct jpeg *jpeg, const void *data, unsigned int size,
+		struct jpeg_output *output)
+{
+	int16_t *coefficients[JPEG_COMPONENTS_MAX];
+	const uint8_t *p = data;
+	const uint8_t *end = p + size;
+	struct jpeg_component *component;
+	bool setup = false;
+	unsigned int row, row_start, row_end;
+	unsigned int c;
+	int ret;
+
+	if (!jpeg || !data || !jpeg_output_check(output))
+		return -EINVAL;
+
+	jpeg_reset(jpeg);
+
+	if (size < 4 || p[0] != 0xff || p[1] != JPEG_MARKER_SOI)
+		return -EBADMSG;
+
+	p += 2;
+
+	while ((ret = jpeg_segments(jpeg, &p, end)) > 0) {
+		if (!setup) {
+			ret = jpeg_buffers_setup(jpeg);
+			if (ret)
+				return ret;
+
+			setup = true;
+		}
+
+		ret = jpeg_scan_decode(jpeg, &p, end, output);
+		if (ret)
+			return ret;
+	}
+
+	if (ret)
+		return ret;
+
+	if (!setup)
+		return -EBADMSG;
+
+	if (!jpeg->progressive)
+		return 0;
+
+	jpeg_output_rows(jpeg, output, &row_start, &row_end);
+
+	for (row = row_start; row < row_end; row++) {
+		for (c = 0; c < jpeg->components_count; c++) {
+			component = &jpeg->components[c];
+			coefficients[c] = component->coefficients +
+					  row * component->v *
+					  component->blocks_w * 64;
+		}
+
+		jpeg_row_output(jpeg, &jpeg->context, coefficients, row,
+				output);
+	}
+
+	return 0;
+}
+
+/* Slices */
+
+static unsigned int jpeg_gcd(unsigned int a, unsigned int b)
+{
+	unsigned int t;
+
+	while (b) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+/*
+ * Index the restart markers of the first scan, which must be the last one.
+ * Markers are found with memchr, which is vectorized by the C library.
+ */
+static int jpeg_restarts_index(struct jpeg *jpeg, const uint8_t *data,
+			       unsigned int size)
+{
+	const uint8_t *p = data + jpeg->scan_offset;
+	const uint8_t *end = data + size;
+	unsigned int restarts_size;
+	unsigned int *restarts;
+	uint8_t marker;
+
+	jpeg->restarts_count = 0;
+
+	while (p + 1 < end) {
+		p = memchr(p, 0xff, end - p - 1);
+		if (!p)
+			break;
+
+		marker = p[1];
+
+		/* Stuffed bytes and fill bytes. */
+		if (marker == 0x00 || marker == 0xff) {
+			p++;
+			continue;
+		}
+
+		if (marker < JPEG_MARKER_RST0 || marker > JPEG_MARKER_RST7)
+			return marker == JPEG_MARKER_EOI ? 0 : -ENOTSUP;
+
+		if (jpeg->restarts_count == jpeg->restarts_size) {
+			restarts_size = jpeg->restarts_size ?
+					jpeg->restarts_size * 2 : 64;
+			restarts = realloc(jpeg->restarts, restarts_size *
+					   sizeof(*restarts));
+			if (!restarts)
+				return -ENOMEM;
+
+			jpeg->restarts = restarts;
+			jpeg->restarts_size = restarts_size;
+		}
+
+		p += 2;
+		jpeg->restarts[jpeg->restarts_count++] = p - data;
+	}
+
+	return -EBADMSG;
+}
+
+/*
+ * Split a parsed sequential frame with restart markers in ranges of MCU rows
+ * that each start at a restart boundary, to be decoded independently.
+ * Returns the number of slices, which is 1 for frames that cannot be split.
+ */
+int jpeg_slices_setup(struct jpeg *jpeg, const void *data, unsigned int size,
+		      unsigned int slices_max)
+{
+	unsigned int interval = jpeg->restart_interval;
+	unsigned int mcus_count;
+	unsigned int units_count;
+	unsigned int unit_rows;
+	unsigned int i;
+	int ret;
+
+	if (!jpeg || !data || !slices_max)
+		return -EINVAL;
+
+	jpeg->slices_count = 1;
+	jpeg->slices[0].row_start = 0;
+	jpeg->slices[0].row_end = jpeg->mcus_y;
+
+	if (jpeg->progressive || !interval ||
+	    jpeg->scan.components_count != jpeg->components_count)
+		return 1;
+
+	/* Smallest number of MCU rows spanning whole restart intervals. */
+	unit_rows = interval / jpeg_gcd(interval, jpeg->mcus_x);
+	units_count = (jpeg->mcus_y + unit_rows - 1) / unit_rows;
+
+	if (slices_max > JPEG_SLICES_MAX)
+		slices_max = JPEG_SLICES_MAX;
+
+	if (units_count < 2 || slices_max < 2)
+		return 1;
+
+	ret = jpeg_restarts_index(jpeg, data, size);
+	if (ret)
+		return 1;
+
+	mcus_count = jpeg->mcus_x * jpeg->mcus_y;
+	if (jpeg->restarts_count != (mcus_count - 1) / interval)
+		return 1;
+
+	jpeg->slices_count = units_count < slices_max ? units_count :
+			     slices_max;
+
+	for (i = 0; i < jpeg->slices_count; i++) {
+		jpeg->slices[i].row_start = i * units_count /
+					    jpeg->slices_count * unit_rows;
+		jpeg->slices[i].row_end = (i + 1) * units_count /
+					  jpeg->slices_count * unit_rows;
+
+		if (jpeg->slices[i].row_end > jpeg->mcus_y)
+			jpeg->slices[i].row_end = jpeg->mcus_y;
+	}
+
+	return jpeg->slices_count;
+}
+
+/*
+ * Decode the MCU rows of a slice from its restart marker. Slices only share
+ * read-only frame state and write disjoint rows of the output.
+ */
+int jpeg_slice_decode(struct jpeg *jpeg, struct jpeg_context *context,
+		      const void *data, unsigned int size, unsigned int slice,
+		      struct jpeg_output *output)
+{
+	const uint8_t *p = data;
+	unsigned int row_start, row_end;
+	unsigned int output_start, output_end;
+	unsigned int segment;
+	unsigned int offset;
+	int ret;
+
+	if (!jpeg || !context || !data || !jpeg_output_check(output) ||
+	    slice >= jpeg->slices_count)
+		return -EINVAL;
+
+	if (jpeg->progressive ||
+	    jpeg->scan.components_count != jpeg->components_count)
+		return -ENOTSUP;
+
+	row_start = jpeg->slices[slice].row_start;
+	row_end = jpeg->slices[slice].row_end;
+
+	/* Slices outside the output region are skipped altogether. */
+	jpeg_output_rows(jpeg, output, &output_start, &output_end);
+	if (row_end <= output_start || row_start >= output_end)
+		return 0;
+
+	if (jpeg->slices_count > 1) {
+		segment = row_start * jpeg->mcus_x / jpeg->restart_interval;
+		offset = segment ? jpeg->restarts[segment - 1] :
+			 jpeg->scan_offset;
+	} else {
+		offset = jpeg->scan_offset;
+	}
+
+	if (offset >= size)
+		return -EBADMSG;
+
+	ret = jpeg_context_setup(jpeg, context);
+	if (ret)
+		return ret;
+
+	jpeg_context_reset(jpeg, context, p + offset, p + size);
+
+	return jpeg_scan_rows(jpeg, context, row_start, row_end, output);
+}
+
+void jpeg_context_cleanup(struct jpeg_context *context)
+{
+	if (!context)
+		return;
+
+	free(context->rows);
+	context->rows = NULL;
+	context->rows_size = 0;
+}
+
+void jpeg_cleanup(struct jpeg *jpeg)
+{
+	if (!jpeg)
+		return;
+
+	free(jpeg->coefficients);
+	jpeg->coefficients = NULL;
+	jpeg->coefficients_size = 0;
+
+	free(jpeg->restarts);
+	jpeg->restarts = NULL;
+	jpeg->restarts_count = 0;
+	jpeg->restarts_size = 0;
+
+	jpeg_context_cleanup(&jpeg->context);
+}
@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2024 Paul Kocialkowski <contact@paulk.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _JPEG_H_
+#define _JPEG_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Software decoder for sequential and progressive Huffman JPEG with 8-bit
+ * samples, producing 4:2:2 or 4:2:0 frames with semi-planar or planar chroma.
+ */
+
+#define JPEG_COMPONENTS_MAX	3
+#define JPEG_TABLES_MAX		4
+#define JPEG_SLICES_MAX		64
+
+/* Bits of Huffman codes decoded with a single table lookup. */
+#define JPEG_HUFFMAN_LOOKAHEAD	9
+
+struct jpeg_huffman_entry {
+	uint8_t symbol;
+	uint8_t code_length;
+
+	/* Code and magnitude bits, when both fit in the lookahead. */
+	uint8_t length;
+	int16_t value;
+};
+
+struct jpeg_huffman {
+	bool present;
+	uint8_t bits[17];
+	uint8_t values[256];
+
+	/* Canonical codes, for those longer than the lookahead. */
+	int32_t maxcode[18];
+	int32_t valptr[17];
+	int32_t mincode[17];
+
+	struct jpeg_huffman_entry lookahead[1 << JPEG_HUFFMAN_LOOKAHEAD];
+};
+
+struct jpeg_component {
+	unsigned int id;
+	unsigned int h;
+	unsigned int v;
+	unsigned int tq;
+
+	/* Current scan tables. */
+	unsigned int td;
+	unsigned int ta;
+
+	/* Blocks covering whole MCUs and the component itself. */
+	unsigned int blocks_w;
+	unsigned int blocks_h;
+	unsigned int width_blocks;
+	unsigned int height_blocks;
+
+	/* Whole frame coefficients, for multiple scans. */
+	int16_t *coefficients;
+};
+
+struct jpeg_bits {
+	const uint8_t *data;
+	const uint8_t *end;
+	uint64_t buffer;
+	unsigned int count;
+};
+
+struct jpeg_scan {
+	unsigned int components[JPEG_COMPONENTS_MAX];
+	unsigned int components_count;
+	unsigned int ss;
+	unsigned int se;
+	unsigned int ah;
+	unsigned int al;
+};
+
+struct jpeg_output {
+	uint8_t *luma;
+	unsigned int stride;
+
+	/* Interleaved CbCr lines, or Cb and Cr planes when chroma_cr is set. */
+	uint8_t *chroma;
+	uint8_t *chroma_cr;
+	unsigned int chroma_stride;
+
+	/* Vertical chroma subsampling shift, 0 for 4:2:2 and 1 for 4:2:0. */
+	unsigned int chroma_shift;
+
+	unsigned int width;
+	unsigned int height;
+
+	/* Output region offset in the downscaled frame, with an even x. */
+	unsigned int x;
+	unsigned int y;
+
+	/* Downscaling factor of 1, 2, 4 or 8, in the DCT domain. */
+	unsigned int scale;
+};
+
+/* Entropy decoding state and row buffers, private to each decoding thread. */
+struct jpeg_context {
+	struct jpeg_bits bits;
+	int dc_predictors[JPEG_COMPONENTS_MAX];
+	unsigned int eobrun;
+
+	/* Single MCU row of coefficients and samples, per component. */
+	int16_t *row_coefficients[JPEG_COMPONENTS_MAX];
+	uint8_t *row_samples[JPEG_COMPONENTS_MAX];
+
+	void *rows;
+	size_t rows_size;
+};
+
+/* Range of MCU rows starting at a restart marker. */
+struct jpeg_slice {
+	unsigned int row_start;
+	unsigned int row_end;
+};
+
+struct jpeg {
+	/* Decode all codes one bit at a time, as a reference. */
+	bool reference;
+
+	unsigned int width;
+	unsigned int height;
+	bool progressive;
+
+	struct jpeg_component components[JPEG_COMPONENTS_MAX];
+	unsigned int components_count;
+	unsigned int hmax;
+	unsigned int vmax;
+	unsigned int mcus_x;
+	unsigned int mcus_y;
+	unsigned int restart_interval;
+
+	uint16_t quant[JPEG_TABLES_MAX][64];
+	struct jpeg_huffman dc[JPEG_TABLES_MAX];
+	struct jpeg_huffman ac[JPEG_TABLES_MAX];
+
+	struct jpeg_scan scan;
+	unsigned int scan_offset;
+
+	/* Offsets of the entropy-coded segments following restart markers. */
+	unsigned int *restarts;
+	unsigned int restarts_count;
+	unsigned int restarts_size;
+
+	struct jpeg_slice slices[JPEG_SLICES_MAX];
+	unsigned int slices_count;
+
+	struct jpeg_context context;
+
+	/* Allocations kept across frames. */
+	int16_t *coefficients;
+	size_t coefficients_size;
+};
+
+int jpeg_parse(struct jpeg *jpeg, const void *data, unsigned int size);
+int jpeg_decode(struct jpeg *jpeg, const void *data, unsigned int size,
+		struct jpeg_output *output);
+int jpeg_slices_setup(struct jpeg *jpeg, const void *data, unsigned int size,
+		      unsigned int slices_max);
+int jpeg_slice_decode(struct jpeg *jpeg, struct jpeg_context *context,
+		      const void *data, unsigned int size, unsigned int slice,
+		      struct jpeg_output *output);
+void jpeg_context_cleanup(struct jpeg_context *context);
+void jpeg_cleanup(struct jpeg *jpeg);
+
+#endif
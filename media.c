@@ -28,13 +28,14 @@
 
 #include <linux/media.h>
 
+#include "perf.h"
 #include "v4l2.h"
 
 int media_device_info(int media_fd, struct media_device_info *device_info)
 {
 	int ret;
 
-	ret = ioctl(media_fd, MEDIA_IOC_DEVICE_INFO, device_info);
+	ret = perf_ioctl(media_fd, MEDIA_IOC_DEVICE_INFO, device_info);
 	if (ret)
 		return -errno;
 
@@ -45,7 +46,7 @@ int media_topology_get(int media_fd, struct media_v2_topology *topology)
 {
 	int ret;
 
-	ret = ioctl(media_fd, MEDIA_IOC_G_TOPOLOGY, topology);
+	ret = perf_ioctl(media_fd, MEDIA_IOC_G_TOPOLOGY, topology);
 	if (ret)
 		return -errno;
 
@@ -199,7 +200,7 @@ int media_request_alloc(int media_fd)
 	int request_fd;
 	int ret;
 
-	ret = ioctl(media_fd, MEDIA_IOC_REQUEST_ALLOC, &request_fd);
+	ret = perf_ioctl(media_fd, MEDIA_IOC_REQUEST_ALLOC, &request_fd);
 	if (ret)
 		return -errno;
 
@@ -210,7 +211,7 @@ int media_request_queue(int request_fd)
 {
 	int ret;
 
-	ret = ioctl(request_fd, MEDIA_REQUEST_IOC_QUEUE, NULL);
+	ret = perf_ioctl(request_fd, MEDIA_REQUEST_IOC_QUEUE, NULL);
 	if (ret)
 		return -errno;
 
@@ -221,7 +222,7 @@ int media_request_reinit(int request_fd)
 {
 	int ret;
 
-	ret = ioctl(request_fd, MEDIA_REQUEST_IOC_REINIT, NULL);
+	ret = perf_ioctl(request_fd, MEDIA_REQUEST_IOC_REINIT, NULL);
 	if (ret)
 		return -errno;
 
@@ -16,25 +16,590 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
 #include <time.h>
 
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#ifdef CONFIG_PERF_IOCTL
+#include <sys/ioctl.h>
+#include <linux/videodev2.h>
+#include <linux/media.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-heap.h>
+#endif
+
 #include "perf.h"
 
+/* Stages are aggregated by step name when counters are enabled. */
+#define PERF_STAGES_MAX		16
+
+struct perf_counters {
+	int fds[PERF_COUNTERS_COUNT];
+	int group_fd;
+	unsigned int mask;
+	unsigned int count;
+};
+
+struct perf_counter_event {
+	const char *name;
+	unsigned int type;
+	unsigned long long config;
+};
+
+struct perf_stage {
+	const char *step;
+	unsigned int count;
+	uint64_t time;
+	unsigned int counters_mask;
+	uint64_t counters[PERF_COUNTERS_COUNT];
+};
+
+static const struct perf_counter_event perf_counter_events[] = {
+	[PERF_COUNTER_CYCLES] = {
+		"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES,
+	},
+	[PERF_COUNTER_INSTRUCTIONS] = {
+		"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS,
+	},
+	[PERF_COUNTER_CACHE_MISSES] = {
+		"cache misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES,
+	},
+	[PERF_COUNTER_PAGE_FAULTS] = {
+		"page faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS,
+	},
+};
+
+static bool perf_counters_enabled;
+static bool perf_counters_warned;
+static pthread_key_t perf_counters_key;
+static pthread_once_t perf_counters_once = PTHREAD_ONCE_INIT;
+
+static struct perf_stage perf_stages[PERF_STAGES_MAX];
+static unsigned int perf_stages_count;
+static pthread_mutex_t perf_stages_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void perf_counters_close(void *data)
+{
+	struct perf_counters *counters = data;
+	unsigned int i;
+
+	for (i = 0; i < PERF_COUNTERS_COUNT; i++)
+		if (counters->fds[i] >= 0)
+			close(counters->fds[i]);
+
+	free(counters);
+}
+
+static void perf_counters_key_create(void)
+{
+	pthread_key_create(&perf_counters_key, perf_counters_close);
+}
+
+static int perf_counter_open(unsigned int index, int group_fd)
+{
+	const struct perf_counter_event *event = &perf_counter_events[index];
+	struct perf_event_attr attr = { 0 };
+	int fd;
+
+	attr.size = sizeof(attr);
+	attr.type = event->type;
+	attr.config = event->config;
+	attr.read_format = PERF_FORMAT_GROUP;
+
+	/* Count for the calling thread on any CPU. */
+	fd = syscall(SYS_perf_event_open, &attr, 0, -1, group_fd,
+		     PERF_FLAG_FD_CLOEXEC);
+	if (fd >= 0)
+		return fd;
+
+	if (errno != EACCES && errno != EPERM)
+		return -errno;
+
+	/* Unprivileged users may only count their own user-space code. */
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	fd = syscall(SYS_perf_event_open, &attr, 0, -1, group_fd,
+		     PERF_FLAG_FD_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	return fd;
+}
+
+/* Counters are opened per thread on first use and closed at thread exit. */
+static struct perf_counters *perf_counters_get(void)
+{
+	struct perf_counters *counters;
+	int error = 0;
+	unsigned int i;
+	int fd;
+
+	counters = pthread_getspecific(perf_counters_key);
+	if (counters)
+		return counters;
+
+	counters = malloc(sizeof(*counters));
+	if (!counters)
+		return NULL;
+
+	counters->group_fd = -1;
+	counters->mask = 0;
+	counters->count = 0;
+
+	/* Counters missing on this system are left out of the group. */
+	for (i = 0; i < PERF_COUNTERS_COUNT; i++) {
+		fd = perf_counter_open(i, counters->group_fd);
+		counters->fds[i] = fd;
+
+		if (fd < 0) {
+			error = fd;
+			continue;
+		}
+
+		if (counters->group_fd < 0)
+			counters->group_fd = fd;
+
+		counters->mask |= 1 << i;
+		counters->count++;
+	}
+
+	pthread_setspecific(perf_counters_key, counters);
+
+	pthread_mutex_lock(&perf_stages_lock);
+
+	if (error && !perf_counters_warned) {
+		if (!counters->mask)
+			fprintf(stderr, "Performance counters unavailable (%s), "
+				"reporting time only\n", strerror(-error));
+		else
+			fprintf(stderr, "Some performance counters are "
+				"unavailable (%s)\n", strerror(-error));
+
+		perf_counters_warned = true;
+	}
+
+	pthread_mutex_unlock(&perf_stages_lock);
+
+	return counters;
+}
+
+static unsigned int perf_counters_read(uint64_t *values)
+{
+	struct perf_counters *counters;
+	uint64_t data[1 + PERF_COUNTERS_COUNT];
+	unsigned int index = 1;
+	unsigned int i;
+	ssize_t ret;
+
+	if (!perf_counters_enabled)
+		return 0;
+
+	counters = perf_counters_get();
+	if (!counters || !counters->mask)
+		return 0;
+
+	/* Group values come in the order counters were opened. */
+	ret = read(counters->group_fd, data, sizeof(data));
+	if (ret < (ssize_t)sizeof(uint64_t) || data[0] != counters->count)
+		return 0;
+
+	for (i = 0; i < PERF_COUNTERS_COUNT; i++)
+		if (counters->mask & (1 << i))
+			values[i] = data[index++];
+
+	return counters->mask;
+}
+
+void perf_counters_enable(void)
+{
+	pthread_once(&perf_counters_once, perf_counters_key_create);
+
+	perf_counters_enabled = true;
+}
+
 void perf_before(struct perf *perf)
 {
+	perf->counters_mask = perf_counters_read(perf->counters_before);
+
 	clock_gettime(CLOCK_MONOTONIC, &perf->before);
 }
 
 void perf_after(struct perf *perf)
 {
 	clock_gettime(CLOCK_MONOTONIC, &perf->after);
+
+	if (perf->counters_mask)
+		perf->counters_mask &= perf_counters_read(perf->counters_after);
+}
+
+static void perf_stage_add(struct perf *perf, const char *step)
+{
+	struct perf_stage *stage = NULL;
+	unsigned int i;
+
+	pthread_mutex_lock(&perf_stages_lock);
+
+	for (i = 0; i < perf_stages_count; i++) {
+		if (!strcmp(perf_stages[i].step, step)) {
+			stage = &perf_stages[i];
+			break;
+		}
+	}
+
+	if (!stage && perf_stages_count < PERF_STAGES_MAX) {
+		stage = &perf_stages[perf_stages_count++];
+		stage->step = step;
+	}
+
+	if (!stage)
+		goto complete;
+
+	stage->count++;
+	stage->time += timespec_diff(perf->before, perf->after);
+	stage->counters_mask |= perf->counters_mask;
+
+	for (i = 0; i < PERF_COUNTERS_COUNT; i++)
+		if (perf->counters_mask & (1 << i))
+			stage->counters[i] += perf->counters_after[i] -
+					      perf->counters_before[i];
+
+complete:
+	pthread_mutex_unlock(&perf_stages_lock);
+}
+
+static void perf_counters_print(unsigned int mask, uint64_t *values,
+				unsigned int count)
+{
+	uint64_t cycles = values[PERF_COUNTER_CYCLES];
+	uint64_t instructions = values[PERF_COUNTER_INSTRUCTIONS];
+	uint64_t ipc;
+	unsigned int i;
+
+	for (i = 0; i < PERF_COUNTERS_COUNT; i++)
+		if (mask & (1 << i))
+			printf(", %"PRIu64" %s", values[i] / count,
+			       perf_counter_events[i].name);
+
+	/* Instructions per cycle scaled by 100 for two decimals. */
+	if ((mask & (1 << PERF_COUNTER_CYCLES)) &&
+	    (mask & (1 << PERF_COUNTER_INSTRUCTIONS)) && cycles) {
+		ipc = instructions * 100 / cycles;
+		printf(" (%"PRIu64".%02"PRIu64" IPC)", ipc / 100, ipc % 100);
+	}
 }
 
 void perf_print(struct perf *perf, const char *step)
 {
 	uint64_t diff = timespec_diff(perf->before, perf->after) / 1000UL;
+	uint64_t values[PERF_COUNTERS_COUNT];
+	unsigned int i;
+
+	printf("+ Perf time for step %s: %"PRIu64" us", step, diff);
+
+	if (perf->counters_mask) {
+		for (i = 0; i < PERF_COUNTERS_COUNT; i++)
+			values[i] = perf->counters_after[i] -
+				    perf->counters_before[i];
+
+		perf_counters_print(perf->counters_mask, values, 1);
+	}
+
+	printf("\n");
+
+	if (perf_counters_enabled)
+		perf_stage_add(perf, step);
+}
 
-	printf("+ Perf time for step %s: %"PRIu64" us\n", step, diff);
+void perf_report(void)
+{
+	struct perf_stage *stage;
+	unsigned int i;
+
+	if (!perf_counters_enabled)
+		return;
+
+	pthread_mutex_lock(&perf_stages_lock);
+
+	for (i = 0; i < perf_stages_count; i++) {
+		stage = &perf_stages[i];
+
+		printf("Perf step %s: %u runs, mean %"PRIu64" us", stage->step,
+		       stage->count, stage->time / stage->count / 1000);
+		perf_counters_print(stage->counters_mask, stage->counters,
+				    stage->count);
+		printf("\n");
+	}
+
+	pthread_mutex_unlock(&perf_stages_lock);
+}
+
+void perf_histogram_add(struct perf_histogram *histogram, uint64_t duration)
+{
+	uint64_t duration_us = duration / 1000;
+	unsigned int bucket = 0;
+
+	while (duration_us > 1 && bucket < PERF_HISTOGRAM_SIZE - 1) {
+		duration_us >>= 1;
+		bucket++;
+	}
+
+	histogram->count++;
+	histogram->total += duration;
+	histogram->buckets[bucket]++;
+
+	if (duration > histogram->max)
+		histogram->max = duration;
+}
+
+void perf_histogram_print(struct perf_histogram *histogram)
+{
+	unsigned int i;
+
+	for (i = 0; i < PERF_HISTOGRAM_SIZE; i++)
+		if (histogram->buckets[i])
+			printf("  < %8u us: %u\n", 2U << i,
+			       histogram->buckets[i]);
 }
+
+#ifdef CONFIG_PERF_IOCTL
+
+/* Calls are accounted per request and file descriptor pair. */
+#define PERF_IOCTL_ENTRIES_MAX	64
+#define PERF_IOCTL_ERRORS_MAX	4
+
+#define PERF_IOCTL_NAME(request) \
+	{ request, #request }
+
+struct perf_ioctl_name {
+	unsigned long request;
+	const char *name;
+};
+
+struct perf_ioctl_error {
+	int code;
+	unsigned int count;
+};
+
+struct perf_ioctl_entry {
+	unsigned long request;
+	int fd;
+
+	unsigned int errors_count;
+	struct perf_ioctl_error errors[PERF_IOCTL_ERRORS_MAX];
+	struct perf_histogram histogram;
+
+	/* Calls made before streaming last started. */
+	unsigned int setup_count;
+};
+
+static const struct perf_ioctl_name perf_ioctl_names[] = {
+	PERF_IOCTL_NAME(VIDIOC_QUERYCAP),
+	PERF_IOCTL_NAME(VIDIOC_ENUM_FMT),
+	PERF_IOCTL_NAME(VIDIOC_ENUM_FRAMESIZES),
+	PERF_IOCTL_NAME(VIDIOC_ENUM_FRAMEINTERVALS),
+	PERF_IOCTL_NAME(VIDIOC_TRY_FMT),
+	PERF_IOCTL_NAME(VIDIOC_S_FMT),
+	PERF_IOCTL_NAME(VIDIOC_G_FMT),
+	PERF_IOCTL_NAME(VIDIOC_S_SELECTION),
+	PERF_IOCTL_NAME(VIDIOC_G_SELECTION),
+	PERF_IOCTL_NAME(VIDIOC_S_CTRL),
+	PERF_IOCTL_NAME(VIDIOC_G_CTRL),
+	PERF_IOCTL_NAME(VIDIOC_S_EXT_CTRLS),
+	PERF_IOCTL_NAME(VIDIOC_G_EXT_CTRLS),
+	PERF_IOCTL_NAME(VIDIOC_TRY_EXT_CTRLS),
+	PERF_IOCTL_NAME(VIDIOC_S_PARM),
+	PERF_IOCTL_NAME(VIDIOC_G_PARM),
+	PERF_IOCTL_NAME(VIDIOC_CREATE_BUFS),
+	PERF_IOCTL_NAME(VIDIOC_REQBUFS),
+	PERF_IOCTL_NAME(VIDIOC_QUERYBUF),
+	PERF_IOCTL_NAME(VIDIOC_QBUF),
+	PERF_IOCTL_NAME(VIDIOC_DQBUF),
+	PERF_IOCTL_NAME(VIDIOC_EXPBUF),
+	PERF_IOCTL_NAME(VIDIOC_STREAMON),
+	PERF_IOCTL_NAME(VIDIOC_STREAMOFF),
+	PERF_IOCTL_NAME(MEDIA_IOC_DEVICE_INFO),
+	PERF_IOCTL_NAME(MEDIA_IOC_G_TOPOLOGY),
+	PERF_IOCTL_NAME(MEDIA_IOC_REQUEST_ALLOC),
+	PERF_IOCTL_NAME(MEDIA_REQUEST_IOC_QUEUE),
+	PERF_IOCTL_NAME(MEDIA_REQUEST_IOC_REINIT),
+	PERF_IOCTL_NAME(DMA_BUF_IOCTL_SYNC),
+	PERF_IOCTL_NAME(DMA_HEAP_IOCTL_ALLOC),
+};
+
+static struct perf_ioctl_entry perf_ioctl_entries[PERF_IOCTL_ENTRIES_MAX];
+static unsigned int perf_ioctl_entries_count;
+static unsigned int perf_ioctl_entries_dropped;
+static pthread_mutex_t perf_ioctl_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *perf_ioctl_name(unsigned long request)
+{
+	unsigned int count = sizeof(perf_ioctl_names) /
+			     sizeof(perf_ioctl_names[0]);
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		if (perf_ioctl_names[i].request == request)
+			return perf_ioctl_names[i].name;
+
+	return NULL;
+}
+
+static struct perf_ioctl_entry *perf_ioctl_entry_find(int fd,
+						      unsigned long request)
+{
+	struct perf_ioctl_entry *entry;
+	unsigned int i;
+
+	for (i = 0; i < perf_ioctl_entries_count; i++) {
+		entry = &perf_ioctl_entries[i];
+		if (entry->fd == fd && entry->request == request)
+			return entry;
+	}
+
+	if (perf_ioctl_entries_count == PERF_IOCTL_ENTRIES_MAX)
+		return NULL;
+
+	entry = &perf_ioctl_entries[perf_ioctl_entries_count++];
+	entry->fd = fd;
+	entry->request = request;
+
+	return entry;
+}
+
+static void perf_ioctl_error_add(struct perf_ioctl_entry *entry, int code)
+{
+	unsigned int i;
+
+	entry->errors_count++;
+
+	/* Errors beyond the first few distinct codes are only counted. */
+	for (i = 0; i < PERF_IOCTL_ERRORS_MAX; i++) {
+		if (!entry->errors[i].count)
+			entry->errors[i].code = code;
+
+		if (entry->errors[i].code == code) {
+			entry->errors[i].count++;
+			break;
+		}
+	}
+}
+
+int perf_ioctl(int fd, unsigned long request, void *argument)
+{
+	struct perf_ioctl_entry *entry;
+	struct timespec before;
+	struct timespec after;
+	int error;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &before);
+	ret = ioctl(fd, request, argument);
+	error = errno;
+	clock_gettime(CLOCK_MONOTONIC, &after);
+
+	pthread_mutex_lock(&perf_ioctl_lock);
+
+	entry = perf_ioctl_entry_find(fd, request);
+	if (entry) {
+		perf_histogram_add(&entry->histogram,
+				   timespec_diff(before, after));
+
+		if (ret < 0)
+			perf_ioctl_error_add(entry, error);
+	} else {
+		perf_ioctl_entries_dropped++;
+	}
+
+	pthread_mutex_unlock(&perf_ioctl_lock);
+
+	errno = error;
+
+	return ret;
+}
+
+/* Calls made so far are accounted as setup, out of the frame budget. */
+void perf_ioctl_mark(void)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&perf_ioctl_lock);
+
+	for (i = 0; i < perf_ioctl_entries_count; i++)
+		perf_ioctl_entries[i].setup_count =
+			perf_ioctl_entries[i].histogram.count;
+
+	pthread_mutex_unlock(&perf_ioctl_lock);
+}
+
+void perf_ioctl_report(unsigned int frames_count)
+{
+	struct perf_ioctl_entry *entry;
+	struct perf_histogram *histogram;
+	unsigned int calls_total = 0;
+	unsigned int setup_total = 0;
+	unsigned int errors_total = 0;
+	unsigned int calls_frames;
+	const char *name;
+	unsigned int i, j;
+
+	pthread_mutex_lock(&perf_ioctl_lock);
+
+	for (i = 0; i < perf_ioctl_entries_count; i++) {
+		entry = &perf_ioctl_entries[i];
+		histogram = &entry->histogram;
+		name = perf_ioctl_name(entry->request);
+
+		if (name)
+			printf("Ioctl %s", name);
+		else
+			printf("Ioctl 0x%08lx", entry->request);
+
+		printf(" on fd %d: %u calls (%u setup), latency mean %"PRIu64
+		       " us max %"PRIu64" us\n", entry->fd, histogram->count,
+		       entry->setup_count,
+		       histogram->total / histogram->count / 1000,
+		       histogram->max / 1000);
+
+		for (j = 0; j < PERF_IOCTL_ERRORS_MAX; j++)
+			if (entry->errors[j].count)
+				printf("  error %s: %u\n",
+				       strerror(entry->errors[j].code),
+				       entry->errors[j].count);
+
+		perf_histogram_print(histogram);
+
+		calls_total += histogram->count;
+		setup_total += entry->setup_count;
+		errors_total += entry->errors_count;
+	}
+
+	calls_frames = calls_total - setup_total;
+
+	printf("Ioctls: %u calls, %u errors, %u for setup", calls_total,
+	       errors_total, setup_total);
+
+	/* Budget scaled by 100 for two decimals, once streaming. */
+	if (frames_count)
+		printf(", %u.%02u per frame over %u frames",
+		       calls_frames / frames_count,
+		       calls_frames * 100 / frames_count % 100, frames_count);
+
+	printf("\n");
+
+	if (perf_ioctl_entries_dropped)
+		printf("Ioctls: %u calls not accounted\n",
+		       perf_ioctl_entries_dropped);
+
+	pthread_mutex_unlock(&perf_ioctl_lock);
+}
+
+#endif
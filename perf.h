@@ -18,6 +18,8 @@
 #ifndef _PERF_H_
 #define _PERF_H_
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 
 #define timespec_ns(t) \
@@ -25,13 +27,59 @@
 #define timespec_diff(tb, ta) \
 	(timespec_ns(ta) - timespec_ns(tb))
 
+/* Latency histogram buckets, in powers of two microseconds. */
+#define PERF_HISTOGRAM_SIZE	24
+
+enum perf_counter {
+	PERF_COUNTER_CYCLES,
+	PERF_COUNTER_INSTRUCTIONS,
+	PERF_COUNTER_CACHE_MISSES,
+	PERF_COUNTER_PAGE_FAULTS,
+	PERF_COUNTERS_COUNT,
+};
+
 struct perf {
 	struct timespec before;
 	struct timespec after;
+
+	/* Mask of the counters read for the calling thread, if enabled. */
+	unsigned int counters_mask;
+	uint64_t counters_before[PERF_COUNTERS_COUNT];
+	uint64_t counters_after[PERF_COUNTERS_COUNT];
+};
+
+struct perf_histogram {
+	unsigned int count;
+	uint64_t total;
+	uint64_t max;
+	unsigned int buckets[PERF_HISTOGRAM_SIZE];
 };
 
 void perf_before(struct perf *perf);
 void perf_after(struct perf *perf);
 void perf_print(struct perf *perf, const char *step);
 
+void perf_counters_enable(void);
+void perf_report(void);
+
+void perf_histogram_add(struct perf_histogram *histogram, uint64_t duration);
+void perf_histogram_print(struct perf_histogram *histogram);
+
+/*
+ * Ioctl instrumentation is only built with CONFIG_PERF_IOCTL, otherwise
+ * wrappers call ioctl directly.
+ */
+#ifdef CONFIG_PERF_IOCTL
+int perf_ioctl(int fd, unsigned long request, void *argument);
+void perf_ioctl_mark(void);
+void perf_ioctl_report(unsigned int frames_count);
+#else
+#define perf_ioctl(fd, request, argument) \
+	ioctl(fd, request, argument)
+#define perf_ioctl_mark() \
+	do { } while (0)
+#define perf_ioctl_report(frames_count) \
+	do { } while (0)
+#endif
+
 #endif
@@ -0,0 +1,182 @@
+/*
+ * Copyright (C) 2024 Paul Kocialkowski <contact@paulk.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "ring.h"
+
+static void ring_futex_wait(atomic_uint *address, unsigned int value)
+{
+	/* Spurious wakeups and value changes are handled by the caller. */
+	syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static void ring_futex_wake(atomic_uint *address)
+{
+	syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+int ring_push(struct ring *ring, unsigned int value)
+{
+	unsigned int head;
+	unsigned int tail;
+
+	if (!ring)
+		return -EINVAL;
+
+	tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+	if (tail - head >= ring->size)
+		return -EAGAIN;
+
+	ring->entries[tail & ring->mask] = value;
+
+	/* Sequential consistency orders the store against the waiting flag. */
+	atomic_store(&ring->tail, tail + 1);
+
+	if (atomic_load(&ring->consumer_waiting))
+		ring_futex_wake(&ring->tail);
+
+	return 0;
+}
+
+int ring_push_wait(struct ring *ring, unsigned int value)
+{
+	unsigned int head;
+	unsigned int tail;
+	int ret;
+
+	while (1) {
+		ret = ring_push(ring, value);
+		if (ret != -EAGAIN)
+			return ret;
+
+		atomic_store(&ring->producer_waiting, 1);
+
+		tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		head = atomic_load(&ring->head);
+
+		if (tail - head >= ring->size)
+			ring_futex_wait(&ring->head, head);
+
+		atomic_store(&ring->producer_waiting, 0);
+	}
+}
+
+int ring_pop(struct ring *ring, unsigned int *value)
+{
+	unsigned int head;
+	unsigned int tail;
+
+	if (!ring || !value)
+		return -EINVAL;
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	if (head == tail)
+		return -EAGAIN;
+
+	*value = ring->entries[head & ring->mask];
+
+	atomic_store(&ring->head, head + 1);
+
+	if (atomic_load(&ring->producer_waiting))
+		ring_futex_wake(&ring->head);
+
+	return 0;
+}
+
+int ring_pop_wait(struct ring *ring, unsigned int *value)
+{
+	unsigned int head;
+	unsigned int tail;
+	int ret;
+
+	while (1) {
+		ret = ring_pop(ring, value);
+		if (ret != -EAGAIN)
+			return ret;
+
+		atomic_store(&ring->consumer_waiting, 1);
+
+		head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+		tail = atomic_load(&ring->tail);
+
+		if (head == tail)
+			ring_futex_wait(&ring->tail, tail);
+
+		atomic_store(&ring->consumer_waiting, 0);
+	}
+}
+
+unsigned int ring_count(struct ring *ring)
+{
+	unsigned int head;
+	unsigned int tail;
+
+	if (!ring)
+		return 0;
+
+	head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	return tail - head;
+}
+
+int ring_setup(struct ring *ring, unsigned int size)
+{
+	unsigned int size_pow2 = 1;
+
+	if (!ring || !size)
+		return -EINVAL;
+
+	while (size_pow2 < size)
+		size_pow2 <<= 1;
+
+	ring->entries = calloc(size_pow2, sizeof(*ring->entries));
+	if (!ring->entries)
+		return -ENOMEM;
+
+	ring->size = size_pow2;
+	ring->mask = size_pow2 - 1;
+
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->producer_waiting, 0);
+	atomic_init(&ring->consumer_waiting, 0);
+
+	return 0;
+}
+
+void ring_cleanup(struct ring *ring)
+{
+	if (!ring)
+		return;
+
+	if (ring->entries) {
+		free(ring->entries);
+		ring->entries = NULL;
+	}
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2024 Paul Kocialkowski <contact@paulk.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RING_H_
+#define _RING_H_
+
+#include <stdatomic.h>
+
+/*
+ * Bounded single-producer/single-consumer ring of unsigned integers.
+ * Push and pop are lock-free, waiting for space or entries uses a futex.
+ */
+
+struct ring {
+	unsigned int *entries;
+	unsigned int size;
+	unsigned int mask;
+
+	_Alignas(64) atomic_uint head;
+	atomic_uint producer_waiting;
+
+	_Alignas(64) atomic_uint tail;
+	atomic_uint consumer_waiting;
+};
+
+int ring_push(struct ring *ring, unsigned int value);
+int ring_push_wait(struct ring *ring, unsigned int value);
+int ring_pop(struct ring *ring, unsigned int *value);
+int ring_pop_wait(struct ring *ring, unsigned int *value);
+unsigned int ring_count(struct ring *ring);
+int ring_setup(struct ring *ring, unsigned int size);
+void ring_cleanup(struct ring *ring);
+
+#endif
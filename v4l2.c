@@ -25,10 +25,12 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
+#include <time.h>
 
 #include <linux/videodev2.h>
 #include <linux/media.h>
 
+#include "perf.h"
 #include "v4l2.h"
 
 /* Type */
@@ -60,7 +62,7 @@ unsigned int v4l2_type_base(unsigned int type)
 /* Capabilities */
 
 int v4l2_capabilities_probe(int video_fd, unsigned int *capabilities,
-			    char *driver, char *card)
+			    char *driver, char *card, char *bus_info)
 {
 	struct v4l2_capability capability = { 0 };
 	int ret;
@@ -68,7 +70,7 @@ int v4l2_capabilities_probe(int video_fd, unsigned int *capabilities,
 	if (!capabilities)
 		return -EINVAL;
 
-	ret = ioctl(video_fd, VIDIOC_QUERYCAP, &capability);
+	ret = perf_ioctl(video_fd, VIDIOC_QUERYCAP, &capability);
 	if (ret < 0)
 		return -errno;
 
@@ -83,6 +85,10 @@ int v4l2_capabilities_probe(int video_fd, unsigned int *capabilities,
 	if (card)
 		strncpy(card, capability.card, sizeof(capability.card));
 
+	if (bus_info)
+		strncpy(bus_info, capability.bus_info,
+			sizeof(capability.bus_info));
+
 	return 0;
 }
 
@@ -109,7 +115,7 @@ int v4l2_pixel_format_enum(int video_fd, unsigned int type, unsigned int index,
 	fmtdesc.type = type;
 	fmtdesc.index = index;
 
-	ret = ioctl(video_fd, VIDIOC_ENUM_FMT, &fmtdesc);
+	ret = perf_ioctl(video_fd, VIDIOC_ENUM_FMT, &fmtdesc);
 	if (ret)
 		return -errno;
 
@@ -145,6 +151,55 @@ bool v4l2_pixel_format_check(int video_fd, unsigned int type,
 	return false;
 }
 
+/* Frame Size */
+
+int v4l2_frame_size_enum(int video_fd, unsigned int pixel_format,
+			 unsigned int index,
+			 struct v4l2_frmsizeenum *frame_size)
+{
+	int ret;
+
+	if (!frame_size)
+		return -EINVAL;
+
+	memset(frame_size, 0, sizeof(*frame_size));
+
+	frame_size->index = index;
+	frame_size->pixel_format = pixel_format;
+
+	ret = perf_ioctl(video_fd, VIDIOC_ENUM_FRAMESIZES, frame_size);
+	if (ret)
+		return -errno;
+
+	return 0;
+}
+
+/* Frame Interval */
+
+int v4l2_frame_interval_enum(int video_fd, unsigned int pixel_format,
+			     unsigned int width, unsigned int height,
+			     unsigned int index,
+			     struct v4l2_frmivalenum *frame_interval)
+{
+	int ret;
+
+	if (!frame_interval)
+		return -EINVAL;
+
+	memset(frame_interval, 0, sizeof(*frame_interval));
+
+	frame_interval->index = index;
+	frame_interval->pixel_format = pixel_format;
+	frame_interval->width = width;
+	frame_interval->height = height;
+
+	ret = perf_ioctl(video_fd, VIDIOC_ENUM_FRAMEINTERVALS, frame_interval);
+	if (ret)
+		return -errno;
+
+	return 0;
+}
+
 /* Format */
 
 int v4l2_format_try(int video_fd, struct v4l2_format *format)
@@ -154,7 +209,7 @@ int v4l2_format_try(int video_fd, struct v4l2_format *format)
 	if (!format)
 		return -EINVAL;
 
-	ret = ioctl(video_fd, VIDIOC_TRY_FMT, format);
+	ret = perf_ioctl(video_fd, VIDIOC_TRY_FMT, format);
 	if (ret)
 		return -errno;
 
@@ -168,7 +223,7 @@ int v4l2_format_set(int video_fd, struct v4l2_format *format)
 	if (!format)
 		return -EINVAL;
 
-	ret = ioctl(video_fd, VIDIOC_S_FMT, format);
+	ret = perf_ioctl(video_fd, VIDIOC_S_FMT, format);
 	if (ret)
 		return -errno;
 
@@ -182,7 +237,7 @@ int v4l2_format_get(int video_fd, struct v4l2_format *format)
 	if (!format)
 		return -EINVAL;
 
-	ret = ioctl(video_fd, VIDIOC_G_FMT, format);
+	ret = perf_ioctl(video_fd, VIDIOC_G_FMT, format);
 	if (ret)
 		return -errno;
 
@@ -304,6 +359,30 @@ void v4l2_format_planes_count(struct v4l2_format *format,
 		*planes_count = 1;
 }
 
+void v4l2_format_bytesperline(struct v4l2_format *format,
+			      unsigned int plane_index,
+			      unsigned int *bytesperline)
+{
+	bool mplane_check;
+
+	if (!format || !bytesperline)
+		return;
+
+	mplane_check = v4l2_type_mplane_check(format->type);
+	if (mplane_check) {
+		if (plane_index >= format->fmt.pix_mp.num_planes)
+			return;
+
+		*bytesperline =
+			format->fmt.pix_mp.plane_fmt[plane_index].bytesperline;
+	} else {
+		if (plane_index > 0)
+			return;
+
+		*bytesperline = format->fmt.pix.bytesperline;
+	}
+}
+
 /* Selection */
 
 int v4l2_selection_set(int video_fd, struct v4l2_selection *selection)
@@ -313,7 +392,7 @@ int v4l2_selection_set(int video_fd, struct v4l2_selection *selection)
 	if (!selection)
 		return -EINVAL;
 
-	ret = ioctl(video_fd, VIDIOC_S_SELECTION, selection);
+	ret = perf_ioctl(video_fd, VIDIOC_S_SELECTION, selection);
 	if (ret)
 		return -errno;
 
@@ -327,7 +406,7 @@ int v4l2_selection_get(int video_fd, struct v4l2_selection *selection)
 	if (!selection)
 		return -EINVAL;
 
-	ret = ioctl(video_fd, VIDIOC_G_SELECTION, selection);
+	ret = perf_ioctl(video_fd, VIDIOC_G_SELECTION, selection);
 	if (ret)
 		return -errno;
 
@@ -368,7 +447,7 @@ int v4l2_control_set(int video_fd, struct v4l2_control *control)
 	if (!control)
 		return -EINVAL;
 
-	ret = ioctl(video_fd, VIDIOC_S_CTRL, control);
+	ret = perf_ioctl(video_fd, VIDIOC_S_CTRL, control);
 	if (ret)
 		return -errno;
 
@@ -382,7 +461,7 @@ int v4l2_control_get(int video_fd, struct v4l2_control *control)
 	if (!control)
 		return -EINVAL;
 
-	ret = ioctl(video_fd, VIDIOC_G_CTRL, control);
+	ret = perf_ioctl(video_fd, VIDIOC_G_CTRL, control);
 	if (ret)
 		return -errno;
 
@@ -424,7 +503,7 @@ int v4l2_ext_controls_set(int video_fd, struct v4l2_ext_controls *ext_controls)
 	if (!ext_controls)
 		return -EINVAL;
 
-	ret = ioctl(video_fd, VIDIOC_S_EXT_CTRLS, ext_controls);
+	ret = perf_ioctl(video_fd, VIDIOC_S_EXT_CTRLS, ext_controls);
 	if (ret)
 		return -errno;
 
@@ -438,7 +517,7 @@ int v4l2_ext_controls_get(int video_fd, struct v4l2_ext_controls *ext_controls)
 	if (!ext_controls)
 		return -EINVAL;
 
-	ret = ioctl(video_fd, VIDIOC_G_EXT_CTRLS, ext_controls);
+	ret = perf_ioctl(video_fd, VIDIOC_G_EXT_CTRLS, ext_controls);
 	if (ret)
 		return -errno;
 
@@ -452,7 +531,7 @@ int v4l2_ext_controls_try(int video_fd, struct v4l2_ext_controls *ext_controls)
 	if (!ext_controls)
 		return -EINVAL;
 
-	ret = ioctl(video_fd, VIDIOC_TRY_EXT_CTRLS, ext_controls);
+	ret = perf_ioctl(video_fd, VIDIOC_TRY_EXT_CTRLS, ext_controls);
 	if (ret)
 		return -errno;
 
@@ -524,6 +603,42 @@ void v4l2_parm_setup_base(struct v4l2_streamparm *streamparm, unsigned int type)
 	streamparm->type = type;
 }
 
+void v4l2_parm_setup_timeperframe(struct v4l2_streamparm *streamparm,
+				  unsigned int numerator,
+				  unsigned int denominator)
+{
+	struct v4l2_fract *timeperframe;
+
+	if (!streamparm)
+		return;
+
+	if (v4l2_type_base(streamparm->type) == V4L2_BUF_TYPE_VIDEO_OUTPUT)
+		timeperframe = &streamparm->parm.output.timeperframe;
+	else
+		timeperframe = &streamparm->parm.capture.timeperframe;
+
+	timeperframe->numerator = numerator;
+	timeperframe->denominator = denominator;
+}
+
+void v4l2_parm_timeperframe(struct v4l2_streamparm *streamparm,
+			    unsigned int *numerator,
+			    unsigned int *denominator)
+{
+	struct v4l2_fract *timeperframe;
+
+	if (!streamparm || !numerator || !denominator)
+		return;
+
+	if (v4l2_type_base(streamparm->type) == V4L2_BUF_TYPE_VIDEO_OUTPUT)
+		timeperframe = &streamparm->parm.output.timeperframe;
+	else
+		timeperframe = &streamparm->parm.capture.timeperframe;
+
+	*numerator = timeperframe->numerator;
+	*denominator = timeperframe->denominator;
+}
+
 int v4l2_parm_set(int video_fd, struct v4l2_streamparm *streamparm)
 {
 	int ret;
@@ -531,7 +646,7 @@ int v4l2_parm_set(int video_fd, struct v4l2_streamparm *streamparm)
 	if (!streamparm)
 		return -EINVAL;
 
-	ret = ioctl(video_fd, VIDIOC_S_PARM, streamparm);
+	ret = perf_ioctl(video_fd, VIDIOC_S_PARM, streamparm);
 	if (ret)
 		return -errno;
 
@@ -545,7 +660,7 @@ int v4l2_parm_get(int video_fd, struct v4l2_streamparm *streamparm)
 	if (!streamparm)
 		return -EINVAL;
 
-	ret = ioctl(video_fd, VIDIOC_G_PARM, streamparm);
+	ret = perf_ioctl(video_fd, VIDIOC_G_PARM, streamparm);
 	if (ret)
 		return -errno;
 
@@ -564,7 +679,7 @@ int v4l2_buffers_create(int video_fd, unsigned int type, unsigned int memory,
 	if (format) {
 		create_buffers.format = *format;
 	} else {
-		ret = ioctl(video_fd, VIDIOC_G_FMT, &create_buffers.format);
+		ret = perf_ioctl(video_fd, VIDIOC_G_FMT, &create_buffers.format);
 		if (ret)
 			return -errno;
 	}
@@ -573,7 +688,7 @@ int v4l2_buffers_create(int video_fd, unsigned int type, unsigned int memory,
 	create_buffers.memory = memory;
 	create_buffers.count = count;
 
-	ret = ioctl(video_fd, VIDIOC_CREATE_BUFS, &create_buffers);
+	ret = perf_ioctl(video_fd, VIDIOC_CREATE_BUFS, &create_buffers);
 	if (ret)
 		return -errno;
 
@@ -593,7 +708,7 @@ int v4l2_buffers_request(int video_fd, unsigned int type, unsigned int memory,
 	requestbuffers.memory = memory;
 	requestbuffers.count = count;
 
-	ret = ioctl(video_fd, VIDIOC_REQBUFS, &requestbuffers);
+	ret = perf_ioctl(video_fd, VIDIOC_REQBUFS, &requestbuffers);
 	if (ret)
 		return -errno;
 
@@ -620,7 +735,7 @@ int v4l2_buffers_capabilities_probe(int video_fd, unsigned int type,
 	create_buffers.memory = memory;
 	create_buffers.count = 0;
 
-	ret = ioctl(video_fd, VIDIOC_CREATE_BUFS, &create_buffers);
+	ret = perf_ioctl(video_fd, VIDIOC_CREATE_BUFS, &create_buffers);
 	if (ret)
 		return -errno;
 
@@ -641,7 +756,7 @@ int v4l2_buffer_query(int video_fd, struct v4l2_buffer *buffer)
 	if (!buffer)
 		return -EINVAL;
 
-	ret = ioctl(video_fd, VIDIOC_QUERYBUF, buffer);
+	ret = perf_ioctl(video_fd, VIDIOC_QUERYBUF, buffer);
 	if (ret)
 		return -errno;
 
@@ -655,7 +770,7 @@ int v4l2_buffer_queue(int video_fd, struct v4l2_buffer *buffer)
 	if (!buffer)
 		return -EINVAL;
 
-	ret = ioctl(video_fd, VIDIOC_QBUF, buffer);
+	ret = perf_ioctl(video_fd, VIDIOC_QBUF, buffer);
 	if (ret)
 		return -errno;
 
@@ -669,7 +784,7 @@ int v4l2_buffer_dequeue(int video_fd, struct v4l2_buffer *buffer)
 	if (!buffer)
 		return -EINVAL;
 
-	ret = ioctl(video_fd, VIDIOC_DQBUF, buffer);
+	ret = perf_ioctl(video_fd, VIDIOC_DQBUF, buffer);
 	if (ret)
 		return -errno;
 
@@ -700,7 +815,7 @@ int v4l2_buffer_export(int video_fd, struct v4l2_buffer *buffer,
 	exportbuffer.plane = plane_index;
 	exportbuffer.flags = flags;
 
-	ret = ioctl(video_fd, VIDIOC_EXPBUF, &exportbuffer);
+	ret = perf_ioctl(video_fd, VIDIOC_EXPBUF, &exportbuffer);
 	if (ret)
 		return -errno;
 
@@ -942,10 +1057,13 @@ int v4l2_stream_on(int video_fd, unsigned int type)
 {
 	int ret;
 
-	ret = ioctl(video_fd, VIDIOC_STREAMON, &type);
+	ret = perf_ioctl(video_fd, VIDIOC_STREAMON, &type);
 	if (ret)
 		return -errno;
 
+	/* Calls from here on are per-frame cost. */
+	perf_ioctl_mark();
+
 	return 0;
 }
 
@@ -953,7 +1071,7 @@ int v4l2_stream_off(int video_fd, unsigned int type)
 {
 	int ret;
 
-	ret = ioctl(video_fd, VIDIOC_STREAMOFF, &type);
+	ret = perf_ioctl(video_fd, VIDIOC_STREAMOFF, &type);
 	if (ret)
 		return -errno;
 
@@ -979,3 +1097,30 @@ int v4l2_poll(int video_fd, struct timeval *timeout)
 
 	return ret;
 }
+
+/* Poll without sleeping for up to duration us, zero when nothing came. */
+int v4l2_poll_spin(int video_fd, unsigned int duration)
+{
+	struct timespec start;
+	struct timespec now;
+	struct timeval timeout;
+	uint64_t elapsed;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	do {
+		timeout.tv_sec = 0;
+		timeout.tv_usec = 0;
+
+		ret = v4l2_poll(video_fd, &timeout);
+		if (ret)
+			return ret;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		elapsed = timespec_diff(start, now) / 1000UL;
+	} while (elapsed < duration);
+
+	return 0;
+}
@@ -31,7 +31,7 @@ unsigned int v4l2_type_base(unsigned int type);
 /* Capabilities */
 
 int v4l2_capabilities_probe(int video_fd, unsigned int *capabilities,
-			    char *driver, char *card);
+			    char *driver, char *card, char *bus_info);
 bool v4l2_capabilities_check(unsigned int capabilities_probed,
 			     unsigned int capabilities);
 
@@ -42,6 +42,19 @@ int v4l2_pixel_format_enum(int video_fd, unsigned int type, unsigned int index,
 bool v4l2_pixel_format_check(int video_fd, unsigned int type,
 			     unsigned int pixel_format);
 
+/* Frame Size */
+
+int v4l2_frame_size_enum(int video_fd, unsigned int pixel_format,
+			 unsigned int index,
+			 struct v4l2_frmsizeenum *frame_size);
+
+/* Frame Interval */
+
+int v4l2_frame_interval_enum(int video_fd, unsigned int pixel_format,
+			     unsigned int width, unsigned int height,
+			     unsigned int index,
+			     struct v4l2_frmivalenum *frame_interval);
+
 /* Format */
 
 int v4l2_format_try(int video_fd, struct v4l2_format *format);
@@ -59,6 +72,9 @@ void v4l2_format_pixel_format(struct v4l2_format *format,
 			      unsigned int *pixel_format);
 void v4l2_format_planes_count(struct v4l2_format *format,
 			      unsigned int *planes_count);
+void v4l2_format_bytesperline(struct v4l2_format *format,
+			      unsigned int plane_index,
+			      unsigned int *bytesperline);
 
 /* Selection */
 
@@ -100,6 +116,12 @@ int v4l2_parm_set(int video_fd, struct v4l2_streamparm *streamparm);
 int v4l2_parm_get(int video_fd, struct v4l2_streamparm *streamparm);
 void v4l2_parm_setup_base(struct v4l2_streamparm *streamparm,
 			  unsigned int type);
+void v4l2_parm_setup_timeperframe(struct v4l2_streamparm *streamparm,
+				  unsigned int numerator,
+				  unsigned int denominator);
+void v4l2_parm_timeperframe(struct v4l2_streamparm *streamparm,
+			    unsigned int *numerator,
+			    unsigned int *denominator);
 
 /* Buffers */
 
@@ -154,5 +176,6 @@ int v4l2_stream_off(int video_fd, unsigned int type);
 /* Poll */
 
 int v4l2_poll(int video_fd, struct timeval *timeout);
+int v4l2_poll_spin(int video_fd, unsigned int duration);
 
 #endif